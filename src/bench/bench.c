@@ -0,0 +1,592 @@
+/*
+  bench.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+
+/* standalone driver of the plugin on the stub core.
+
+   imgr_bench gen [-n frames] [-s WxH]... DIR
+       writes the synthetic corpus into DIR.
+   imgr_bench run [-t threads] [-r repeats] [-p proxy] [-a] [-m match] DIR
+       reads every sequence in DIR, or those whose name contains match,
+       and reports the time of probing them, reading the files alone, the
+       mean time of the stages of the frames from their props, and the
+       latency and throughput of the frames.
+   imgr_bench writers [-n iterations] [-r repeats] [-s seed]
+       checks the writers against a reference and times them.
+   imgr_bench prefetch [-d depth] [-t threads] [-m match] DIR
+       requests the frames of each sequence in several orders, as the
+       threads of the core would, and reports the prefetch hits and misses
+       from imgr.Stats. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "imagereader.h"
+#include "vsstub.h"
+#include "bench.h"
+
+#define BENCH_MAX_SIZES 8
+#define BENCH_MAX_SETS 256
+
+
+typedef struct {
+    int threads;
+    int repeats;
+    int proxy;
+    int alpha;
+    const char *match;
+} options_t;
+
+/* one numbered sequence of the corpus */
+typedef struct {
+    char prefix[FILENAME_MAX]; // name before -0000
+    char ext[16];
+    int frames;
+} sequence_t;
+
+typedef struct {
+    const VSAPI *vsapi;
+    stub_node_t *node;
+    int num_outputs;
+    int frames;
+    int jobs;
+    volatile int next_job;
+    int64_t *latency; // per job
+    volatile int64_t out_bytes;
+    volatile int64_t stage_ns[3]; // read, decode and write from the props
+    volatile int failed;
+} run_state_t;
+
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(((const sequence_t *)a)->prefix,
+                  ((const sequence_t *)b)->prefix);
+}
+
+
+static int compare_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static int file_exists(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0;
+}
+
+
+/* finds <prefix>-0000.<ext> in dir and counts the frames of each */
+static int find_sequences(const char *dir, const char *match,
+                          sequence_t *seqs)
+{
+    DIR *d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+    int num = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) && num < BENCH_MAX_SETS) {
+        char *p = strstr(de->d_name, "-0000.");
+        if (!p || strlen(p + 6) >= sizeof(seqs->ext) ||
+            (match && !strstr(de->d_name, match))) {
+            continue;
+        }
+        sequence_t *s = seqs + num++;
+        snprintf(s->prefix, sizeof(s->prefix), "%.*s",
+                 (int)(p - de->d_name), de->d_name);
+        strcpy(s->ext, p + 6);
+        for (s->frames = 1; ; s->frames++) {
+            char path[FILENAME_MAX * 2];
+            snprintf(path, sizeof(path), "%s/%s-%04d.%s", dir, s->prefix,
+                     s->frames, s->ext);
+            if (!file_exists(path)) {
+                break;
+            }
+        }
+    }
+    closedir(d);
+    qsort(seqs, num, sizeof(sequence_t), compare_names);
+    return num;
+}
+
+
+static int64_t frame_bytes(const VSAPI *vsapi, const VSFrameRef *f)
+{
+    const VSFormat *fi = vsapi->getFrameFormat(f);
+    int64_t bytes = 0;
+    for (int i = 0; i < fi->numPlanes; i++) {
+        bytes += (int64_t)vsapi->getFrameWidth(f, i) *
+                 vsapi->getFrameHeight(f, i) * fi->bytesPerSample;
+    }
+    return bytes;
+}
+
+
+static void *run_worker(void *arg)
+{
+    run_state_t *rs = (run_state_t *)arg;
+    const VSAPI *vsapi = rs->vsapi;
+    for (;;) {
+        int job = __sync_fetch_and_add(&rs->next_job, 1);
+        if (job >= rs->jobs) {
+            break;
+        }
+        int64_t start = imgr_now();
+        int64_t bytes = 0;
+        for (int index = 0; index < rs->num_outputs; index++) {
+            char err[256];
+            const VSFrameRef *f = stub_get_frame(rs->node, job % rs->frames,
+                                                 index, err, sizeof(err));
+            if (!f) {
+                if (__sync_fetch_and_add(&rs->failed, 1) == 0) {
+                    fprintf(stderr, "  frame %d: %s\n", job % rs->frames,
+                            err);
+                }
+                break;
+            }
+            bytes += frame_bytes(vsapi, f);
+            if (index == 0) {
+                static const char *keys[3] = {
+                    "_ImgrReadNs", "_ImgrDecodeNs", "_ImgrWriteNs"
+                };
+                const VSMap *props = vsapi->getFramePropsRO(f);
+                for (int i = 0; i < 3; i++) {
+                    int unset;
+                    int64_t ns = vsapi->propGetInt(props, keys[i], 0, &unset);
+                    __sync_fetch_and_add(&rs->stage_ns[i], unset ? 0 : ns);
+                }
+            }
+            vsapi->freeFrame(f);
+        }
+        rs->latency[job] = imgr_now() - start;
+        __sync_fetch_and_add(&rs->out_bytes, bytes);
+    }
+    return NULL;
+}
+
+
+static void run_sequence(const VSAPI *vsapi, const char *dir,
+                         const sequence_t *seq, const options_t *opt)
+{
+    char pattern[FILENAME_MAX * 2];
+    snprintf(pattern, sizeof(pattern), "%s/%s-%%04d.%s", dir, seq->prefix,
+             seq->ext);
+
+    /* file: reading the files alone, as a bound of the decoding */
+    uint8_t *buff = NULL;
+    size_t buff_size = 0;
+    int64_t in_bytes = 0;
+    int64_t start = imgr_now();
+    for (int n = 0; n < seq->frames; n++) {
+        char path[FILENAME_MAX * 2];
+        size_t size;
+        snprintf(path, sizeof(path), pattern, n);
+        if (imgr_read_file(path, &buff, &buff_size, &size)) {
+            fprintf(stderr, "%s: failed to read %s\n", seq->prefix, path);
+            free(buff);
+            return;
+        }
+        in_bytes += size;
+    }
+    int64_t read_ns = imgr_now() - start;
+    free(buff);
+
+    /* probing: creation of the filter */
+    VSMap *in = vsapi->newMap();
+    VSMap *out = vsapi->newMap();
+    vsapi->propSetData(in, "pattern", pattern, -1, paReplace);
+    vsapi->propSetInt(in, "last", seq->frames - 1, paReplace);
+    vsapi->propSetInt(in, "alpha", opt->alpha, paReplace);
+    vsapi->propSetInt(in, "proxy", opt->proxy, paReplace);
+    vsapi->propSetInt(in, "stats", 1, paReplace);
+    start = imgr_now();
+    stub_invoke("Read", in, out);
+    int64_t probe_ns = imgr_now() - start;
+    vsapi->freeMap(in);
+    if (vsapi->getError(out)) {
+        fprintf(stderr, "%s: %s\n", seq->prefix, vsapi->getError(out));
+        vsapi->freeMap(out);
+        return;
+    }
+
+    /* decoding: every frame repeats times on the worker threads */
+    run_state_t rs = { vsapi, stub_get_node(out), 0, seq->frames,
+                       seq->frames * opt->repeats, 0, NULL, 0, { 0 }, 0 };
+    vsapi->freeMap(out);
+    rs.num_outputs = stub_num_outputs(rs.node);
+    rs.latency = (int64_t *)calloc(rs.jobs, sizeof(int64_t));
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * opt->threads);
+    if (!rs.latency || !threads) {
+        fprintf(stderr, "failed to allocate bench state\n");
+        exit(1);
+    }
+    start = imgr_now();
+    int started = 1;
+    while (started < opt->threads &&
+           pthread_create(threads + started, NULL, run_worker, &rs) == 0) {
+        started++;
+    }
+    if (started < opt->threads) {
+        fprintf(stderr, "  started %d of %d threads\n", started,
+                opt->threads);
+    }
+    run_worker(&rs);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    int64_t decode_ns = imgr_now() - start;
+    stub_free_node(rs.node);
+
+    if (rs.failed == 0) {
+        qsort(rs.latency, rs.jobs, sizeof(int64_t), compare_ns);
+        double sec = decode_ns / 1e9;
+        printf("%-32s %6d %8.2f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f "
+               "%9.1f %9.1f %9.1f\n",
+               seq->prefix, seq->frames, probe_ns / 1e6,
+               read_ns / 1e6 / seq->frames, rs.stage_ns[0] / 1e6 / rs.jobs,
+               rs.stage_ns[1] / 1e6 / rs.jobs, rs.stage_ns[2] / 1e6 / rs.jobs,
+               rs.latency[rs.jobs / 2] / 1e6,
+               rs.latency[(rs.jobs * 99) / 100] / 1e6, rs.jobs / sec,
+               in_bytes * opt->repeats / sec / 1048576.0,
+               rs.out_bytes / sec / 1048576.0);
+    }
+    free(rs.latency);
+    free(threads);
+}
+
+
+/* percentiles of the stages of all frames by format from imgr.Stats */
+static void print_stats(const VSAPI *vsapi)
+{
+    static const char *stages[] = { "read", "decode", "write", "total" };
+    VSMap *in = vsapi->newMap();
+    VSMap *out = vsapi->newMap();
+    stub_invoke("Stats", in, out);
+    int err;
+    int num = vsapi->propNumElements(out, "percentiles");
+    printf("\n%-8s %-8s", "format", "stage");
+    for (int i = 0; i < num; i++) {
+        char label[16];
+        snprintf(label, sizeof(label), "p%d",
+                 (int)vsapi->propGetInt(out, "percentiles", i, &err));
+        printf(" %8s", label);
+    }
+    printf("\n");
+    for (int f = 0; f < vsapi->propNumElements(out, "formats"); f++) {
+        const char *format = vsapi->propGetData(out, "formats", f, &err);
+        for (int s = 0; s < 4; s++) {
+            char key[32];
+            snprintf(key, sizeof(key), "%s_%s_ns", format, stages[s]);
+            printf("%-8s %-8s", format, stages[s]);
+            for (int i = 0; i < num; i++) {
+                printf(" %8.3f", vsapi->propGetInt(out, key, i, &err) / 1e6);
+            }
+            printf("\n");
+        }
+    }
+    vsapi->freeMap(in);
+    vsapi->freeMap(out);
+}
+
+
+/* prefetch counts from imgr.Stats, which are cleared */
+static void take_prefetch_counts(const VSAPI *vsapi, int64_t *hits,
+                                 int64_t *misses)
+{
+    VSMap *in = vsapi->newMap();
+    VSMap *out = vsapi->newMap();
+    vsapi->propSetInt(in, "reset", 1, paReplace);
+    stub_invoke("Stats", in, out);
+    int err;
+    *hits = vsapi->propGetInt(out, "prefetch_hits", 0, &err);
+    *misses = vsapi->propGetInt(out, "prefetch_misses", 0, &err);
+    vsapi->freeMap(in);
+    vsapi->freeMap(out);
+}
+
+
+/* the frame requested i-th in the order, or -1. frames requested at once by
+   the threads of the core arrive in any order within the window. */
+static int order_frame(int order, int i, int frames, int window)
+{
+    int n;
+    switch (order) {
+    case 0: // forward
+        n = i;
+        break;
+    case 1: // backward
+        n = frames - 1 - i;
+        break;
+    case 2: // swapped: 1, 0, 3, 2, ...
+        n = i ^ 1;
+        break;
+    case 3: // each window backward
+        n = i - i % window + window - 1 - i % window;
+        break;
+    default: // every other frame, swapped
+        n = (i ^ 1) * 2;
+        break;
+    }
+    return n < frames ? n : -1;
+}
+
+
+static void prefetch_sequence(const VSAPI *vsapi, const char *dir,
+                              const sequence_t *seq, int depth, int window)
+{
+    static const char *orders[] = {
+        "forward", "backward", "swapped", "window", "stride2"
+    };
+    char pattern[FILENAME_MAX * 2];
+    snprintf(pattern, sizeof(pattern), "%s/%s-%%04d.%s", dir, seq->prefix,
+             seq->ext);
+    for (int order = 0; order < 5; order++) {
+        int64_t hits, misses;
+        take_prefetch_counts(vsapi, &hits, &misses);
+        VSMap *in = vsapi->newMap();
+        VSMap *out = vsapi->newMap();
+        vsapi->propSetData(in, "pattern", pattern, -1, paReplace);
+        vsapi->propSetInt(in, "last", seq->frames - 1, paReplace);
+        vsapi->propSetInt(in, "prefetch", depth, paReplace);
+        stub_invoke("Read", in, out);
+        vsapi->freeMap(in);
+        if (vsapi->getError(out)) {
+            fprintf(stderr, "%s: %s\n", seq->prefix, vsapi->getError(out));
+            vsapi->freeMap(out);
+            return;
+        }
+        stub_node_t *node = stub_get_node(out);
+        vsapi->freeMap(out);
+        for (int i = 0; i < seq->frames; i++) {
+            int n = order_frame(order, i, seq->frames, window);
+            if (n < 0) {
+                continue;
+            }
+            char err[256];
+            const VSFrameRef *f = stub_get_frame(node, n, 0, err, sizeof(err));
+            if (!f) {
+                fprintf(stderr, "  frame %d: %s\n", n, err);
+                break;
+            }
+            vsapi->freeFrame(f);
+        }
+        stub_free_node(node);
+        take_prefetch_counts(vsapi, &hits, &misses);
+        printf("%-32s %-8s %6d %6d\n", seq->prefix, orders[order],
+               (int)hits, (int)misses);
+    }
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: imgr_bench gen [-n frames] [-s WxH]... DIR\n"
+            "       imgr_bench run [-t threads] [-r repeats] [-p proxy] "
+            "[-a] [-m match] DIR\n"
+            "       imgr_bench writers [-n iterations] [-r repeats] "
+            "[-s seed]\n"
+            "       imgr_bench prefetch [-d depth] [-t threads] [-m match] "
+            "DIR\n");
+    exit(2);
+}
+
+
+static int generate(int argc, char **argv)
+{
+    int sizes[BENCH_MAX_SIZES * 2] = { 640, 360, 1920, 1080 };
+    int num_sizes = 0;
+    int frames = 8;
+    int c;
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        case 's':
+            if (num_sizes == BENCH_MAX_SIZES ||
+                sscanf(optarg, "%dx%d", sizes + num_sizes * 2,
+                       sizes + num_sizes * 2 + 1) != 2 ||
+                sizes[num_sizes * 2] < 1 || sizes[num_sizes * 2 + 1] < 1) {
+                usage();
+            }
+            num_sizes++;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || frames < 1) {
+        usage();
+    }
+    if (num_sizes == 0) {
+        num_sizes = 2;
+    }
+    return bench_generate(argv[optind], sizes, num_sizes, frames) ? 1 : 0;
+}
+
+
+static int run(int argc, char **argv)
+{
+    options_t opt = { 0, 1, 1, 0, NULL };
+    int c;
+    while ((c = getopt(argc, argv, "t:r:p:am:")) != -1) {
+        switch (c) {
+        case 't':
+            opt.threads = atoi(optarg);
+            break;
+        case 'r':
+            opt.repeats = atoi(optarg);
+            break;
+        case 'p':
+            opt.proxy = atoi(optarg);
+            break;
+        case 'a':
+            opt.alpha = 1;
+            break;
+        case 'm':
+            opt.match = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || opt.threads < 0 || opt.repeats < 1) {
+        usage();
+    }
+    if (opt.threads == 0) {
+        opt.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (opt.threads < 1) {
+            opt.threads = 1;
+        }
+    }
+    const char *dir = argv[optind];
+
+    static sequence_t seqs[BENCH_MAX_SETS];
+    int num = find_sequences(dir, opt.match, seqs);
+    if (num < 0) {
+        fprintf(stderr, "failed to open %s\n", dir);
+        return 1;
+    }
+    if (num == 0) {
+        fprintf(stderr, "no sequence in %s\n", dir);
+        return 1;
+    }
+
+    const VSAPI *vsapi = stub_init(opt.threads);
+    printf("threads %d, repeats %d, proxy %d, alpha %d, times in ms\n", opt.threads,
+           opt.repeats, opt.proxy, opt.alpha);
+    printf("%-32s %6s %8s %8s %8s %8s %8s %8s %8s %9s %9s %9s\n",
+           "sequence", "frames", "probe", "file", "read", "decode", "write",
+           "p50", "p99", "fps", "in MB/s", "out MB/s");
+    for (int i = 0; i < num; i++) {
+        run_sequence(vsapi, dir, seqs + i, &opt);
+    }
+    print_stats(vsapi);
+    return 0;
+}
+
+
+static int prefetch(int argc, char **argv)
+{
+    int depth = 4;
+    int threads = 4;
+    const char *match = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "d:t:m:")) != -1) {
+        switch (c) {
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'm':
+            match = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || depth < 1 || threads < 1) {
+        usage();
+    }
+    const char *dir = argv[optind];
+
+    static sequence_t seqs[BENCH_MAX_SETS];
+    int num = find_sequences(dir, match, seqs);
+    if (num < 1) {
+        fprintf(stderr, "no sequence in %s\n", dir);
+        return 1;
+    }
+
+    /* the requests are made by this thread, in the orders of a core with
+       threads threads */
+    const VSAPI *vsapi = stub_init(threads);
+    printf("depth %d, threads %d\n", depth, threads);
+    printf("%-32s %-8s %6s %6s\n", "sequence", "order", "hits", "misses");
+    for (int i = 0; i < num; i++) {
+        prefetch_sequence(vsapi, dir, seqs + i, depth, threads);
+    }
+    return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage();
+    }
+    if (!strcmp(argv[1], "gen")) {
+        return generate(argc - 1, argv + 1);
+    }
+    if (!strcmp(argv[1], "run")) {
+        return run(argc - 1, argv + 1);
+    }
+    if (!strcmp(argv[1], "prefetch")) {
+        return prefetch(argc - 1, argv + 1);
+    }
+    if (!strcmp(argv[1], "writers")) {
+        int ret = bench_writers(argc - 1, argv + 1);
+        if (ret < 0) {
+            usage();
+        }
+        return ret;
+    }
+    usage();
+    return 2;
+}
@@ -0,0 +1,41 @@
+/*
+  bench.h
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+
+#ifndef VS_IMGR_BENCH_H
+#define VS_IMGR_BENCH_H
+
+#include <stdint.h>
+
+/* writes frames images of every format and kind into dir at each size.
+   sizes holds num_sizes pairs of width and height. */
+int bench_generate(const char *dir, const int *sizes, int num_sizes,
+                   int frames);
+
+/* verifies and times the writers. returns 1 on mismatch, -1 on bad
+   arguments. */
+int bench_writers(int argc, char **argv);
+
+#endif
@@ -0,0 +1,566 @@
+/*
+  corpus.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+/* synthetic corpus: numbered sequences of BMP, JPEG, PNG and TGA images
+   named <format>-<kind>-<width>x<height>-<number>.<ext>. the frames are
+   gradients with moving shapes and some noise, so that they compress
+   about as well as real footage. PNG is written here with zlib, so that
+   the corpus doesn't depend on the png backend. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "zlib.h"
+#include "turbojpeg.h"
+
+#include "bench.h"
+
+#define PNG_SPLIT_SEGMENTS 8
+
+
+typedef struct {
+    int width;
+    int height;
+    uint8_t *rgba; // 4 bytes per pixel, top row first
+    uint16_t *rgba16;
+} picture_t;
+
+typedef int (*func_write_kind)(const char *path, const picture_t *pic,
+                               int kind);
+
+typedef struct {
+    const char *format;
+    const char *ext;
+    func_write_kind write;
+    const char *kinds[8];
+} format_t;
+
+
+static inline uint32_t next_random(uint32_t *state)
+{
+    *state = *state * 1664525 + 1013904223;
+    return *state >> 16;
+}
+
+
+static void make_picture(picture_t *pic, int frame)
+{
+    uint32_t state = 12345 + frame;
+    int w = pic->width;
+    int h = pic->height;
+    int cx = (w / 4 + frame * 7) % w;
+    int cy = (h / 3 + frame * 5) % h;
+    int r2 = (w < h ? w : h) / 5 * ((w < h ? w : h) / 5);
+    for (int y = 0; y < h; y++) {
+        uint8_t *p = pic->rgba + (size_t)y * w * 4;
+        uint16_t *p16 = pic->rgba16 + (size_t)y * w * 4;
+        for (int x = 0; x < w; x++) {
+            int dx = x - cx;
+            int dy = y - cy;
+            int inside = dx * dx + dy * dy < r2;
+            int noise = next_random(&state) & 7;
+            int v[4];
+            v[0] = ((x * 255 / w) + noise + (inside ? 96 : 0)) & 0xFF;
+            v[1] = ((y * 255 / h) + noise) & 0xFF;
+            v[2] = inside ? 200 + noise : ((x + y + frame) & 0x3F) + noise;
+            v[3] = inside ? 255 : (x * 255 / w);
+            for (int c = 0; c < 4; c++) {
+                p[x * 4 + c] = v[c];
+                p16[x * 4 + c] = (v[c] << 8) | (next_random(&state) & 0xFF);
+            }
+        }
+    }
+}
+
+
+static inline uint8_t to_gray(const uint8_t *p)
+{
+    return (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+}
+
+
+static inline uint8_t to_index(const uint8_t *p)
+{
+    return (p[0] & 0xE0) | ((p[1] >> 3) & 0x1C) | (p[2] >> 6);
+}
+
+
+static void put_le16(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+
+/* growing output buffer, written to the file at once */
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} out_buff_t;
+
+static uint8_t *reserve(out_buff_t *ob, size_t size)
+{
+    if (ob->size + size > ob->capacity) {
+        size_t capacity = (ob->size + size) * 2;
+        uint8_t *data = (uint8_t *)realloc(ob->data, capacity);
+        if (!data) {
+            abort();
+        }
+        ob->data = data;
+        ob->capacity = capacity;
+    }
+    uint8_t *p = ob->data + ob->size;
+    ob->size += size;
+    return p;
+}
+
+
+static void put_byte(out_buff_t *ob, uint8_t v)
+{
+    *reserve(ob, 1) = v;
+}
+
+
+static int save(const char *path, out_buff_t *ob)
+{
+    FILE *fp = fopen(path, "wb");
+    int ret = !fp || fwrite(ob->data, 1, ob->size, fp) != ob->size;
+    if (fp && fclose(fp)) {
+        ret = 1;
+    }
+    free(ob->data);
+    return ret ? -1 : 0;
+}
+
+
+/* BMP: 24bit, 32bit, 8bit color-mapped and RLE8 */
+enum { BMP_RGB24, BMP_RGB32, BMP_PAL8, BMP_RLE8 };
+
+static int write_bmp(const char *path, const picture_t *pic, int kind)
+{
+    static const int bits[] = { 24, 32, 8, 8 };
+    int w = pic->width;
+    int h = pic->height;
+    int row_size = ((w * bits[kind] + 31) & ~31) / 8;
+    int palette = bits[kind] == 8 ? 256 * 4 : 0;
+    out_buff_t ob = { NULL, 0, 0 };
+    uint8_t *hdr = reserve(&ob, 54 + palette);
+    memset(hdr, 0, 54);
+    hdr[0] = 'B';
+    hdr[1] = 'M';
+    put_le32(hdr + 10, 54 + palette);
+    put_le32(hdr + 14, 40);
+    put_le32(hdr + 18, w);
+    put_le32(hdr + 22, h);
+    put_le16(hdr + 26, 1);
+    put_le16(hdr + 28, bits[kind]);
+    put_le32(hdr + 30, kind == BMP_RLE8 ? 1 : 0);
+    for (int i = 0; i < palette / 4; i++) {
+        uint8_t *p = hdr + 54 + i * 4;
+        p[0] = (i & 3) * 85;
+        p[1] = ((i >> 2) & 7) * 36;
+        p[2] = (i >> 5) * 36;
+        p[3] = 0;
+    }
+
+    for (int y = h - 1; y >= 0; y--) {
+        const uint8_t *srcp = pic->rgba + (size_t)y * w * 4;
+        if (kind == BMP_RLE8) {
+            for (int x = 0; x < w;) {
+                uint8_t index = to_index(srcp + x * 4);
+                int run = 1;
+                while (x + run < w && run < 255 &&
+                       to_index(srcp + (x + run) * 4) == index) {
+                    run++;
+                }
+                put_byte(&ob, run);
+                put_byte(&ob, index);
+                x += run;
+            }
+            put_byte(&ob, 0);
+            put_byte(&ob, y == 0 ? 1 : 0);
+            continue;
+        }
+        uint8_t *dstp = reserve(&ob, row_size);
+        memset(dstp, 0, row_size);
+        for (int x = 0; x < w; x++) {
+            const uint8_t *s = srcp + x * 4;
+            switch (kind) {
+            case BMP_RGB24:
+                dstp[x * 3] = s[2];
+                dstp[x * 3 + 1] = s[1];
+                dstp[x * 3 + 2] = s[0];
+                break;
+            case BMP_RGB32:
+                dstp[x * 4] = s[2];
+                dstp[x * 4 + 1] = s[1];
+                dstp[x * 4 + 2] = s[0];
+                dstp[x * 4 + 3] = s[3];
+                break;
+            default:
+                dstp[x] = to_index(s);
+            }
+        }
+    }
+    put_le32(ob.data + 2, ob.size);
+    put_le32(ob.data + 34, ob.size - 54 - palette);
+    return save(path, &ob);
+}
+
+
+/* TGA: 24bit, 32bit, 8bit gray and RLE 24bit, top-left origin */
+enum { TGA_RGB24, TGA_RGB32, TGA_GRAY8, TGA_RLE24 };
+
+static int write_tga(const char *path, const picture_t *pic, int kind)
+{
+    static const int bytes[] = { 3, 4, 1, 3 };
+    static const int types[] = { 2, 2, 3, 10 };
+    int w = pic->width;
+    int h = pic->height;
+    int bpp = bytes[kind];
+    out_buff_t ob = { NULL, 0, 0 };
+    uint8_t *hdr = reserve(&ob, 18);
+    memset(hdr, 0, 18);
+    hdr[2] = types[kind];
+    put_le16(hdr + 12, w);
+    put_le16(hdr + 14, h);
+    hdr[16] = bpp * 8;
+    hdr[17] = 0x20 | (bpp == 4 ? 8 : 0);
+
+    uint8_t *row = (uint8_t *)malloc((size_t)w * bpp);
+    if (!row) {
+        abort();
+    }
+    for (int y = 0; y < h; y++) {
+        const uint8_t *srcp = pic->rgba + (size_t)y * w * 4;
+        for (int x = 0; x < w; x++) {
+            const uint8_t *s = srcp + x * 4;
+            uint8_t *d = row + x * bpp;
+            if (bpp == 1) {
+                d[0] = to_gray(s);
+                continue;
+            }
+            d[0] = s[2];
+            d[1] = s[1];
+            d[2] = s[0];
+            if (bpp == 4) {
+                d[3] = s[3];
+            }
+        }
+        if (kind != TGA_RLE24) {
+            memcpy(reserve(&ob, (size_t)w * bpp), row, (size_t)w * bpp);
+            continue;
+        }
+        /* runs of 2 or more pixels are run-length packets */
+        for (int x = 0; x < w;) {
+            int run = 1;
+            while (x + run < w && run < 128 &&
+                   !memcmp(row + x * 3, row + (x + run) * 3, 3)) {
+                run++;
+            }
+            if (run > 1) {
+                put_byte(&ob, 0x80 | (run - 1));
+                memcpy(reserve(&ob, 3), row + x * 3, 3);
+                x += run;
+                continue;
+            }
+            int raw = 1;
+            while (x + raw < w && raw < 128 &&
+                   (x + raw + 1 >= w ||
+                    memcmp(row + (x + raw) * 3, row + (x + raw + 1) * 3, 3))) {
+                raw++;
+            }
+            put_byte(&ob, raw - 1);
+            memcpy(reserve(&ob, raw * 3), row + x * 3, raw * 3);
+            x += raw;
+        }
+    }
+    free(row);
+    return save(path, &ob);
+}
+
+
+/* PNG: filtered with the minimum sum of absolute differences, as libpng
+   does by default. split images carry an iDOT index, and the first rows
+   of their segments use only None or Sub. */
+enum { PNG_GRAY8, PNG_GRAY16, PNG_RGB24, PNG_RGBA32, PNG_RGB48, PNG_PAL8,
+       PNG_RGBA32_SPLIT };
+
+static void png_chunk(out_buff_t *ob, const char *type, const uint8_t *data,
+                      size_t size)
+{
+    uint8_t *p = reserve(ob, size + 12);
+    put_be32(p, size);
+    memcpy(p + 4, type, 4);
+    if (size) {
+        memcpy(p + 8, data, size);
+    }
+    put_be32(p + 8 + size, crc32(0, p + 4, size + 4));
+}
+
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+
+static void filter_row(const uint8_t *row, const uint8_t *prev, size_t size,
+                       int bpp, int allowed, uint8_t *dstp)
+{
+    uint8_t *tmp = dstp + size + 1;
+    uint32_t best = UINT32_MAX;
+    for (int f = 0; f < allowed; f++) {
+        uint32_t sum = 0;
+        for (size_t i = 0; i < size; i++) {
+            int a = i < (size_t)bpp ? 0 : row[i - bpp];
+            int b = prev ? prev[i] : 0;
+            int c = prev && i >= (size_t)bpp ? prev[i - bpp] : 0;
+            int pred = f == 0 ? 0 : f == 1 ? a : f == 2 ? b :
+                       f == 3 ? (a + b) >> 1 : paeth(a, b, c);
+            tmp[i] = row[i] - pred;
+            sum += tmp[i] < 128 ? tmp[i] : 256 - tmp[i];
+        }
+        if (sum < best) {
+            best = sum;
+            dstp[0] = f;
+            memcpy(dstp + 1, tmp, size);
+        }
+    }
+}
+
+
+static int write_png(const char *path, const picture_t *pic, int kind)
+{
+    static const int channels[] = { 1, 1, 3, 4, 3, 1, 4 };
+    static const int depths[] = { 8, 16, 8, 8, 16, 8, 8 };
+    static const int colors[] = { 0, 0, 2, 6, 2, 3, 6 };
+    int w = pic->width;
+    int h = pic->height;
+    int bpp = channels[kind] * depths[kind] / 8;
+    size_t size = (size_t)w * bpp;
+    int segments = kind == PNG_RGBA32_SPLIT ? PNG_SPLIT_SEGMENTS : 1;
+    if (segments > h) {
+        segments = h;
+    }
+
+    /* the compressed data of each segment ends on a full flush */
+    out_buff_t zdata[PNG_SPLIT_SEGMENTS];
+    memset(zdata, 0, sizeof(zdata));
+    uint8_t *rows = (uint8_t *)malloc(size * 2);
+    uint8_t *filtered = (uint8_t *)malloc(size * 2 + 1);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (!rows || !filtered ||
+        deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        abort();
+    }
+    for (int seg = 0; seg < segments; seg++) {
+        int top = h * seg / segments;
+        int bottom = h * (seg + 1) / segments;
+        for (int y = top; y < bottom; y++) {
+            uint8_t *row = rows + (y & 1) * size;
+            const uint8_t *srcp = pic->rgba + (size_t)y * w * 4;
+            const uint16_t *src16 = pic->rgba16 + (size_t)y * w * 4;
+            for (int x = 0; x < w; x++) {
+                switch (kind) {
+                case PNG_GRAY8:
+                    row[x] = to_gray(srcp + x * 4);
+                    break;
+                case PNG_GRAY16:
+                    row[x * 2] = src16[x * 4] >> 8;
+                    row[x * 2 + 1] = src16[x * 4];
+                    break;
+                case PNG_PAL8:
+                    row[x] = to_index(srcp + x * 4);
+                    break;
+                case PNG_RGB48:
+                    for (int c = 0; c < 3; c++) {
+                        row[x * 6 + c * 2] = src16[x * 4 + c] >> 8;
+                        row[x * 6 + c * 2 + 1] = src16[x * 4 + c];
+                    }
+                    break;
+                default:
+                    memcpy(row + x * bpp, srcp + x * 4, bpp);
+                }
+            }
+            const uint8_t *prev = y == 0 ? NULL : rows + ((y - 1) & 1) * size;
+            int allowed = y == top && y > 0 ? 2 : kind == PNG_PAL8 ? 1 : 5;
+            filter_row(row, prev, size, bpp, allowed, filtered);
+
+            int flush = y < bottom - 1 ? Z_NO_FLUSH :
+                        seg < segments - 1 ? Z_FULL_FLUSH : Z_FINISH;
+            zs.next_in = filtered;
+            zs.avail_in = size + 1;
+            do {
+                size_t room = deflateBound(&zs, size + 1) + 64;
+                zs.next_out = reserve(zdata + seg, room);
+                zs.avail_out = room;
+                deflate(&zs, flush);
+                zdata[seg].size -= zs.avail_out;
+            } while (zs.avail_out == 0);
+        }
+    }
+    deflateEnd(&zs);
+    free(rows);
+    free(filtered);
+
+    out_buff_t ob = { NULL, 0, 0 };
+    memcpy(reserve(&ob, 8), "\x89PNG\r\n\x1a\n", 8);
+    uint8_t ihdr[13];
+    put_be32(ihdr, w);
+    put_be32(ihdr + 4, h);
+    ihdr[8] = depths[kind];
+    ihdr[9] = colors[kind];
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    png_chunk(&ob, "IHDR", ihdr, 13);
+    if (kind == PNG_PAL8) {
+        uint8_t plte[256 * 3];
+        for (int i = 0; i < 256; i++) {
+            plte[i * 3] = (i >> 5) * 36;
+            plte[i * 3 + 1] = ((i >> 2) & 7) * 36;
+            plte[i * 3 + 2] = (i & 3) * 85;
+        }
+        png_chunk(&ob, "PLTE", plte, sizeof(plte));
+    }
+    if (segments > 1) {
+        /* offsets are from the length field of iDOT */
+        uint8_t idot[4 * (3 + 2 * PNG_SPLIT_SEGMENTS)];
+        size_t idot_size = 4 * (3 + 2 * segments);
+        size_t offset = idot_size + 12;
+        put_be32(idot, segments);
+        put_be32(idot + 4, 0);
+        put_be32(idot + 8, h / segments);
+        put_be32(idot + 12, offset);
+        for (int seg = 0; seg < segments; seg++) {
+            put_be32(idot + 16 + seg * 4,
+                     h * (seg + 1) / segments - h * seg / segments);
+            if (seg > 0) {
+                put_be32(idot + 16 + (segments + seg - 1) * 4, offset);
+            }
+            offset += zdata[seg].size + 12;
+        }
+        png_chunk(&ob, "iDOT", idot, idot_size);
+    }
+    for (int seg = 0; seg < segments; seg++) {
+        png_chunk(&ob, "IDAT", zdata[seg].data, zdata[seg].size);
+        free(zdata[seg].data);
+    }
+    png_chunk(&ob, "IEND", NULL, 0);
+    return save(path, &ob);
+}
+
+
+/* JPEG: 4:4:4, 4:2:2, 4:2:0 and gray at quality 90 */
+static int write_jpeg(const char *path, const picture_t *pic, int kind)
+{
+    static const int subsamples[] = { TJSAMP_444, TJSAMP_422, TJSAMP_420,
+                                      TJSAMP_GRAY };
+    tjhandle tjh = tjInitCompress();
+    if (!tjh) {
+        return -1;
+    }
+    unsigned char *jpeg = NULL;
+    unsigned long size = 0;
+    int ret = tjCompress2(tjh, pic->rgba, pic->width, pic->width * 4,
+                          pic->height, TJPF_RGBX, &jpeg, &size,
+                          subsamples[kind], 90, 0);
+    tjDestroy(tjh);
+    if (ret) {
+        return -1;
+    }
+    out_buff_t ob = { NULL, 0, 0 };
+    memcpy(reserve(&ob, size), jpeg, size);
+    tjFree(jpeg);
+    return save(path, &ob);
+}
+
+
+static const format_t corpus_formats[] = {
+    { "bmp", "bmp", write_bmp, { "rgb24", "rgb32", "pal8", "rle8" } },
+    { "jpeg", "jpg", write_jpeg, { "444", "422", "420", "gray" } },
+    { "png", "png", write_png, { "gray8", "gray16", "rgb24", "rgba32",
+                                 "rgb48", "pal8", "rgba32split" } },
+    { "tga", "tga", write_tga, { "rgb24", "rgb32", "gray8", "rle24" } },
+};
+
+
+int bench_generate(const char *dir, const int *sizes, int num_sizes,
+                   int frames)
+{
+    for (int i = 0; i < num_sizes; i++) {
+        picture_t pic = { sizes[i * 2], sizes[i * 2 + 1], NULL, NULL };
+        pic.rgba = (uint8_t *)malloc((size_t)pic.width * pic.height * 4);
+        pic.rgba16 = (uint16_t *)malloc((size_t)pic.width * pic.height * 8);
+        if (!pic.rgba || !pic.rgba16) {
+            fprintf(stderr, "failed to allocate %dx%d picture\n",
+                    pic.width, pic.height);
+            return -1;
+        }
+        for (int n = 0; n < frames; n++) {
+            make_picture(&pic, n);
+            for (size_t f = 0; f < sizeof(corpus_formats) / sizeof(format_t);
+                 f++) {
+                const format_t *fmt = corpus_formats + f;
+                for (int k = 0; k < 8 && fmt->kinds[k]; k++) {
+                    char path[FILENAME_MAX];
+                    snprintf(path, sizeof(path), "%s/%s-%s-%dx%d-%04d.%s",
+                             dir, fmt->format, fmt->kinds[k], pic.width,
+                             pic.height, n, fmt->ext);
+                    if (fmt->write(path, &pic, k)) {
+                        fprintf(stderr, "failed to write %s\n", path);
+                        return -1;
+                    }
+                }
+            }
+        }
+        free(pic.rgba);
+        free(pic.rgba16);
+    }
+    return 0;
+}
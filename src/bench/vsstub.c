@@ -0,0 +1,626 @@
+/*
+  vsstub.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "vsstub.h"
+
+#define STUB_MAX_FUNCS 16
+#define STUB_KEY_LENGTH 64
+#define STUB_ALIGN 32
+
+/* types returned by propGetType */
+#define TYPE_UNSET 'u'
+#define TYPE_INT   'i'
+#define TYPE_DATA  's'
+#define TYPE_NODE  'c'
+
+
+/* one key of a map. the elements are ints, data, frames or nodes. */
+typedef struct {
+    char key[STUB_KEY_LENGTH];
+    char type;
+    int num;
+    int64_t *ints;
+    char **data;
+    int *sizes;
+    void **ptrs;
+} map_entry_t;
+
+struct VSMap {
+    map_entry_t *entries;
+    int num;
+    char *error;
+};
+
+struct VSFrameRef {
+    const VSFormat *format;
+    int width[3];
+    int height[3];
+    int stride[3];
+    uint8_t *data[3];
+    void *alloc[3];
+    VSMap *props;
+    int refs;
+};
+
+struct VSFrameContext {
+    int index;
+    char *error;
+};
+
+struct stub_node {
+    VSFilterGetFrame get_frame;
+    VSFilterFree free;
+    void *instance_data;
+    VSVideoInfo vi[2];
+    int num_outputs;
+};
+
+struct VSCore {
+    VSCoreInfo info;
+    struct {
+        char name[STUB_KEY_LENGTH];
+        VSPublicFunction func;
+        void *data;
+    } funcs[STUB_MAX_FUNCS];
+    int num_funcs;
+};
+
+static VSCore stub_core_inst;
+static VSAPI stub_api;
+static int stub_stride_pad; // samples after the rows, 0 to align them
+
+
+static const VSFormat formats[] = {
+    { "Gray8",    pfGray8,    cmGray, stInteger,  8, 1, 0, 0, 1 },
+    { "Gray16",   pfGray16,   cmGray, stInteger, 16, 2, 0, 0, 1 },
+    { "YUV420P8", pfYUV420P8, cmYUV,  stInteger,  8, 1, 1, 1, 3 },
+    { "YUV422P8", pfYUV422P8, cmYUV,  stInteger,  8, 1, 1, 0, 3 },
+    { "YUV444P8", pfYUV444P8, cmYUV,  stInteger,  8, 1, 0, 0, 3 },
+    { "YUV410P8", pfYUV410P8, cmYUV,  stInteger,  8, 1, 2, 2, 3 },
+    { "YUV411P8", pfYUV411P8, cmYUV,  stInteger,  8, 1, 2, 0, 3 },
+    { "YUV440P8", pfYUV440P8, cmYUV,  stInteger,  8, 1, 0, 1, 3 },
+    { "RGB24",    pfRGB24,    cmRGB,  stInteger,  8, 1, 0, 0, 3 },
+    { "RGB48",    pfRGB48,    cmRGB,  stInteger, 16, 2, 0, 0, 3 },
+};
+
+
+static const VSFormat * VS_CC get_format_preset(int id, VSCore *core)
+{
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (formats[i].id == id) {
+            return formats + i;
+        }
+    }
+    return NULL;
+}
+
+
+static VSMap * VS_CC new_map(void)
+{
+    return (VSMap *)calloc(1, sizeof(VSMap));
+}
+
+
+static void VS_CC clear_entry(map_entry_t *e)
+{
+    for (int i = 0; e->data && i < e->num; i++) {
+        free(e->data[i]);
+    }
+    free(e->ints);
+    free(e->data);
+    free(e->sizes);
+    free(e->ptrs);
+    e->ints = NULL;
+    e->data = NULL;
+    e->sizes = NULL;
+    e->ptrs = NULL;
+    e->num = 0;
+}
+
+
+static void VS_CC clear_map(VSMap *map)
+{
+    for (int i = 0; i < map->num; i++) {
+        clear_entry(map->entries + i);
+    }
+    free(map->entries);
+    free(map->error);
+    memset(map, 0, sizeof(VSMap));
+}
+
+
+static void VS_CC free_map(VSMap *map)
+{
+    if (map) {
+        clear_map(map);
+        free(map);
+    }
+}
+
+
+static map_entry_t *find_entry(const VSMap *map, const char *key)
+{
+    for (int i = 0; i < map->num; i++) {
+        if (!strcmp(map->entries[i].key, key)) {
+            return map->entries + i;
+        }
+    }
+    return NULL;
+}
+
+
+/* returns the entry to which an element of type is appended */
+static map_entry_t *set_entry(VSMap *map, const char *key, char type,
+                              int append)
+{
+    map_entry_t *e = find_entry(map, key);
+    if (e && (append != paAppend || e->type != type)) {
+        clear_entry(e);
+    }
+    if (!e) {
+        map_entry_t *entries = (map_entry_t *)realloc(map->entries,
+            sizeof(map_entry_t) * (map->num + 1));
+        if (!entries) {
+            abort();
+        }
+        map->entries = entries;
+        e = entries + map->num++;
+        memset(e, 0, sizeof(map_entry_t));
+        snprintf(e->key, STUB_KEY_LENGTH, "%s", key);
+    }
+    e->type = type;
+    return e;
+}
+
+
+static void *grow(void *array, size_t size, int num)
+{
+    void *p = realloc(array, size * (num + 1));
+    if (!p) {
+        abort();
+    }
+    return p;
+}
+
+
+/* returns the entry of key holding index, and sets error */
+static map_entry_t *get_entry(const VSMap *map, const char *key, char type,
+                              int index, int *error)
+{
+    map_entry_t *e = find_entry(map, key);
+    int err = !e ? peUnset : e->type != type ? peType :
+              index < 0 || index >= e->num ? peIndex : 0;
+    if (error) {
+        *error = err;
+    } else if (err) {
+        fprintf(stderr, "stub: failed to get %s\n", key);
+        abort();
+    }
+    return err ? NULL : e;
+}
+
+
+static int VS_CC prop_num_elements(const VSMap *map, const char *key)
+{
+    map_entry_t *e = find_entry(map, key);
+    return e ? e->num : -1;
+}
+
+
+static char VS_CC prop_get_type(const VSMap *map, const char *key)
+{
+    map_entry_t *e = find_entry(map, key);
+    return e ? e->type : TYPE_UNSET;
+}
+
+
+static int64_t VS_CC
+prop_get_int(const VSMap *map, const char *key, int index, int *error)
+{
+    map_entry_t *e = get_entry(map, key, TYPE_INT, index, error);
+    return e ? e->ints[index] : 0;
+}
+
+
+static const char * VS_CC
+prop_get_data(const VSMap *map, const char *key, int index, int *error)
+{
+    map_entry_t *e = get_entry(map, key, TYPE_DATA, index, error);
+    return e ? e->data[index] : NULL;
+}
+
+
+static int VS_CC
+prop_get_data_size(const VSMap *map, const char *key, int index, int *error)
+{
+    map_entry_t *e = get_entry(map, key, TYPE_DATA, index, error);
+    return e ? e->sizes[index] : -1;
+}
+
+
+static int VS_CC
+prop_set_int(VSMap *map, const char *key, int64_t i, int append)
+{
+    map_entry_t *e = set_entry(map, key, TYPE_INT, append);
+    e->ints = (int64_t *)grow(e->ints, sizeof(int64_t), e->num);
+    e->ints[e->num++] = i;
+    return 0;
+}
+
+
+static int VS_CC
+prop_set_data(VSMap *map, const char *key, const char *data, int size,
+              int append)
+{
+    if (size < 0) {
+        size = (int)strlen(data);
+    }
+    map_entry_t *e = set_entry(map, key, TYPE_DATA, append);
+    e->data = (char **)grow(e->data, sizeof(char *), e->num);
+    e->sizes = (int *)grow(e->sizes, sizeof(int), e->num);
+    e->data[e->num] = (char *)malloc(size + 1);
+    if (!e->data[e->num]) {
+        abort();
+    }
+    memcpy(e->data[e->num], data, size);
+    e->data[e->num][size] = '\0';
+    e->sizes[e->num++] = size;
+    return 0;
+}
+
+
+static void set_ptr(VSMap *map, const char *key, char type, void *p)
+{
+    map_entry_t *e = set_entry(map, key, type, paReplace);
+    e->ptrs = (void **)grow(e->ptrs, sizeof(void *), e->num);
+    e->ptrs[e->num++] = p;
+}
+
+
+static void VS_CC set_error(VSMap *map, const char *msg)
+{
+    free(map->error);
+    map->error = strdup(msg);
+}
+
+
+static const char * VS_CC get_error(const VSMap *map)
+{
+    return map->error;
+}
+
+
+static void VS_CC set_filter_error(const char *msg, VSFrameContext *ctx)
+{
+    free(ctx->error);
+    ctx->error = strdup(msg);
+}
+
+
+static VSFrameRef * VS_CC
+new_video_frame(const VSFormat *format, int width, int height,
+                const VSFrameRef *prop_src, VSCore *core)
+{
+    VSFrameRef *f = (VSFrameRef *)calloc(1, sizeof(VSFrameRef));
+    if (!f) {
+        abort();
+    }
+    f->format = format;
+    f->refs = 1;
+    f->props = new_map();
+    for (int i = 0; i < format->numPlanes; i++) {
+        f->width[i] = i ? width >> format->subSamplingW : width;
+        f->height[i] = i ? height >> format->subSamplingH : height;
+        f->stride[i] = stub_stride_pad > 0
+                       ? (f->width[i] + stub_stride_pad) * format->bytesPerSample
+                       : (f->width[i] * format->bytesPerSample + STUB_ALIGN - 1)
+                         & ~(STUB_ALIGN - 1);
+        f->alloc[i] = malloc((size_t)f->stride[i] * f->height[i] +
+                             STUB_ALIGN);
+        if (!f->alloc[i]) {
+            abort();
+        }
+        f->data[i] = (uint8_t *)(((uintptr_t)f->alloc[i] + STUB_ALIGN - 1)
+                                 & ~(uintptr_t)(STUB_ALIGN - 1));
+    }
+    return f;
+}
+
+
+static void VS_CC free_frame(const VSFrameRef *frame)
+{
+    VSFrameRef *f = (VSFrameRef *)frame;
+    if (!f || __sync_sub_and_fetch(&f->refs, 1) > 0) {
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        free(f->alloc[i]);
+    }
+    free_map(f->props);
+    free(f);
+}
+
+
+static const VSFrameRef * VS_CC clone_frame_ref(const VSFrameRef *frame)
+{
+    __sync_add_and_fetch(&((VSFrameRef *)frame)->refs, 1);
+    return frame;
+}
+
+
+static VSFrameRef * VS_CC copy_frame(const VSFrameRef *src, VSCore *core)
+{
+    VSFrameRef *f = new_video_frame(src->format, src->width[0],
+                                    src->height[0], NULL, core);
+    for (int i = 0; i < src->format->numPlanes; i++) {
+        memcpy(f->data[i], src->data[i], (size_t)src->stride[i] * src->height[i]);
+    }
+    for (int i = 0; i < src->props->num; i++) {
+        map_entry_t *e = src->props->entries + i;
+        for (int j = 0; e->type == TYPE_INT && j < e->num; j++) {
+            prop_set_int(f->props, e->key, e->ints[j], paAppend);
+        }
+    }
+    return f;
+}
+
+
+static int VS_CC get_stride(const VSFrameRef *f, int plane)
+{
+    return f->stride[plane];
+}
+
+
+static const uint8_t * VS_CC get_read_ptr(const VSFrameRef *f, int plane)
+{
+    return f->data[plane];
+}
+
+
+static uint8_t * VS_CC get_write_ptr(VSFrameRef *f, int plane)
+{
+    return f->data[plane];
+}
+
+
+static const VSFormat * VS_CC get_frame_format(const VSFrameRef *f)
+{
+    return f->format;
+}
+
+
+static int VS_CC get_frame_width(const VSFrameRef *f, int plane)
+{
+    return f->width[plane];
+}
+
+
+static int VS_CC get_frame_height(const VSFrameRef *f, int plane)
+{
+    return f->height[plane];
+}
+
+
+static const VSMap * VS_CC get_frame_props_ro(const VSFrameRef *f)
+{
+    return f->props;
+}
+
+
+static VSMap * VS_CC get_frame_props_rw(VSFrameRef *f)
+{
+    return f->props;
+}
+
+
+static void VS_CC
+create_filter(const VSMap *in, VSMap *out, const char *name,
+              VSFilterInit init, VSFilterGetFrame get_frame,
+              VSFilterFree free_func, int mode, int flags,
+              void *instance_data, VSCore *core)
+{
+    stub_node_t *node = (stub_node_t *)calloc(1, sizeof(stub_node_t));
+    if (!node) {
+        abort();
+    }
+    node->get_frame = get_frame;
+    node->free = free_func;
+    node->instance_data = instance_data;
+    set_ptr(out, "clip", TYPE_NODE, node);
+    init((VSMap *)in, out, &node->instance_data, (VSNode *)node, core,
+         &stub_api);
+}
+
+
+static void VS_CC
+set_video_info(const VSVideoInfo *vi, int num_outputs, VSNode *vsnode)
+{
+    stub_node_t *node = (stub_node_t *)vsnode;
+    for (int i = 0; i < num_outputs && i < 2; i++) {
+        node->vi[i] = vi[i];
+    }
+    node->num_outputs = num_outputs;
+}
+
+
+static int VS_CC get_output_index(VSFrameContext *ctx)
+{
+    return ctx->index;
+}
+
+
+static const VSCoreInfo * VS_CC get_core_info(VSCore *core)
+{
+    return &core->info;
+}
+
+
+static void VS_CC
+register_function(const char *name, const char *args, VSPublicFunction func,
+                  void *data, VSPlugin *plugin)
+{
+    VSCore *core = &stub_core_inst;
+    if (core->num_funcs < STUB_MAX_FUNCS) {
+        snprintf(core->funcs[core->num_funcs].name, STUB_KEY_LENGTH, "%s",
+                 name);
+        core->funcs[core->num_funcs].func = func;
+        core->funcs[core->num_funcs++].data = data;
+    }
+}
+
+
+static void VS_CC
+config_plugin(const char *identifier, const char *ns, const char *name,
+              int api_version, int read_only, VSPlugin *plugin)
+{
+}
+
+
+VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin, VSRegisterFunction,
+                                            VSPlugin *);
+
+const VSAPI * VS_CC stub_init(int num_threads)
+{
+    VSCore *core = &stub_core_inst;
+    core->info.versionString = "vsimagereader stub core";
+    core->info.core = 0;
+    core->info.api = VAPOURSYNTH_API_VERSION;
+    core->info.numThreads = num_threads;
+    core->info.maxFramebufferSize = INT64_C(1) << 30;
+    core->info.usedFramebufferSize = 0;
+
+    VSAPI *api = &stub_api;
+    api->createFilter = create_filter;
+    api->setError = set_error;
+    api->getError = get_error;
+    api->setFilterError = set_filter_error;
+    api->getFormatPreset = get_format_preset;
+    api->cloneFrameRef = clone_frame_ref;
+    api->freeFrame = free_frame;
+    api->newVideoFrame = new_video_frame;
+    api->copyFrame = copy_frame;
+    api->getStride = get_stride;
+    api->getReadPtr = get_read_ptr;
+    api->getWritePtr = get_write_ptr;
+    api->getFrameFormat = get_frame_format;
+    api->getFrameWidth = get_frame_width;
+    api->getFrameHeight = get_frame_height;
+    api->getFramePropsRO = get_frame_props_ro;
+    api->getFramePropsRW = get_frame_props_rw;
+    api->setVideoInfo = set_video_info;
+    api->getOutputIndex = get_output_index;
+    api->getCoreInfo = get_core_info;
+    api->registerFunction = register_function;
+    api->newMap = new_map;
+    api->freeMap = free_map;
+    api->clearMap = clear_map;
+    api->propNumElements = prop_num_elements;
+    api->propGetType = prop_get_type;
+    api->propGetInt = prop_get_int;
+    api->propGetData = prop_get_data;
+    api->propGetDataSize = prop_get_data_size;
+    api->propSetInt = prop_set_int;
+    api->propSetData = prop_set_data;
+
+    if (core->num_funcs == 0) {
+        VapourSynthPluginInit(config_plugin, register_function, NULL);
+    }
+    return api;
+}
+
+
+VSCore * VS_CC stub_core(void)
+{
+    return &stub_core_inst;
+}
+
+
+void VS_CC stub_set_stride_pad(int pad)
+{
+    stub_stride_pad = pad;
+}
+
+
+void VS_CC stub_invoke(const char *name, const VSMap *in, VSMap *out)
+{
+    VSCore *core = &stub_core_inst;
+    for (int i = 0; i < core->num_funcs; i++) {
+        if (!strcmp(core->funcs[i].name, name)) {
+            core->funcs[i].func(in, out, core->funcs[i].data, core,
+                                &stub_api);
+            return;
+        }
+    }
+    set_error(out, "stub: no such function");
+}
+
+
+stub_node_t * VS_CC stub_get_node(const VSMap *out)
+{
+    map_entry_t *e = find_entry(out, "clip");
+    return e && e->type == TYPE_NODE ? (stub_node_t *)e->ptrs[0] : NULL;
+}
+
+
+const VSVideoInfo * VS_CC stub_video_info(stub_node_t *node, int index)
+{
+    return node->vi + index;
+}
+
+
+int VS_CC stub_num_outputs(stub_node_t *node)
+{
+    return node->num_outputs;
+}
+
+
+const VSFrameRef * VS_CC
+stub_get_frame(stub_node_t *node, int n, int index, char *err, int err_size)
+{
+    VSFrameContext ctx = { index, NULL };
+    void *frame_data = NULL;
+    const VSFrameRef *f = node->get_frame(n, arInitial, &node->instance_data,
+                                          &frame_data, &ctx, &stub_core_inst,
+                                          &stub_api);
+    if (!f && err) {
+        snprintf(err, err_size, "%s", ctx.error ? ctx.error : "no frame");
+    }
+    free(ctx.error);
+    return f;
+}
+
+
+void VS_CC stub_free_node(stub_node_t *node)
+{
+    if (node->free) {
+        node->free(node->instance_data, &stub_core_inst, &stub_api);
+    }
+    free(node);
+}
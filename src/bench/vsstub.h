@@ -0,0 +1,57 @@
+/*
+  vsstub.h
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+/* in-process stand-in for the parts of VSAPI and VSCore used by the
+   plugin, so that it can be driven without VapourSynth. */
+
+#ifndef VS_IMGR_STUB_H
+#define VS_IMGR_STUB_H
+
+#include "VapourSynth.h"
+
+typedef struct stub_node stub_node_t;
+
+/* the api of the stub core. num_threads is reported by getCoreInfo. */
+const VSAPI * VS_CC stub_init(int num_threads);
+VSCore * VS_CC stub_core(void);
+
+/* the frames made after this have pad samples after each row instead of
+   the aligned stride. 0 restores the alignment. */
+void VS_CC stub_set_stride_pad(int pad);
+
+/* calls the function registered by the plugin as name */
+void VS_CC stub_invoke(const char *name, const VSMap *in, VSMap *out);
+
+stub_node_t * VS_CC stub_get_node(const VSMap *out);
+const VSVideoInfo * VS_CC stub_video_info(stub_node_t *node, int index);
+int VS_CC stub_num_outputs(stub_node_t *node);
+
+/* requests the frame n of output index. returns NULL with the message of
+   the filter in err on failure. */
+const VSFrameRef * VS_CC stub_get_frame(stub_node_t *node, int n, int index,
+                                        char *err, int err_size);
+void VS_CC stub_free_node(stub_node_t *node);
+
+#endif
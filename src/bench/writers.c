@@ -0,0 +1,682 @@
+/*
+  writers.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+
+/* verification and microbenchmark of the func_write_* writers.
+
+   each writer is run on every row kernel set the cpu supports, over random
+   sources of random widths, crops, proxies, bands, row alignments and odd
+   frame strides, both component orders and flip on/off. the frames are
+   compared byte for byte with a per pixel reference. then every writer is
+   timed on a 1920x1080 image with each kernel set. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICKS() ((int64_t)__rdtsc())
+#define TICK_UNIT "cycles"
+#else
+#define TICKS() imgr_now()
+#define TICK_UNIT "ns"
+#endif
+
+#include "imagereader.h"
+#include "vsstub.h"
+#include "bench.h"
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define MAX_KERNEL_SETS 8
+
+
+typedef enum {
+    SRC_PLANAR,
+    SRC_PACKED,
+    SRC_PALETTE,
+    SRC_BITFIELDS
+} src_kind_t;
+
+typedef struct {
+    const char *name;
+    const func_write_frame *write;
+    VSPresetFormat format;
+    src_kind_t kind;
+    int num; // components of the packed pixels
+    int bits; // bits per pixel of palette and bitfields
+} writer_case_t;
+
+static const writer_case_t cases[] = {
+    { "planar-gray8",    &func_write_planar,    pfGray8,    SRC_PLANAR,    1,  0 },
+    { "planar-yuv444p8", &func_write_planar,    pfYUV444P8, SRC_PLANAR,    3,  0 },
+    { "planar-yuv422p8", &func_write_planar,    pfYUV422P8, SRC_PLANAR,    3,  0 },
+    { "planar-yuv420p8", &func_write_planar,    pfYUV420P8, SRC_PLANAR,    3,  0 },
+    { "gray8_a",         &func_write_gray8_a,   pfGray8,    SRC_PACKED,    2,  0 },
+    { "gray16_a",        &func_write_gray16_a,  pfGray16,   SRC_PACKED,    2,  0 },
+    { "rgb24",           &func_write_rgb24,     pfRGB24,    SRC_PACKED,    3,  0 },
+    { "rgb32",           &func_write_rgb32,     pfRGB24,    SRC_PACKED,    4,  0 },
+    { "rgb48",           &func_write_rgb48,     pfRGB48,    SRC_PACKED,    3,  0 },
+    { "rgb64",           &func_write_rgb64,     pfRGB48,    SRC_PACKED,    4,  0 },
+    { "palette1",        &func_write_palette,   pfRGB24,    SRC_PALETTE,   1,  1 },
+    { "palette2",        &func_write_palette,   pfRGB24,    SRC_PALETTE,   1,  2 },
+    { "palette4",        &func_write_palette,   pfRGB24,    SRC_PALETTE,   1,  4 },
+    { "palette8",        &func_write_palette,   pfRGB24,    SRC_PALETTE,   1,  8 },
+    { "bitfields16",     &func_write_bitfields, pfRGB24,    SRC_BITFIELDS, 1, 16 },
+    { "bitfields32",     &func_write_bitfields, pfRGB24,    SRC_BITFIELDS, 1, 32 },
+};
+
+#define NUM_CASES (int)(sizeof(cases) / sizeof(cases[0]))
+
+static const char *kernel_sets[] = { "c", "sse2", "ssse3", "avx2", "avx512",
+                                     "neon" };
+
+/* one run of a writer */
+typedef struct {
+    const writer_case_t *wc;
+    const VSFormat *format;
+    int width; // of the image
+    int height;
+    int proxy;
+    int crop[4]; // left, top, width and height after proxy
+    int flip;
+    int order_rgb;
+    int row_adjust; // 0 or 3
+    int band; // rows per band, 0 for the whole image
+    int alpha; // enable_alpha
+    int palette_alpha;
+    int stride_pad;
+    uint8_t *image; // whole source image, see src_row_size()
+    color_palette_t palette[256];
+    bitfields_t bitfields;
+} run_t;
+
+
+static uint32_t rand_state;
+
+static uint32_t next_rand(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+
+static int rand_range(int lo, int hi)
+{
+    return lo + (int)(next_rand() % (uint32_t)(hi - lo + 1));
+}
+
+
+static int bytes_of(const run_t *r)
+{
+    return r->format->bytesPerSample;
+}
+
+
+static int subsampled(const run_t *r)
+{
+    return r->format->subSamplingW || r->format->subSamplingH;
+}
+
+
+/* size of a row of the plane in the source, as the writers compute it */
+static int src_row_size(const run_t *r, int plane)
+{
+    const writer_case_t *wc = r->wc;
+    int width = r->width;
+    int bytes;
+    switch (wc->kind) {
+    case SRC_PLANAR:
+        width >>= plane ? r->format->subSamplingW : 0;
+        bytes = width * bytes_of(r);
+        break;
+    case SRC_PACKED:
+        bytes = width * wc->num * bytes_of(r);
+        break;
+    default:
+        bytes = (width * wc->bits + 7) / 8;
+    }
+    return (bytes + r->row_adjust) & ~r->row_adjust;
+}
+
+
+static int src_plane_height(const run_t *r, int plane)
+{
+    return plane ? r->height >> r->format->subSamplingH : r->height;
+}
+
+
+static size_t src_plane_size(const run_t *r, int plane)
+{
+    return (size_t)src_row_size(r, plane) * src_plane_height(r, plane);
+}
+
+
+static int num_src_planes(const run_t *r)
+{
+    return r->wc->kind == SRC_PLANAR ? r->format->numPlanes : 1;
+}
+
+
+/* 16/32bit pixels: random widths of the fields at random positions */
+static void make_bitfields(run_t *r)
+{
+    static const int layouts16[][4] = {
+        { 5, 5, 5, 1 }, { 5, 6, 5, 0 }, { 4, 4, 4, 4 }, { 3, 3, 2, 0 }
+    };
+    static const int layouts32[][4] = {
+        { 8, 8, 8, 8 }, { 10, 10, 10, 2 }, { 8, 8, 8, 0 }, { 11, 11, 10, 0 }
+    };
+    const int *widths = r->wc->bits == 16 ? layouts16[next_rand() % 4]
+                                          : layouts32[next_rand() % 4];
+    int perm[4] = { 0, 1, 2, 3 };
+    for (int i = 3; i > 0; i--) {
+        int j = next_rand() % (i + 1);
+        int t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+    int shift = 0;
+    for (int i = 0; i < 4; i++) {
+        int c = perm[i];
+        r->bitfields.shift[c] = shift;
+        r->bitfields.bits[c] = widths[c];
+        shift += widths[c];
+    }
+}
+
+
+static void make_source(run_t *r)
+{
+    size_t size = 0;
+    for (int i = 0; i < num_src_planes(r); i++) {
+        size += src_plane_size(r, i);
+    }
+    r->image = (uint8_t *)malloc(size + 32);
+    if (!r->image) {
+        fprintf(stderr, "failed to allocate source\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < size + 32; i++) {
+        r->image[i] = (uint8_t)next_rand();
+    }
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = next_rand();
+        memcpy(r->palette + i, &c, 4);
+    }
+    if (r->wc->kind == SRC_BITFIELDS) {
+        make_bitfields(r);
+    }
+}
+
+
+static void random_run(run_t *r, const writer_case_t *wc, const VSAPI *vsapi)
+{
+    memset(r, 0, sizeof(run_t));
+    r->wc = wc;
+    r->format = vsapi->getFormatPreset(wc->format, stub_core());
+    int ss = subsampled(r);
+    r->width = rand_range(1, 300);
+    r->height = rand_range(1, 40);
+    if (ss) {
+        /* regions of the subsampled images are aligned to it */
+        r->width = (r->width + 1) & ~1;
+        r->height = (r->height + 1) & ~1;
+    }
+    static const int proxies[] = { 1, 1, 2, 4, 8 };
+    r->proxy = ss ? 1 : proxies[next_rand() % 5];
+    int pw = IMG_PROXY_SIZE(r->width, r->proxy);
+    int ph = IMG_PROXY_SIZE(r->height, r->proxy);
+    if (next_rand() % 2) {
+        r->crop[0] = rand_range(0, pw - 1) & (ss ? ~1 : ~0);
+        r->crop[1] = rand_range(0, ph - 1) & (ss ? ~1 : ~0);
+        r->crop[2] = rand_range(1, pw - r->crop[0]);
+        r->crop[3] = rand_range(1, ph - r->crop[1]);
+        if (ss) {
+            r->crop[2] = (r->crop[2] + 1) & ~1;
+            r->crop[3] = (r->crop[3] + 1) & ~1;
+        }
+    } else {
+        r->crop[2] = pw;
+        r->crop[3] = ph;
+    }
+    r->flip = ss ? 0 : next_rand() % 2;
+    r->order_rgb = next_rand() % 2;
+    r->row_adjust = next_rand() % 2 ? 3 : 0;
+    r->band = ss || next_rand() % 2 ? 0 : rand_range(1, r->height);
+    r->alpha = next_rand() % 2;
+    r->palette_alpha = next_rand() % 2;
+    /* the row kernels may write 3 pixels into the padding */
+    r->stride_pad = next_rand() % 2 ? rand_range(1, 15) * 2 + 1 : 0;
+    make_source(r);
+}
+
+
+/* value of the component of the plane at x of the row y of the file */
+static int ref_sample(const run_t *r, int plane, int x, int y)
+{
+    const writer_case_t *wc = r->wc;
+    const uint8_t *srcp = r->image;
+    int bytes = bytes_of(r);
+    switch (wc->kind) {
+    case SRC_PLANAR:
+        for (int i = 0; i < plane; i++) {
+            srcp += src_plane_size(r, i);
+        }
+        srcp += (size_t)y * src_row_size(r, plane) + x * bytes;
+        return bytes == 1 ? srcp[0] : srcp[0] | srcp[1] << 8;
+    case SRC_PACKED: {
+        int comp = plane;
+        if (plane == 3) {
+            comp = wc->num - 1;
+        } else if (wc->num >= 3 && !r->order_rgb) {
+            comp = 2 - plane;
+        }
+        srcp += (size_t)y * src_row_size(r, 0) + (x * wc->num + comp) * bytes;
+        return bytes == 1 ? srcp[0] : srcp[0] | srcp[1] << 8;
+    }
+    case SRC_PALETTE: {
+        srcp += (size_t)y * src_row_size(r, 0);
+        int bit = x * wc->bits;
+        int index = (srcp[bit / 8] >> (8 - wc->bits - bit % 8)) &
+                    ((1 << wc->bits) - 1);
+        const color_palette_t *c = r->palette + index;
+        const uint8_t values[4] = { c->red, c->green, c->blue, c->reserved };
+        return values[plane];
+    }
+    default: {
+        srcp += (size_t)y * src_row_size(r, 0) + x * (wc->bits / 8);
+        uint32_t px = 0;
+        for (int i = wc->bits / 8 - 1; i >= 0; i--) {
+            px = px << 8 | srcp[i];
+        }
+        int bits = r->bitfields.bits[plane];
+        if (bits == 0) {
+            return 0;
+        }
+        uint32_t v = (px >> r->bitfields.shift[plane]) &
+                     (uint32_t)((1ull << bits) - 1);
+        if (bits >= 8) {
+            return v >> (bits - 8);
+        }
+        /* narrower fields repeat their bits from the top */
+        uint32_t out = 0;
+        int filled = 0;
+        while (filled < 8) {
+            out = out << bits | v;
+            filled += bits;
+        }
+        return (out >> (filled - 8)) & 0xFF;
+    }
+    }
+}
+
+
+/* whether the source has the alpha written into the alpha frame */
+static int has_alpha(const run_t *r)
+{
+    switch (r->wc->kind) {
+    case SRC_PACKED:
+        return r->wc->num == 2 || r->wc->num == 4;
+    case SRC_PALETTE:
+        return r->palette_alpha;
+    case SRC_BITFIELDS:
+        return r->bitfields.bits[3] != 0;
+    default:
+        return 0;
+    }
+}
+
+
+/* value of the pixel of the plane (3 for alpha) of the frame */
+static int ref_pixel(const run_t *r, int plane, int fx, int fy)
+{
+    if (plane == 3 && !has_alpha(r)) {
+        return 0;
+    }
+    int ss_w = plane && plane < 3 ? r->format->subSamplingW : 0;
+    int ss_h = plane && plane < 3 ? r->format->subSamplingH : 0;
+    int p = r->proxy;
+    int left = r->crop[0] * p;
+    int top = r->crop[1] * p;
+    int roi_width = (r->crop[0] + r->crop[2]) * p < r->width
+                    ? r->crop[2] * p : r->width - left;
+    int roi_height = (r->crop[1] + r->crop[3]) * p < r->height
+                     ? r->crop[3] * p : r->height - top;
+    if (ss_w || ss_h) {
+        return ref_sample(r, plane, (left >> ss_w) + fx, (top >> ss_h) + fy);
+    }
+
+    uint32_t sum = 0, count = 0;
+    for (int y = fy * p; y < (fy + 1) * p && y < roi_height; y++) {
+        int row = top + y;
+        if (r->flip) {
+            row = r->height - 1 - row;
+        }
+        for (int x = fx * p; x < (fx + 1) * p && x < roi_width; x++) {
+            sum += ref_sample(r, plane, left + x, row);
+            count++;
+        }
+    }
+    return (sum + count / 2) / count;
+}
+
+
+static void setup_writer(const run_t *r, img_hnd_t *ih, src_info_t *src,
+                         img_ctx_t *ctx)
+{
+    memset(ih, 0, sizeof(img_hnd_t));
+    memset(src, 0, sizeof(src_info_t));
+    memset(ctx, 0, sizeof(img_ctx_t));
+    src->format = r->format;
+    src->width = r->crop[2];
+    src->height = r->crop[3];
+    src->flip = r->flip;
+    ih->src = src;
+    ih->enable_alpha = r->alpha;
+    ih->proxy = r->proxy;
+    memcpy(ih->roi, r->crop, sizeof(ih->roi));
+    pthread_mutex_init(&ih->alpha_mutex, NULL);
+
+    ctx->row_adjust = r->row_adjust;
+    switch (r->wc->kind) {
+    case SRC_PACKED:
+        ctx->misc = r->order_rgb ? IMG_ORDER_RGB : IMG_ORDER_BGR;
+        break;
+    case SRC_PALETTE:
+        ctx->misc = r->wc->bits | (r->palette_alpha ? IMG_PALETTE_ALPHA : 0);
+        memcpy(ctx->palettes, r->palette, sizeof(ctx->palettes));
+        break;
+    case SRC_BITFIELDS:
+        ctx->misc = r->wc->bits;
+        ctx->bitfields = r->bitfields;
+        break;
+    default:
+        break;
+    }
+    if (imgr_set_image_size(ih, ctx, 0, r->width, r->height, r->proxy)) {
+        fprintf(stderr, "bad run of %s\n", r->wc->name);
+        exit(1);
+    }
+}
+
+
+static void cleanup_writer(img_hnd_t *ih, img_ctx_t *ctx, const VSAPI *vsapi)
+{
+    while (ih->zero_alpha) {
+        zero_alpha_t *za = ih->zero_alpha;
+        ih->zero_alpha = za->next;
+        vsapi->freeFrame(za->frame);
+        free(za);
+    }
+    pthread_mutex_destroy(&ih->alpha_mutex);
+    free(ctx->proxy_buff);
+}
+
+
+/* copies the rows [top, top + height) of the source into a buffer of the
+   layout the readers hand to the writers, with 32 bytes of slack */
+static uint8_t *make_band(const run_t *r, int top, int height)
+{
+    size_t size = 0;
+    for (int i = 0; i < num_src_planes(r); i++) {
+        size += (size_t)src_row_size(r, i) * height;
+    }
+    uint8_t *band = (uint8_t *)malloc(size + 32);
+    if (!band) {
+        fprintf(stderr, "failed to allocate band\n");
+        exit(1);
+    }
+    memset(band + size, 0xA5, 32);
+    const uint8_t *srcp = r->image;
+    uint8_t *dstp = band;
+    for (int i = 0; i < num_src_planes(r); i++) {
+        size_t row_size = src_row_size(r, i);
+        int rows = i ? height >> r->format->subSamplingH : height;
+        int first = i ? top >> r->format->subSamplingH : top;
+        memcpy(dstp, srcp + first * row_size, rows * row_size);
+        dstp += rows * row_size;
+        srcp += src_plane_size(r, i);
+    }
+    return band;
+}
+
+
+static int compare_plane(const run_t *r, const VSFrameRef *f, int plane,
+                         int index, const VSAPI *vsapi, const char *set)
+{
+    int bytes = vsapi->getFrameFormat(f)->bytesPerSample;
+    int stride = vsapi->getStride(f, plane);
+    const uint8_t *p = vsapi->getReadPtr(f, plane);
+    for (int y = 0; y < vsapi->getFrameHeight(f, plane); y++) {
+        for (int x = 0; x < vsapi->getFrameWidth(f, plane); x++) {
+            const uint8_t *s = p + y * stride + x * bytes;
+            int got = bytes == 1 ? s[0] : s[0] | s[1] << 8;
+            int expected = ref_pixel(r, index, x, y);
+            if (got != expected) {
+                printf("MISMATCH %s on %s: %dx%d proxy %d crop %d,%d,%d,%d "
+                       "flip %d rgb %d adjust %d band %d alpha %d pad %d: "
+                       "plane %d at %d,%d is %d, expected %d\n",
+                       r->wc->name, set, r->width, r->height, r->proxy,
+                       r->crop[0], r->crop[1], r->crop[2], r->crop[3],
+                       r->flip, r->order_rgb, r->row_adjust, r->band,
+                       r->alpha, r->stride_pad, index, x, y, got, expected);
+                fflush(stdout);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/* runs the writer over the bands of the source. returns 0 if the frames
+   match the reference. */
+static int verify_run(const run_t *r, const VSAPI *vsapi, const char *set)
+{
+    img_hnd_t ih;
+    src_info_t src;
+    img_ctx_t ctx;
+    setup_writer(r, &ih, &src, &ctx);
+    VSCore *core = stub_core();
+
+    stub_set_stride_pad(r->stride_pad);
+    VSFrameRef *dst[2] = { NULL, NULL };
+    dst[0] = vsapi->newVideoFrame(r->format, src.width, src.height, NULL,
+                                  core);
+    int rows = imgr_rows_needed(&ih, &ctx, 0);
+    int band = r->band ? r->band : r->height;
+    for (int top = 0; top < rows; top += band) {
+        int height = top + band < r->height ? band : r->height - top;
+        ctx.image = make_band(r, top, height);
+        ctx.band_top = r->band ? top : 0;
+        ctx.band_height = r->band ? height : 0;
+        (*r->wc->write)(&ih, &ctx, 0, dst, core, vsapi);
+        free(ctx.image);
+    }
+    stub_set_stride_pad(0);
+
+    int ret = 0;
+    for (int i = 0; i < r->format->numPlanes && !ret; i++) {
+        ret = compare_plane(r, dst[0], i, i, vsapi, set);
+    }
+    if (!ret && r->alpha != !!dst[1]) {
+        printf("MISMATCH %s on %s: alpha frame %s\n", r->wc->name, set,
+               dst[1] ? "not expected" : "missing");
+        ret = -1;
+    }
+    if (!ret && dst[1]) {
+        ret = compare_plane(r, dst[1], 0, 3, vsapi, set);
+    }
+    vsapi->freeFrame(dst[0]);
+    vsapi->freeFrame(dst[1]);
+    cleanup_writer(&ih, &ctx, vsapi);
+    return ret;
+}
+
+
+/* ticks per pixel of the writer on a whole image, best of the repeats */
+static double time_writer(const writer_case_t *wc, const VSAPI *vsapi,
+                          int repeats)
+{
+    run_t r;
+    memset(&r, 0, sizeof(run_t));
+    r.wc = wc;
+    r.format = vsapi->getFormatPreset(wc->format, stub_core());
+    r.width = BENCH_WIDTH;
+    r.height = BENCH_HEIGHT;
+    r.proxy = 1;
+    r.crop[2] = BENCH_WIDTH;
+    r.crop[3] = BENCH_HEIGHT;
+    r.order_rgb = 1;
+    r.alpha = 1;
+    r.palette_alpha = 1;
+    make_source(&r);
+
+    img_hnd_t ih;
+    src_info_t src;
+    img_ctx_t ctx;
+    setup_writer(&r, &ih, &src, &ctx);
+    ctx.image = r.image;
+    VSCore *core = stub_core();
+    int64_t best = INT64_MAX;
+    for (int i = 0; i < repeats; i++) {
+        VSFrameRef *dst[2] = { NULL, NULL };
+        dst[0] = vsapi->newVideoFrame(r.format, BENCH_WIDTH, BENCH_HEIGHT,
+                                      NULL, core);
+        for (int p = 0; p < r.format->numPlanes; p++) {
+            /* the pages of the frames are touched in advance, as the
+               frames reused by the core are */
+            memset(vsapi->getWritePtr(dst[0], p), 0,
+                   vsapi->getStride(dst[0], p) *
+                   vsapi->getFrameHeight(dst[0], p));
+        }
+        int64_t start = TICKS();
+        (*wc->write)(&ih, &ctx, 0, dst, core, vsapi);
+        int64_t ticks = TICKS() - start;
+        best = ticks < best ? ticks : best;
+        vsapi->freeFrame(dst[0]);
+        vsapi->freeFrame(dst[1]);
+    }
+    cleanup_writer(&ih, &ctx, vsapi);
+    free(r.image);
+    return (double)best / ((double)BENCH_WIDTH * BENCH_HEIGHT);
+}
+
+
+/* selects the kernel set by name. returns 0 if the cpu supports it. */
+static int select_kernels(const char *name)
+{
+    setenv("IMGR_SIMD", name, 1);
+    imgr_init_deint_kernels();
+    return strcmp(imgr_deint_kernels()->name, name) ? -1 : 0;
+}
+
+
+int bench_writers(int argc, char **argv)
+{
+    int iterations = 200;
+    int repeats = 10;
+    uint32_t seed = 1;
+    int c;
+    while ((c = getopt(argc, argv, "n:r:s:")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 's':
+            seed = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            return -1;
+        }
+    }
+    if (optind != argc || iterations < 0 || repeats < 0) {
+        return -1;
+    }
+
+    const VSAPI *vsapi = stub_init(1);
+    const char *limit = getenv("IMGR_SIMD");
+    const char *sets[MAX_KERNEL_SETS];
+    int num_sets = 0;
+    for (size_t i = 0; i < sizeof(kernel_sets) / sizeof(kernel_sets[0]); i++) {
+        if ((!limit || !strcmp(limit, kernel_sets[i])) &&
+            select_kernels(kernel_sets[i]) == 0) {
+            sets[num_sets++] = kernel_sets[i];
+        }
+    }
+
+    int failed = 0;
+    for (int s = 0; s < num_sets; s++) {
+        select_kernels(sets[s]);
+        rand_state = seed ? seed : 1;
+        int set_failed = 0;
+        for (int i = 0; i < NUM_CASES; i++) {
+            for (int n = 0; n < iterations; n++) {
+                run_t r;
+                random_run(&r, cases + i, vsapi);
+                int ret = verify_run(&r, vsapi, sets[s]);
+                free(r.image);
+                if (ret) {
+                    set_failed++; // the first mismatch of a writer is enough
+                    break;
+                }
+            }
+        }
+        printf("%-8s %d runs of %d writers: %s\n", sets[s],
+               iterations * NUM_CASES, NUM_CASES,
+               set_failed ? "MISMATCH" : "ok");
+        fflush(stdout);
+        failed += set_failed;
+    }
+    if (repeats == 0) {
+        return failed ? 1 : 0;
+    }
+
+    time_writer(cases, vsapi, repeats); // warming up
+    printf("\n%s per pixel at %dx%d\n%-16s", TICK_UNIT, BENCH_WIDTH,
+           BENCH_HEIGHT, "writer");
+    for (int s = 0; s < num_sets; s++) {
+        printf(" %8s", sets[s]);
+    }
+    printf("\n");
+    for (int i = 0; i < NUM_CASES; i++) {
+        printf("%-16s", cases[i].name);
+        for (int s = 0; s < num_sets; s++) {
+            select_kernels(sets[s]);
+            printf(" %8.3f", time_writer(cases + i, vsapi, repeats));
+        }
+        printf("\n");
+    }
+    return failed ? 1 : 0;
+}
@@ -24,6 +24,7 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "imagereader.h"
 
@@ -39,7 +40,7 @@ typedef struct {
     int32_t height;
     uint16_t num_planes;
     uint16_t bits_per_pix;
-    uint32_t fourcc;
+    uint32_t compression;
     uint32_t image_size;
     int32_t pix_per_meter_h;
     int32_t pix_per_meter_v;
@@ -49,41 +50,378 @@ typedef struct {
 #pragma pack(pop)
 
 #define BMP_HEADER_MAGIC (0x4D42)
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_MAX_MASKS_SIZE 16
 
+/* compression */
+#define BI_RGB            0
+#define BI_RLE8           1
+#define BI_RLE4           2
+#define BI_BITFIELDS      3
+#define BI_ALPHABITFIELDS 6
 
-int VS_CC read_bmp(img_hnd_t *ih, int n)
+
+static int is_rle(const bmp_header_t *h)
 {
-    bmp_header_t h;
+    return h->compression == BI_RLE8 || h->compression == BI_RLE4;
+}
+
+
+/* size of the uncompressed pixels. 64 bits don't wrap with any header. */
+static uint64_t row_size_of(const bmp_header_t *h)
+{
+    return (((uint64_t)h->width * h->bits_per_pix + 7) / 8 + 3) & ~(uint64_t)3;
+}
+
+
+static uint64_t image_size_of(const bmp_header_t *h)
+{
+    return row_size_of(h) * (uint64_t)llabs((int64_t)h->height);
+}
+
+
+static int has_masks(const bmp_header_t *h)
+{
+    return h->compression == BI_BITFIELDS ||
+           h->compression == BI_ALPHABITFIELDS;
+}
+
+
+static const char * VS_CC check_header(const bmp_header_t *h)
+{
+    if (h->file_type != BMP_HEADER_MAGIC || h->num_planes != 1 ||
+        h->width <= 0 || h->height == 0) {
+        return "unsupported format";
+    }
+    /* BITMAPINFOHEADER, V2, V3, V4 and V5 */
+    if (h->header_size != 40 && h->header_size != 52 &&
+        h->header_size != 56 && h->header_size != 108 &&
+        h->header_size != 124) {
+        return "unsupported bmp header";
+    }
+
+    int bits = h->bits_per_pix;
+    switch (h->compression) {
+    case BI_RGB:
+        if (bits == 1 || bits == 2 || bits == 4 || bits == 8 ||
+            bits == 16 || bits == 24 || bits == 32) {
+            return NULL;
+        }
+        break;
+    case BI_RLE8:
+    case BI_RLE4:
+        /* RLE images are always bottom up */
+        if (bits == (h->compression == BI_RLE8 ? 8 : 4) && h->height > 0) {
+            return NULL;
+        }
+        break;
+    case BI_BITFIELDS:
+    case BI_ALPHABITFIELDS:
+        if (bits == 16 || bits == 32) {
+            return NULL;
+        }
+        break;
+    default:
+        break;
+    }
+    return "unsupported bmp compression";
+}
+
+
+/* channel masks in the order of R, G, B and A. they follow the 40 bytes
+   header or are part of the V2 and later headers; both start at the same
+   offset. */
+static int VS_CC
+get_bitfields(const bmp_header_t *h, const uint8_t *masks_data, size_t size,
+              bitfields_t *bf)
+{
+    uint32_t masks[4] = { 0x7C00, 0x03E0, 0x001F, 0 }; // 16bit BI_RGB
+    if (has_masks(h)) {
+        int num = h->header_size >= 56 ||
+                  h->compression == BI_ALPHABITFIELDS ? 4 : 3;
+        if (size < num * sizeof(uint32_t)) {
+            return -1;
+        }
+        memcpy(masks, masks_data, num * sizeof(uint32_t));
+    } else if (h->bits_per_pix == 32) {
+        masks[0] = 0x00FF0000;
+        masks[1] = 0x0000FF00;
+        masks[2] = 0x000000FF;
+        masks[3] = 0xFF000000;
+    }
+
+    for (int i = 0; i < 4; i++) {
+        uint32_t m = masks[i];
+        bf->shift[i] = 0;
+        bf->bits[i] = 0;
+        while (m && !(m & 1)) {
+            m >>= 1;
+            bf->shift[i]++;
+        }
+        while (m & 1) {
+            m >>= 1;
+            bf->bits[i]++;
+        }
+        if (m || bf->shift[i] + bf->bits[i] > h->bits_per_pix) {
+            return -1; // not contiguous or out of the pixel
+        }
+    }
+    return 0;
+}
+
+
+/* the 32bit masks that write_rgb32 handles */
+static int is_bgrx(const bitfields_t *bf, int enable_alpha)
+{
+    return bf->shift[0] == 16 && bf->bits[0] == 8 &&
+           bf->shift[1] == 8 && bf->bits[1] == 8 &&
+           bf->shift[2] == 0 && bf->bits[2] == 8 &&
+           ((bf->shift[3] == 24 && bf->bits[3] == 8) || !enable_alpha);
+}
+
+
+static size_t get_palette_offset(const bmp_header_t *h)
+{
+    size_t offset = BMP_FILE_HEADER_SIZE + h->header_size;
+    if (h->header_size == 40 && has_masks(h)) {
+        offset += h->compression == BI_ALPHABITFIELDS ? 16 : 12;
+    }
+    return offset;
+}
+
+
+typedef struct {
+    uint8_t *base[3]; // R, G, B
+    uint8_t *row[3];
+    int stride;
+    int width;
+    int height;
+    int x;
+    int y;
+    const color_palette_t *palette;
+} rle_dst_t;
+
+
+static void set_row(rle_dst_t *d)
+{
+    for (int i = 0; i < 3; i++) {
+        d->row[i] = d->base[i] + d->y * d->stride;
+    }
+}
+
 
-    FILE *fp = imgr_fopen(ih->src[n].name);
-    if (!fp) {
+static void put_run(rle_dst_t *d, int count, uint8_t index)
+{
+    int num = d->width - d->x < count ? d->width - d->x : count;
+    if (num > 0) {
+        const color_palette_t *c = d->palette + index;
+        memset(d->row[0] + d->x, c->red, num);
+        memset(d->row[1] + d->x, c->green, num);
+        memset(d->row[2] + d->x, c->blue, num);
+    }
+    d->x += count;
+}
+
+
+static void put_pixel(rle_dst_t *d, uint8_t index)
+{
+    if (d->x < d->width) {
+        const color_palette_t *c = d->palette + index;
+        d->row[0][d->x] = c->red;
+        d->row[1][d->x] = c->green;
+        d->row[2][d->x] = c->blue;
+    }
+    d->x++;
+}
+
+
+/* pixels skipped over are black */
+static void put_black(rle_dst_t *d, int x)
+{
+    int num = (x < d->width ? x : d->width) - d->x;
+    for (int i = 0; i < 3 && num > 0; i++) {
+        memset(d->row[i] + d->x, 0, num);
+    }
+    d->x = x;
+}
+
+
+static void skip_to(rle_dst_t *d, int x, int y)
+{
+    while (d->y < y && d->y < d->height) {
+        put_black(d, d->width);
+        d->y++;
+        d->x = 0;
+        if (d->y < d->height) {
+            set_row(d);
+        }
+    }
+    if (d->y < d->height && x > d->x) {
+        put_black(d, x);
+    }
+}
+
+
+/* RLE8/RLE4 codes are expanded straight into the planes. with proxy or
+   crop, they are expanded into planes in the image buffer and passed to
+   write_planar. the rows after the region of interest are not expanded. */
+static void VS_CC
+write_rle(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+          VSCore *core, const VSAPI *vsapi)
+{
+    int bits = ctx->misc & 0xFF;
+    const uint8_t *pos = ctx->image;
+    const uint8_t *end = ctx->source.data + ctx->source.size;
+
+    rle_dst_t d = { { NULL } };
+    d.width = ctx->width;
+    d.height = ctx->height;
+    int rows = imgr_rows_needed(ih, ctx, n);
+    int scratch = ctx->proxy > 1 || IMG_IS_CROPPED(ctx);
+    if (scratch) {
+        /* rows as write_planar expects with row_adjust of bmp */
+        d.stride = (d.width + 3) & ~3;
+        uint8_t *buff = imgr_image_buffer(ctx, (size_t)d.stride * d.height * 3);
+        if (!buff) {
+            vsapi->freeFrame(dst[0]);
+            dst[0] = NULL;
+            return;
+        }
+        for (int i = 0; i < 3; i++) {
+            d.base[i] = buff + (size_t)i * d.stride * d.height;
+        }
+    } else {
+        /* RLE images are always bottom up */
+        d.stride = -vsapi->getStride(dst[0], 0);
+        for (int i = 0; i < 3; i++) {
+            d.base[i] = vsapi->getWritePtr(dst[0], i) - (d.height - 1) * d.stride;
+        }
+    }
+    d.palette = ctx->palettes;
+    set_row(&d);
+
+    int ok = 1;
+    while (d.y < rows) {
+        if (end - pos < 2) {
+            ok = 0;
+            break;
+        }
+        int count = pos[0];
+        int code = pos[1];
+        pos += 2;
+        if (count > 0) {
+            if (bits == 8) {
+                put_run(&d, count, code);
+            } else {
+                for (int i = 0; i < count; i++) {
+                    put_pixel(&d, i & 1 ? code & 0x0F : code >> 4);
+                }
+            }
+        } else if (code == 0) {
+            skip_to(&d, 0, d.y + 1); // end of line
+        } else if (code == 1) {
+            break; // end of bitmap
+        } else if (code == 2) {
+            if (end - pos < 2) {
+                ok = 0;
+                break;
+            }
+            skip_to(&d, d.x + pos[0], d.y + pos[1]);
+            pos += 2;
+        } else {
+            /* absolute mode, padded to 16bit */
+            int bytes = bits == 8 ? code : (code + 1) / 2;
+            if (end - pos < bytes) {
+                ok = 0;
+                break;
+            }
+            for (int i = 0; i < code; i++) {
+                put_pixel(&d, bits == 8 ? pos[i] :
+                              i & 1 ? pos[i / 2] & 0x0F : pos[i / 2] >> 4);
+            }
+            pos += end - pos > bytes ? bytes + (bytes & 1) : bytes;
+        }
+    }
+
+    if (!ok) {
+        vsapi->freeFrame(dst[0]);
+        dst[0] = NULL;
+        return;
+    }
+    skip_to(&d, 0, rows);
+
+    if (scratch) {
+        ctx->image = d.base[0];
+        func_write_planar(ih, ctx, n, dst, core, vsapi);
+        return;
+    }
+    if (ih->enable_alpha) {
+        set_dummy_alpha(ih, n, dst + 1, core, vsapi);
+    }
+}
+
+
+int VS_CC read_bmp(img_hnd_t *ih, img_ctx_t *ctx, int n)
+{
+    if (imgr_load_source(ih, ctx, n)) {
         return -1;
     }
-    if (fread(&h, 1, sizeof(bmp_header_t), fp) != sizeof(bmp_header_t)) {
-        fclose(fp);
+    uint8_t *data = ctx->source.data;
+    size_t size = ctx->source.size;
+
+    bmp_header_t h;
+    if (size < sizeof(bmp_header_t)) {
+        return -1;
+    }
+    memcpy(&h, data, sizeof(bmp_header_t));
+    if (check_header(&h)) {
         return -1;
-    };
-
-    ih->misc = IMG_ORDER_BGR;
-    ih->row_adjust = 4;
-    if (h.bits_per_pix < 24) {
-        fread(ih->palettes, sizeof(color_palette_t), 1 << h.bits_per_pix, fp);
-        ih->misc |= h.bits_per_pix;
-        ih->write_frame = func_write_palette;
+    }
+
+    ctx->misc = IMG_ORDER_BGR;
+    ctx->row_adjust = 4;
+    if (h.bits_per_pix <= 8) {
+        int num = 1 << h.bits_per_pix;
+        if (h.num_palettes > 0 && h.num_palettes < (uint32_t)num) {
+            num = h.num_palettes;
+        }
+        size_t offset = get_palette_offset(&h);
+        size_t palette_size = sizeof(color_palette_t) * num;
+        if (size < offset || size - offset < palette_size) {
+            return -1;
+        }
+        memset(ctx->palettes, 0, sizeof(ctx->palettes));
+        memcpy(ctx->palettes, data + offset, palette_size);
+        ctx->misc |= h.bits_per_pix;
+        ctx->write_frame = is_rle(&h) ? write_rle : func_write_palette;
     } else if (h.bits_per_pix == 24) {
-        ih->write_frame = func_write_rgb24;
+        ctx->write_frame = func_write_rgb24;
     } else {
-        ih->write_frame = func_write_rgb32;
+        bitfields_t bf;
+        if (get_bitfields(&h, data + sizeof(bmp_header_t),
+                          size - sizeof(bmp_header_t), &bf)) {
+            return -1;
+        }
+        if (h.bits_per_pix == 32 && is_bgrx(&bf, ih->enable_alpha)) {
+            ctx->write_frame = func_write_rgb32;
+        } else {
+            ctx->bitfields = bf;
+            ctx->misc |= h.bits_per_pix;
+            ctx->write_frame = func_write_bitfields;
+        }
     }
 
-    fseek(fp, h.offset_data, SEEK_SET);
-    uint32_t read = fread(ih->image_buff, 1, ih->src[n].image_size, fp);
-    fclose(fp);
-    if (read != ih->src[n].image_size) {
+    if (h.offset_data > size ||
+        (!is_rle(&h) && size - h.offset_data < image_size_of(&h))) {
         return -1;
     }
+    /* pixels are passed to the writer in place */
+    ctx->image = data + h.offset_data;
 
-    return 0;
+    if (imgr_check_layout(ih, n, pfRGB24, row_size_of(&h), h.height > 0)) {
+        return -1;
+    }
+    return imgr_set_image_size(ih, ctx, n, h.width, abs(h.height), ih->proxy);
 }
 
 
@@ -91,32 +429,42 @@ const char * VS_CC
 check_bmp(img_hnd_t *ih, int n, FILE *fp, vs_args_t *va)
 {
     bmp_header_t h = { 0 };
-    if (fread(&h, 1, sizeof(bmp_header_t), fp) != sizeof(bmp_header_t) ||
-        h.file_type != BMP_HEADER_MAGIC || h.header_size != 40 ||
-        h.num_planes != 1 || h.fourcc != 0 ||
-        (h.bits_per_pix != 1 && h.bits_per_pix != 2 &&
-         h.bits_per_pix != 4 && h.bits_per_pix != 8 &&
-         h.bits_per_pix != 24 && h.bits_per_pix != 32)) {
+    if (fread(&h, 1, sizeof(bmp_header_t), fp) != sizeof(bmp_header_t)) {
         return "unsupported format";
     }
+    const char *err = check_header(&h);
+    if (err) {
+        return err;
+    }
+    if (h.bits_per_pix == 16 || h.bits_per_pix == 32) {
+        uint8_t masks[BMP_MAX_MASKS_SIZE];
+        size_t read = fread(masks, 1, sizeof(masks), fp);
+        bitfields_t bf;
+        if (get_bitfields(&h, masks, read, &bf)) {
+            return "invalid bmp bitfields";
+        }
+    }
 
-    ih->src[n].width = abs(h.width);
+    ih->src[n].width = h.width;
 
     ih->src[n].height = abs(h.height);
     
     ih->src[n].format = va->vsapi->getFormatPreset(pfRGB24, va->core);
 
-    uint32_t row_size = (((ih->src[n].width * h.bits_per_pix + 7) / 8) + 3) & ~3;
-    ih->src[n].image_size = row_size * ih->src[n].height;
+    uint32_t row_size = row_size_of(&h);
+    /* the size of RLE images is checked while decoding */
+    ih->src[n].image_size = is_rle(&h) ? 0 : image_size_of(&h);
     if (row_size > va->max_row_size) {
         va->max_row_size = row_size;
     }
 
     ih->src[n].read = read_bmp;
-    ih->src[n].flip = 1;
+    /* positive height means bottom up rows */
+    ih->src[n].flip = h.height > 0;
 
     return NULL;
 }
 
 
 const func_check_src check_src_bmp = check_bmp;
+const func_read_image read_src_bmp = read_bmp;
@@ -0,0 +1,281 @@
+/*
+  cache.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+/* process-wide cache of decoded frames shared by all imgr.Read instances */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "imagereader.h"
+
+#define CACHE_NUM_BUCKETS 4096
+
+typedef struct cache_entry cache_entry_t;
+struct cache_entry {
+    cache_key_t key;
+    char *name;
+    const VSFrameRef *frame;
+    size_t bytes;
+    cache_entry_t *next_hash;
+    cache_entry_t *prev_lru; // toward most recently used
+    cache_entry_t *next_lru; // toward least recently used
+};
+
+typedef struct {
+    VSCore *core;
+    int users;
+} cache_user_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    cache_entry_t *buckets[CACHE_NUM_BUCKETS];
+    cache_entry_t *mru;
+    cache_entry_t *lru;
+    size_t budget;
+    size_t used;
+    cache_user_t *users;
+    int num_users;
+} cache = { PTHREAD_MUTEX_INITIALIZER };
+
+
+static uint32_t VS_CC hash_key(const cache_key_t *key)
+{
+    uint32_t h = 2166136261U;
+    for (const char *p = key->name; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619U;
+    }
+    const uint8_t *b = (const uint8_t *)&key->options;
+    for (size_t i = 0; i < sizeof(key->options); i++) {
+        h = (h ^ b[i]) * 16777619U;
+    }
+    b = (const uint8_t *)key->roi;
+    for (size_t i = 0; i < sizeof(key->roi); i++) {
+        h = (h ^ b[i]) * 16777619U;
+    }
+    return h;
+}
+
+
+static int VS_CC key_equal(const cache_key_t *a, const cache_key_t *b)
+{
+    return a->core == b->core && a->mtime == b->mtime &&
+           a->size == b->size && a->options == b->options &&
+           memcmp(a->roi, b->roi, sizeof(a->roi)) == 0 &&
+           strcmp(a->name, b->name) == 0;
+}
+
+
+static void VS_CC lru_unlink(cache_entry_t *e)
+{
+    if (e->prev_lru) {
+        e->prev_lru->next_lru = e->next_lru;
+    } else {
+        cache.mru = e->next_lru;
+    }
+    if (e->next_lru) {
+        e->next_lru->prev_lru = e->prev_lru;
+    } else {
+        cache.lru = e->prev_lru;
+    }
+    e->prev_lru = e->next_lru = NULL;
+}
+
+
+static void VS_CC lru_push_front(cache_entry_t *e)
+{
+    e->next_lru = cache.mru;
+    e->prev_lru = NULL;
+    if (cache.mru) {
+        cache.mru->prev_lru = e;
+    }
+    cache.mru = e;
+    if (!cache.lru) {
+        cache.lru = e;
+    }
+}
+
+
+static void VS_CC remove_entry(cache_entry_t *e, const VSAPI *vsapi)
+{
+    cache_entry_t **pp = &cache.buckets[hash_key(&e->key) % CACHE_NUM_BUCKETS];
+    while (*pp != e) {
+        pp = &(*pp)->next_hash;
+    }
+    *pp = e->next_hash;
+    lru_unlink(e);
+    cache.used -= e->bytes;
+    vsapi->freeFrame(e->frame);
+    free(e->name);
+    free(e);
+}
+
+
+static void VS_CC evict(size_t budget, const VSAPI *vsapi)
+{
+    while (cache.used > budget && cache.lru) {
+        remove_entry(cache.lru, vsapi);
+    }
+}
+
+
+/* registers an instance using the cache with the given byte budget.
+   the budget shared by all instances is the largest one requested. */
+void VS_CC imgr_cache_attach(VSCore *core, size_t budget)
+{
+    pthread_mutex_lock(&cache.mutex);
+    if (budget > cache.budget) {
+        cache.budget = budget;
+    }
+    for (int i = 0; i < cache.num_users; i++) {
+        if (cache.users[i].core == core) {
+            cache.users[i].users++;
+            pthread_mutex_unlock(&cache.mutex);
+            return;
+        }
+    }
+    cache_user_t *tmp = (cache_user_t *)realloc(cache.users,
+        sizeof(cache_user_t) * (cache.num_users + 1));
+    if (tmp) {
+        cache.users = tmp;
+        cache.users[cache.num_users].core = core;
+        cache.users[cache.num_users].users = 1;
+        cache.num_users++;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+
+/* frames belong to a core. when the last instance of a core goes away,
+   its frames are dropped before the core can be freed. */
+void VS_CC imgr_cache_detach(VSCore *core, const VSAPI *vsapi)
+{
+    pthread_mutex_lock(&cache.mutex);
+    int i = 0;
+    while (i < cache.num_users && cache.users[i].core != core) i++;
+    if (i == cache.num_users || --cache.users[i].users > 0) {
+        pthread_mutex_unlock(&cache.mutex);
+        return;
+    }
+    cache.users[i] = cache.users[--cache.num_users];
+
+    cache_entry_t *e = cache.mru;
+    while (e) {
+        cache_entry_t *next = e->next_lru;
+        if (e->key.core == core) {
+            remove_entry(e, vsapi);
+        }
+        e = next;
+    }
+    if (cache.num_users == 0) {
+        cache.budget = 0;
+    }
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+
+/* fills key for frame n. returns -1 if the file can't be stat'ed.
+   key->name may be the name buffer of the thread (see imgr_src_name). */
+int VS_CC
+imgr_cache_key(img_hnd_t *ih, int n, uint32_t options, VSCore *core,
+               cache_key_t *key)
+{
+    key->name = imgr_src_name(ih, n);
+    if (imgr_stat(key->name, &key->mtime, &key->size)) {
+        return -1;
+    }
+    key->options = options;
+    memcpy(key->roi, ih->roi, sizeof(key->roi));
+    key->core = core;
+    return 0;
+}
+
+
+/* returns a new reference of the cached frame or NULL */
+const VSFrameRef * VS_CC
+imgr_cache_get(const cache_key_t *key, const VSAPI *vsapi)
+{
+    const VSFrameRef *ret = NULL;
+    uint32_t h = hash_key(key) % CACHE_NUM_BUCKETS;
+
+    pthread_mutex_lock(&cache.mutex);
+    for (cache_entry_t *e = cache.buckets[h]; e; e = e->next_hash) {
+        if (key_equal(&e->key, key)) {
+            lru_unlink(e);
+            lru_push_front(e);
+            ret = vsapi->cloneFrameRef(e->frame);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache.mutex);
+
+    return ret;
+}
+
+
+void VS_CC
+imgr_cache_put(const cache_key_t *key, const VSFrameRef *frame,
+               const VSAPI *vsapi)
+{
+    const VSFormat *format = vsapi->getFrameFormat(frame);
+    size_t bytes = 0;
+    for (int i = 0; i < format->numPlanes; i++) {
+        bytes += (size_t)vsapi->getStride(frame, i) *
+                 vsapi->getFrameHeight(frame, i);
+    }
+
+    pthread_mutex_lock(&cache.mutex);
+    if (bytes > cache.budget) {
+        pthread_mutex_unlock(&cache.mutex);
+        return;
+    }
+
+    uint32_t h = hash_key(key) % CACHE_NUM_BUCKETS;
+    for (cache_entry_t *e = cache.buckets[h]; e; e = e->next_hash) {
+        if (key_equal(&e->key, key)) {
+            /* another thread decoded the same file meanwhile */
+            pthread_mutex_unlock(&cache.mutex);
+            return;
+        }
+    }
+
+    cache_entry_t *e = (cache_entry_t *)calloc(sizeof(cache_entry_t), 1);
+    char *name = e ? strdup(key->name) : NULL;
+    if (!name) {
+        free(e);
+        pthread_mutex_unlock(&cache.mutex);
+        return;
+    }
+    e->key = *key;
+    e->key.name = e->name = name;
+    e->frame = vsapi->cloneFrameRef(frame);
+    e->bytes = bytes;
+    e->next_hash = cache.buckets[h];
+    cache.buckets[h] = e;
+    lru_push_front(e);
+    cache.used += bytes;
+
+    evict(cache.budget, vsapi);
+    pthread_mutex_unlock(&cache.mutex);
+}
@@ -0,0 +1,1156 @@
+/*
+  deinterleave.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+/*
+  row kernels splitting packed pixels into planes.
+  dstp[] is in the order of the components in the source, so that the
+  writers handle RGB/BGR order and vertical flip by choosing the plane
+  pointers and their strides.
+  SIMD kernels process whole blocks only and leave the rest of the row to
+  the scalar tail, so they never read beyond the row.
+
+  palette images are turned into packed 4 byte pixels by the pal8 kernels
+  and then split by deint4_8.
+
+  bitfield kernels take 16/32bit pixels with arbitrary channel masks
+  (BMP BI_BITFIELDS). each field is scaled to 8bit: wider fields keep their
+  top 8 bits and narrower ones are filled by repeating their bits.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define IMGR_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define IMGR_NEON
+#include <arm_neon.h>
+#endif
+
+#include "imagereader.h"
+
+
+static inline uint32_t VS_CC
+bitor8to32(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
+{
+    return ((uint32_t)b0 << 24) | ((uint32_t)b1 << 16) |
+           ((uint32_t)b2 << 8) | (uint32_t)b3;
+}
+
+
+/* scalar reference kernels.
+   8bit ones write 4 pixels at once, so they may read up to 3 pixels
+   over the row and write up to 3 pixels into the padding of the planes. */
+
+static void VS_CC
+deint2_8_c(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    typedef struct {
+        uint8_t c[8];
+    } gray8a_t;
+
+    const gray8a_t *src = (const gray8a_t *)srcp;
+    uint32_t *dstp0 = (uint32_t *)dstp[0];
+    uint32_t *dstp1 = (uint32_t *)dstp[1];
+    for (int x = 0, num = (width + 3) / 4; x < num; x++) {
+        dstp0[x] = bitor8to32(src[x].c[6], src[x].c[4],
+                              src[x].c[2], src[x].c[0]);
+        dstp1[x] = bitor8to32(src[x].c[7], src[x].c[5],
+                              src[x].c[3], src[x].c[1]);
+    }
+}
+
+
+static void VS_CC
+deint3_8_c(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    typedef struct {
+        uint8_t c[12];
+    } rgb24_t;
+
+    const rgb24_t *src = (const rgb24_t *)srcp;
+    uint32_t *dstp0 = (uint32_t *)dstp[0];
+    uint32_t *dstp1 = (uint32_t *)dstp[1];
+    uint32_t *dstp2 = (uint32_t *)dstp[2];
+    for (int x = 0, num = (width + 3) / 4; x < num; x++) {
+        dstp0[x] = bitor8to32(src[x].c[9], src[x].c[6],
+                              src[x].c[3], src[x].c[0]);
+        dstp1[x] = bitor8to32(src[x].c[10], src[x].c[7],
+                              src[x].c[4], src[x].c[1]);
+        dstp2[x] = bitor8to32(src[x].c[11], src[x].c[8],
+                              src[x].c[5], src[x].c[2]);
+    }
+}
+
+
+static void VS_CC
+deint4_8_c(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    typedef struct {
+        uint8_t c[16];
+    } rgb32_t;
+
+    const rgb32_t *src = (const rgb32_t *)srcp;
+    uint32_t *dstp0 = (uint32_t *)dstp[0];
+    uint32_t *dstp1 = (uint32_t *)dstp[1];
+    uint32_t *dstp2 = (uint32_t *)dstp[2];
+    uint32_t *dstp3 = (uint32_t *)dstp[3];
+    for (int x = 0, num = (width + 3) / 4; x < num; x++) {
+        dstp0[x] = bitor8to32(src[x].c[12], src[x].c[8],
+                              src[x].c[4],  src[x].c[0]);
+        dstp1[x] = bitor8to32(src[x].c[13], src[x].c[9],
+                              src[x].c[5],  src[x].c[1]);
+        dstp2[x] = bitor8to32(src[x].c[14], src[x].c[10],
+                              src[x].c[6],  src[x].c[2]);
+        dstp3[x] = bitor8to32(src[x].c[15], src[x].c[11],
+                              src[x].c[7],  src[x].c[3]);
+    }
+}
+
+
+static void VS_CC
+deint2_16_c(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const uint16_t *src = (const uint16_t *)srcp;
+    uint16_t *dstp0 = (uint16_t *)dstp[0];
+    uint16_t *dstp1 = (uint16_t *)dstp[1];
+    for (int x = 0; x < width; x++) {
+        dstp0[x] = src[x * 2];
+        dstp1[x] = src[x * 2 + 1];
+    }
+}
+
+
+static void VS_CC
+deint3_16_c(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const uint16_t *src = (const uint16_t *)srcp;
+    uint16_t *dstp0 = (uint16_t *)dstp[0];
+    uint16_t *dstp1 = (uint16_t *)dstp[1];
+    uint16_t *dstp2 = (uint16_t *)dstp[2];
+    for (int x = 0; x < width; x++) {
+        dstp0[x] = src[x * 3];
+        dstp1[x] = src[x * 3 + 1];
+        dstp2[x] = src[x * 3 + 2];
+    }
+}
+
+
+static void VS_CC
+deint4_16_c(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const uint16_t *src = (const uint16_t *)srcp;
+    uint16_t *dstp0 = (uint16_t *)dstp[0];
+    uint16_t *dstp1 = (uint16_t *)dstp[1];
+    uint16_t *dstp2 = (uint16_t *)dstp[2];
+    uint16_t *dstp3 = (uint16_t *)dstp[3];
+    for (int x = 0; x < width; x++) {
+        dstp0[x] = src[x * 4];
+        dstp1[x] = src[x * 4 + 1];
+        dstp2[x] = src[x * 4 + 2];
+        dstp3[x] = src[x * 4 + 3];
+    }
+}
+
+
+static void VS_CC
+pal8_c(const uint8_t *idx, const uint32_t *palette, uint32_t *dstp, int width)
+{
+    for (int x = 0; x < width; x++) {
+        dstp[x] = palette[idx[x]];
+    }
+}
+
+
+/* indices of the pixels packed in a byte, MSB first */
+static uint8_t unpack1[256][8];
+static uint8_t unpack2[256][4];
+static uint8_t unpack4[256][2];
+
+
+static void VS_CC init_unpack_tables(void)
+{
+    for (int b = 0; b < 256; b++) {
+        for (int i = 0; i < 8; i++) {
+            unpack1[b][i] = (b >> (7 - i)) & 0x01;
+        }
+        for (int i = 0; i < 4; i++) {
+            unpack2[b][i] = (b >> (6 - i * 2)) & 0x03;
+        }
+        unpack4[b][0] = b >> 4;
+        unpack4[b][1] = b & 0x0F;
+    }
+}
+
+
+/* expands width indices of 1/2/4 bits into bytes.
+   dstp needs room for the last byte to be expanded whole. */
+void VS_CC
+imgr_unpack_indices(const uint8_t *srcp, uint8_t *dstp, int width, int bits)
+{
+    int num = (width * bits + 7) / 8;
+    switch (bits) {
+    case 1:
+        for (int i = 0; i < num; i++) {
+            memcpy(dstp + i * 8, unpack1[srcp[i]], 8);
+        }
+        break;
+    case 2:
+        for (int i = 0; i < num; i++) {
+            memcpy(dstp + i * 4, unpack2[srcp[i]], 4);
+        }
+        break;
+    case 4:
+        for (int i = 0; i < num; i++) {
+            memcpy(dstp + i * 2, unpack4[srcp[i]], 2);
+        }
+        break;
+    default:
+        memcpy(dstp, srcp, width);
+    }
+}
+
+
+static inline uint8_t
+scale_field(uint32_t px, uint32_t mask, int shift, int bits, int size)
+{
+    if (bits == 0) {
+        return 0;
+    }
+    uint32_t t = ((px >> shift) & mask) << (size - bits);
+    if (bits < 8) {
+        t |= t >> bits;
+        t |= t >> (bits * 2);
+        t |= t >> (bits * 4);
+    }
+    return (uint8_t)(t >> (size - 8));
+}
+
+
+/* pixels are loaded with memcpy, since the rows of the mmap'd files may
+   not be aligned */
+static void VS_CC
+bitfield16_c(const uint8_t *srcp, uint8_t * const *dstp, int width, int num,
+             const bitfields_t *bf)
+{
+    for (int i = 0; i < num; i++) {
+        uint32_t mask = (1u << bf->bits[i]) - 1;
+        for (int x = 0; x < width; x++) {
+            uint16_t pix;
+            memcpy(&pix, srcp + x * 2, 2);
+            dstp[i][x] = scale_field(pix, mask, bf->shift[i], bf->bits[i],
+                                     16);
+        }
+    }
+}
+
+
+static void VS_CC
+bitfield32_c(const uint8_t *srcp, uint8_t * const *dstp, int width, int num,
+             const bitfields_t *bf)
+{
+    for (int i = 0; i < num; i++) {
+        uint32_t mask = (uint32_t)((1ull << bf->bits[i]) - 1);
+        for (int x = 0; x < width; x++) {
+            uint32_t pix;
+            memcpy(&pix, srcp + x * 4, 4);
+            dstp[i][x] = scale_field(pix, mask, bf->shift[i], bf->bits[i],
+                                     32);
+        }
+    }
+}
+
+
+/* finishes pixels from x to width of a row one by one */
+static inline void
+deint_tail(const uint8_t *srcp, uint8_t * const *dstp, int x, int width,
+           int num, int bytes)
+{
+    for (; x < width; x++) {
+        for (int i = 0; i < num; i++) {
+            memcpy(dstp[i] + x * bytes, srcp + (x * num + i) * bytes, bytes);
+        }
+    }
+}
+
+
+#ifdef IMGR_X86
+
+/* pshufb masks picking component k of 16 pixels (8bit) or 8 pixels
+   (16bit) out of the 3 registers of 3 component pixels */
+static const int8_t shuf3_8[9][16] __attribute__((aligned(16))) = {
+    {  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  1,  4,  7, 10, 13 },
+    {  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  5,  8, 11, 14 },
+    {  2,  5,  8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1,  1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  3,  6,  9, 12, 15 },
+};
+
+static const int8_t shuf3_16[9][16] __attribute__((aligned(16))) = {
+    {  0,  1,  6,  7, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1,  2,  3,  8,  9, 14, 15, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  4,  5, 10, 11 },
+    {  2,  3,  8,  9, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1,  4,  5, 10, 11, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  1,  6,  7, 12, 13 },
+    {  4,  5, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1,  0,  1,  6,  7, 12, 13, -1, -1, -1, -1, -1, -1 },
+    { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  3,  8,  9, 14, 15 },
+};
+
+/* groups the bytes of 4 pixels by component */
+static const int8_t shuf4_8[16] __attribute__((aligned(16))) = {
+    0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15
+};
+
+
+/* SSE2 */
+
+__attribute__((target("sse2"))) static void VS_CC
+deint2_8_sse2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(srcp + x * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *)(srcp + x * 2 + 16));
+        __m128i c0 = _mm_packus_epi16(_mm_and_si128(a, mask),
+                                      _mm_and_si128(b, mask));
+        __m128i c1 = _mm_packus_epi16(_mm_srli_epi16(a, 8),
+                                      _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *)(dstp[0] + x), c0);
+        _mm_storeu_si128((__m128i *)(dstp[1] + x), c1);
+    }
+    deint_tail(srcp, dstp, x, width, 2, 1);
+}
+
+
+__attribute__((target("sse2"))) static void VS_CC
+deint4_8_sse2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i *s = (const __m128i *)(srcp + x * 4);
+        __m128i v0 = _mm_loadu_si128(s);
+        __m128i v1 = _mm_loadu_si128(s + 1);
+        __m128i v2 = _mm_loadu_si128(s + 2);
+        __m128i v3 = _mm_loadu_si128(s + 3);
+        for (int i = 0; i < 4; i++) {
+            __m128i p01 = _mm_packs_epi32(_mm_and_si128(v0, mask),
+                                          _mm_and_si128(v1, mask));
+            __m128i p23 = _mm_packs_epi32(_mm_and_si128(v2, mask),
+                                          _mm_and_si128(v3, mask));
+            _mm_storeu_si128((__m128i *)(dstp[i] + x),
+                             _mm_packus_epi16(p01, p23));
+            v0 = _mm_srli_epi32(v0, 8);
+            v1 = _mm_srli_epi32(v1, 8);
+            v2 = _mm_srli_epi32(v2, 8);
+            v3 = _mm_srli_epi32(v3, 8);
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 4, 1);
+}
+
+
+__attribute__((target("sse2"))) static void VS_CC
+deint2_16_sse2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(srcp + x * 4));
+        __m128i b = _mm_loadu_si128((const __m128i *)(srcp + x * 4 + 16));
+        /* sign extension keeps the bits through the signed pack */
+        __m128i c0 = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                                     _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+        __m128i c1 = _mm_packs_epi32(_mm_srai_epi32(a, 16),
+                                     _mm_srai_epi32(b, 16));
+        _mm_storeu_si128((__m128i *)(dstp[0] + x * 2), c0);
+        _mm_storeu_si128((__m128i *)(dstp[1] + x * 2), c1);
+    }
+    deint_tail(srcp, dstp, x, width, 2, 2);
+}
+
+
+__attribute__((target("sse2"))) static void VS_CC
+deint4_16_sse2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m128i *s = (const __m128i *)(srcp + x * 8);
+        __m128i v0 = _mm_loadu_si128(s);
+        __m128i v1 = _mm_loadu_si128(s + 1);
+        __m128i v2 = _mm_loadu_si128(s + 2);
+        __m128i v3 = _mm_loadu_si128(s + 3);
+        __m128i t0 = _mm_unpacklo_epi16(v0, v1);
+        __m128i t1 = _mm_unpackhi_epi16(v0, v1);
+        __m128i t2 = _mm_unpacklo_epi16(v2, v3);
+        __m128i t3 = _mm_unpackhi_epi16(v2, v3);
+        __m128i u0 = _mm_unpacklo_epi16(t0, t1);
+        __m128i u1 = _mm_unpackhi_epi16(t0, t1);
+        __m128i u2 = _mm_unpacklo_epi16(t2, t3);
+        __m128i u3 = _mm_unpackhi_epi16(t2, t3);
+        _mm_storeu_si128((__m128i *)(dstp[0] + x * 2),
+                         _mm_unpacklo_epi64(u0, u2));
+        _mm_storeu_si128((__m128i *)(dstp[1] + x * 2),
+                         _mm_unpackhi_epi64(u0, u2));
+        _mm_storeu_si128((__m128i *)(dstp[2] + x * 2),
+                         _mm_unpacklo_epi64(u1, u3));
+        _mm_storeu_si128((__m128i *)(dstp[3] + x * 2),
+                         _mm_unpackhi_epi64(u1, u3));
+    }
+    deint_tail(srcp, dstp, x, width, 4, 2);
+}
+
+
+/* SSSE3 */
+
+__attribute__((target("ssse3"))) static inline __m128i
+gather3_ssse3(__m128i a, __m128i b, __m128i c, const int8_t (*m)[16])
+{
+    __m128i r = _mm_shuffle_epi8(a, _mm_load_si128((const __m128i *)m[0]));
+    r = _mm_or_si128(r, _mm_shuffle_epi8(b, _mm_load_si128((const __m128i *)m[1])));
+    return _mm_or_si128(r, _mm_shuffle_epi8(c, _mm_load_si128((const __m128i *)m[2])));
+}
+
+
+__attribute__((target("ssse3"))) static void VS_CC
+deint3_8_ssse3(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i *s = (const __m128i *)(srcp + x * 3);
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        __m128i c = _mm_loadu_si128(s + 2);
+        for (int i = 0; i < 3; i++) {
+            _mm_storeu_si128((__m128i *)(dstp[i] + x),
+                             gather3_ssse3(a, b, c, shuf3_8 + i * 3));
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 3, 1);
+}
+
+
+__attribute__((target("ssse3"))) static void VS_CC
+deint4_8_ssse3(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m128i m = _mm_load_si128((const __m128i *)shuf4_8);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i *s = (const __m128i *)(srcp + x * 4);
+        __m128i s0 = _mm_shuffle_epi8(_mm_loadu_si128(s), m);
+        __m128i s1 = _mm_shuffle_epi8(_mm_loadu_si128(s + 1), m);
+        __m128i s2 = _mm_shuffle_epi8(_mm_loadu_si128(s + 2), m);
+        __m128i s3 = _mm_shuffle_epi8(_mm_loadu_si128(s + 3), m);
+        __m128i t0 = _mm_unpacklo_epi32(s0, s1);
+        __m128i t1 = _mm_unpackhi_epi32(s0, s1);
+        __m128i t2 = _mm_unpacklo_epi32(s2, s3);
+        __m128i t3 = _mm_unpackhi_epi32(s2, s3);
+        _mm_storeu_si128((__m128i *)(dstp[0] + x), _mm_unpacklo_epi64(t0, t2));
+        _mm_storeu_si128((__m128i *)(dstp[1] + x), _mm_unpackhi_epi64(t0, t2));
+        _mm_storeu_si128((__m128i *)(dstp[2] + x), _mm_unpacklo_epi64(t1, t3));
+        _mm_storeu_si128((__m128i *)(dstp[3] + x), _mm_unpackhi_epi64(t1, t3));
+    }
+    deint_tail(srcp, dstp, x, width, 4, 1);
+}
+
+
+__attribute__((target("ssse3"))) static void VS_CC
+deint3_16_ssse3(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m128i *s = (const __m128i *)(srcp + x * 6);
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        __m128i c = _mm_loadu_si128(s + 2);
+        for (int i = 0; i < 3; i++) {
+            _mm_storeu_si128((__m128i *)(dstp[i] + x * 2),
+                             gather3_ssse3(a, b, c, shuf3_16 + i * 3));
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 3, 2);
+}
+
+
+/* AVX2: the lanes work as two SSSE3 registers, then are put in order */
+
+__attribute__((target("avx2"))) static inline __m256i
+load2x128(const uint8_t *lo, const uint8_t *hi)
+{
+    __m256i r = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    return _mm256_inserti128_si256(r, _mm_loadu_si128((const __m128i *)hi), 1);
+}
+
+
+__attribute__((target("avx2"))) static inline __m256i
+gather3_avx2(__m256i a, __m256i b, __m256i c, const int8_t (*m)[16])
+{
+    __m256i m0 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)m[0]));
+    __m256i m1 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)m[1]));
+    __m256i m2 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)m[2]));
+    __m256i r = _mm256_shuffle_epi8(a, m0);
+    r = _mm256_or_si256(r, _mm256_shuffle_epi8(b, m1));
+    return _mm256_or_si256(r, _mm256_shuffle_epi8(c, m2));
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+deint2_8_avx2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00FF);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(srcp + x * 2));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(srcp + x * 2 + 32));
+        __m256i c0 = _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                                         _mm256_and_si256(b, mask));
+        __m256i c1 = _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                         _mm256_srli_epi16(b, 8));
+        _mm256_storeu_si256((__m256i *)(dstp[0] + x),
+                            _mm256_permute4x64_epi64(c0, 0xD8));
+        _mm256_storeu_si256((__m256i *)(dstp[1] + x),
+                            _mm256_permute4x64_epi64(c1, 0xD8));
+    }
+    deint_tail(srcp, dstp, x, width, 2, 1);
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+deint3_8_avx2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        const uint8_t *s = srcp + x * 3;
+        __m256i a = load2x128(s, s + 48);
+        __m256i b = load2x128(s + 16, s + 64);
+        __m256i c = load2x128(s + 32, s + 80);
+        for (int i = 0; i < 3; i++) {
+            _mm256_storeu_si256((__m256i *)(dstp[i] + x),
+                                gather3_avx2(a, b, c, shuf3_8 + i * 3));
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 3, 1);
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+deint4_8_avx2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m256i m =
+        _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)shuf4_8));
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int x = 0;
+    for (; x + 32 <= width; x += 32) {
+        const __m256i *s = (const __m256i *)(srcp + x * 4);
+        __m256i s0 = _mm256_shuffle_epi8(_mm256_loadu_si256(s), m);
+        __m256i s1 = _mm256_shuffle_epi8(_mm256_loadu_si256(s + 1), m);
+        __m256i s2 = _mm256_shuffle_epi8(_mm256_loadu_si256(s + 2), m);
+        __m256i s3 = _mm256_shuffle_epi8(_mm256_loadu_si256(s + 3), m);
+        __m256i t0 = _mm256_unpacklo_epi32(s0, s1);
+        __m256i t1 = _mm256_unpackhi_epi32(s0, s1);
+        __m256i t2 = _mm256_unpacklo_epi32(s2, s3);
+        __m256i t3 = _mm256_unpackhi_epi32(s2, s3);
+        __m256i c[4] = {
+            _mm256_unpacklo_epi64(t0, t2), _mm256_unpackhi_epi64(t0, t2),
+            _mm256_unpacklo_epi64(t1, t3), _mm256_unpackhi_epi64(t1, t3)
+        };
+        for (int i = 0; i < 4; i++) {
+            _mm256_storeu_si256((__m256i *)(dstp[i] + x),
+                                _mm256_permutevar8x32_epi32(c[i], order));
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 4, 1);
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+deint2_16_avx2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m256i mask = _mm256_set1_epi32(0xFFFF);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(srcp + x * 4));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(srcp + x * 4 + 32));
+        __m256i c0 = _mm256_packus_epi32(_mm256_and_si256(a, mask),
+                                         _mm256_and_si256(b, mask));
+        __m256i c1 = _mm256_packus_epi32(_mm256_srli_epi32(a, 16),
+                                         _mm256_srli_epi32(b, 16));
+        _mm256_storeu_si256((__m256i *)(dstp[0] + x * 2),
+                            _mm256_permute4x64_epi64(c0, 0xD8));
+        _mm256_storeu_si256((__m256i *)(dstp[1] + x * 2),
+                            _mm256_permute4x64_epi64(c1, 0xD8));
+    }
+    deint_tail(srcp, dstp, x, width, 2, 2);
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+deint3_16_avx2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8_t *s = srcp + x * 6;
+        __m256i a = load2x128(s, s + 48);
+        __m256i b = load2x128(s + 16, s + 64);
+        __m256i c = load2x128(s + 32, s + 80);
+        for (int i = 0; i < 3; i++) {
+            _mm256_storeu_si256((__m256i *)(dstp[i] + x * 2),
+                                gather3_avx2(a, b, c, shuf3_16 + i * 3));
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 3, 2);
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+deint4_16_avx2(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m256i *s = (const __m256i *)(srcp + x * 8);
+        __m256i v0 = _mm256_loadu_si256(s);
+        __m256i v1 = _mm256_loadu_si256(s + 1);
+        __m256i v2 = _mm256_loadu_si256(s + 2);
+        __m256i v3 = _mm256_loadu_si256(s + 3);
+        __m256i t0 = _mm256_unpacklo_epi16(v0, v1);
+        __m256i t1 = _mm256_unpackhi_epi16(v0, v1);
+        __m256i t2 = _mm256_unpacklo_epi16(v2, v3);
+        __m256i t3 = _mm256_unpackhi_epi16(v2, v3);
+        __m256i u0 = _mm256_unpacklo_epi16(t0, t1);
+        __m256i u1 = _mm256_unpackhi_epi16(t0, t1);
+        __m256i u2 = _mm256_unpacklo_epi16(t2, t3);
+        __m256i u3 = _mm256_unpackhi_epi16(t2, t3);
+        __m256i c[4] = {
+            _mm256_unpacklo_epi64(u0, u2), _mm256_unpackhi_epi64(u0, u2),
+            _mm256_unpacklo_epi64(u1, u3), _mm256_unpackhi_epi64(u1, u3)
+        };
+        for (int i = 0; i < 4; i++) {
+            _mm256_storeu_si256((__m256i *)(dstp[i] + x * 2),
+                                _mm256_permutevar8x32_epi32(c[i], order));
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 4, 2);
+}
+
+
+/* bitfields: shifts by register so that one kernel serves any masks.
+   counts over the lane width give 0, which the scalar code matches. */
+
+__attribute__((target("sse2"))) static inline __m128i
+scale16_sse2(__m128i px, __m128i mask, __m128i shift, __m128i up,
+             __m128i b1, __m128i b2, __m128i b4)
+{
+    __m128i t = _mm_sll_epi16(_mm_and_si128(_mm_srl_epi16(px, shift), mask), up);
+    t = _mm_or_si128(t, _mm_srl_epi16(t, b1));
+    t = _mm_or_si128(t, _mm_srl_epi16(t, b2));
+    t = _mm_or_si128(t, _mm_srl_epi16(t, b4));
+    return _mm_srli_epi16(t, 8);
+}
+
+
+__attribute__((target("sse2"))) static void VS_CC
+bitfield16_sse2(const uint8_t *srcp, uint8_t * const *dstp, int width,
+                int num, const bitfields_t *bf)
+{
+    int x = 0;
+    for (int i = 0; i < num; i++) {
+        int bits = bf->bits[i];
+        __m128i mask = _mm_set1_epi16((short)((1u << bits) - 1));
+        __m128i shift = _mm_cvtsi32_si128(bf->shift[i]);
+        __m128i up = _mm_cvtsi32_si128(16 - bits);
+        __m128i b1 = _mm_cvtsi32_si128(bits);
+        __m128i b2 = _mm_cvtsi32_si128(bits * 2);
+        __m128i b4 = _mm_cvtsi32_si128(bits * 4);
+        for (x = 0; x + 16 <= width; x += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(srcp + x * 2));
+            __m128i b = _mm_loadu_si128((const __m128i *)(srcp + x * 2 + 16));
+            a = scale16_sse2(a, mask, shift, up, b1, b2, b4);
+            b = scale16_sse2(b, mask, shift, up, b1, b2, b4);
+            _mm_storeu_si128((__m128i *)(dstp[i] + x), _mm_packus_epi16(a, b));
+        }
+    }
+    uint8_t *tail[4] = { dstp[0] + x, dstp[1] + x, dstp[2] + x,
+                         num > 3 ? dstp[3] + x : NULL };
+    bitfield16_c(srcp + x * 2, tail, width - x, num, bf);
+}
+
+
+__attribute__((target("sse2"))) static inline __m128i
+scale32_sse2(__m128i px, __m128i mask, __m128i shift, __m128i up,
+             __m128i b1, __m128i b2, __m128i b4)
+{
+    __m128i t = _mm_sll_epi32(_mm_and_si128(_mm_srl_epi32(px, shift), mask), up);
+    t = _mm_or_si128(t, _mm_srl_epi32(t, b1));
+    t = _mm_or_si128(t, _mm_srl_epi32(t, b2));
+    t = _mm_or_si128(t, _mm_srl_epi32(t, b4));
+    return _mm_srli_epi32(t, 24);
+}
+
+
+__attribute__((target("sse2"))) static void VS_CC
+bitfield32_sse2(const uint8_t *srcp, uint8_t * const *dstp, int width,
+                int num, const bitfields_t *bf)
+{
+    int x = 0;
+    for (int i = 0; i < num; i++) {
+        int bits = bf->bits[i];
+        __m128i mask = _mm_set1_epi32((int)(uint32_t)((1ull << bits) - 1));
+        __m128i shift = _mm_cvtsi32_si128(bf->shift[i]);
+        __m128i up = _mm_cvtsi32_si128(32 - bits);
+        __m128i b1 = _mm_cvtsi32_si128(bits);
+        __m128i b2 = _mm_cvtsi32_si128(bits * 2);
+        __m128i b4 = _mm_cvtsi32_si128(bits * 4);
+        if (bits == 0) {
+            /* a count of 32 for up would keep the bits */
+            mask = _mm_setzero_si128();
+        }
+        for (x = 0; x + 16 <= width; x += 16) {
+            const __m128i *s = (const __m128i *)(srcp + x * 4);
+            __m128i v[4];
+            for (int k = 0; k < 4; k++) {
+                v[k] = scale32_sse2(_mm_loadu_si128(s + k), mask, shift, up,
+                                    b1, b2, b4);
+            }
+            __m128i lo = _mm_packs_epi32(v[0], v[1]);
+            __m128i hi = _mm_packs_epi32(v[2], v[3]);
+            _mm_storeu_si128((__m128i *)(dstp[i] + x), _mm_packus_epi16(lo, hi));
+        }
+    }
+    uint8_t *tail[4] = { dstp[0] + x, dstp[1] + x, dstp[2] + x,
+                         num > 3 ? dstp[3] + x : NULL };
+    bitfield32_c(srcp + x * 4, tail, width - x, num, bf);
+}
+
+
+__attribute__((target("avx2"))) static inline __m256i
+scale16_avx2(__m256i px, __m256i mask, __m128i shift, __m128i up,
+             __m128i b1, __m128i b2, __m128i b4)
+{
+    __m256i t = _mm256_sll_epi16(_mm256_and_si256(_mm256_srl_epi16(px, shift), mask), up);
+    t = _mm256_or_si256(t, _mm256_srl_epi16(t, b1));
+    t = _mm256_or_si256(t, _mm256_srl_epi16(t, b2));
+    t = _mm256_or_si256(t, _mm256_srl_epi16(t, b4));
+    return _mm256_srli_epi16(t, 8);
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+bitfield16_avx2(const uint8_t *srcp, uint8_t * const *dstp, int width,
+                int num, const bitfields_t *bf)
+{
+    int x = 0;
+    for (int i = 0; i < num; i++) {
+        int bits = bf->bits[i];
+        __m256i mask = _mm256_set1_epi16((short)((1u << bits) - 1));
+        __m128i shift = _mm_cvtsi32_si128(bf->shift[i]);
+        __m128i up = _mm_cvtsi32_si128(16 - bits);
+        __m128i b1 = _mm_cvtsi32_si128(bits);
+        __m128i b2 = _mm_cvtsi32_si128(bits * 2);
+        __m128i b4 = _mm_cvtsi32_si128(bits * 4);
+        for (x = 0; x + 32 <= width; x += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(srcp + x * 2));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(srcp + x * 2 + 32));
+            a = scale16_avx2(a, mask, shift, up, b1, b2, b4);
+            b = scale16_avx2(b, mask, shift, up, b1, b2, b4);
+            _mm256_storeu_si256((__m256i *)(dstp[i] + x),
+                                _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+        }
+    }
+    uint8_t *tail[4] = { dstp[0] + x, dstp[1] + x, dstp[2] + x,
+                         num > 3 ? dstp[3] + x : NULL };
+    bitfield16_sse2(srcp + x * 2, tail, width - x, num, bf);
+}
+
+
+__attribute__((target("avx2"))) static inline __m256i
+scale32_avx2(__m256i px, __m256i mask, __m128i shift, __m128i up,
+             __m128i b1, __m128i b2, __m128i b4)
+{
+    __m256i t = _mm256_sll_epi32(_mm256_and_si256(_mm256_srl_epi32(px, shift), mask), up);
+    t = _mm256_or_si256(t, _mm256_srl_epi32(t, b1));
+    t = _mm256_or_si256(t, _mm256_srl_epi32(t, b2));
+    t = _mm256_or_si256(t, _mm256_srl_epi32(t, b4));
+    return _mm256_srli_epi32(t, 24);
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+bitfield32_avx2(const uint8_t *srcp, uint8_t * const *dstp, int width,
+                int num, const bitfields_t *bf)
+{
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int x = 0;
+    for (int i = 0; i < num; i++) {
+        int bits = bf->bits[i];
+        __m256i mask = _mm256_set1_epi32((int)(uint32_t)((1ull << bits) - 1));
+        __m128i shift = _mm_cvtsi32_si128(bf->shift[i]);
+        __m128i up = _mm_cvtsi32_si128(32 - bits);
+        __m128i b1 = _mm_cvtsi32_si128(bits);
+        __m128i b2 = _mm_cvtsi32_si128(bits * 2);
+        __m128i b4 = _mm_cvtsi32_si128(bits * 4);
+        if (bits == 0) {
+            mask = _mm256_setzero_si256();
+        }
+        for (x = 0; x + 32 <= width; x += 32) {
+            const __m256i *s = (const __m256i *)(srcp + x * 4);
+            __m256i v[4];
+            for (int k = 0; k < 4; k++) {
+                v[k] = scale32_avx2(_mm256_loadu_si256(s + k), mask, shift, up,
+                                    b1, b2, b4);
+            }
+            __m256i lo = _mm256_packs_epi32(v[0], v[1]);
+            __m256i hi = _mm256_packs_epi32(v[2], v[3]);
+            _mm256_storeu_si256((__m256i *)(dstp[i] + x),
+                                _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), order));
+        }
+    }
+    uint8_t *tail[4] = { dstp[0] + x, dstp[1] + x, dstp[2] + x,
+                         num > 3 ? dstp[3] + x : NULL };
+    bitfield32_sse2(srcp + x * 4, tail, width - x, num, bf);
+}
+
+
+__attribute__((target("avx2"))) static void VS_CC
+pal8_avx2(const uint8_t *idx, const uint32_t *palette, uint32_t *dstp, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i i = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(idx + x)));
+        _mm256_storeu_si256((__m256i *)(dstp + x),
+                            _mm256_i32gather_epi32((const int *)palette, i, 4));
+    }
+    for (; x < width; x++) {
+        dstp[x] = palette[idx[x]];
+    }
+}
+
+
+#ifdef HAVE_AVX512
+/* AVX-512BW: 8bit kernels on four lanes. 16bit ones use AVX2. */
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i
+load4x128(const uint8_t *p, int step)
+{
+    __m512i r = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)p));
+    r = _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i *)(p + step)), 1);
+    r = _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i *)(p + step * 2)), 2);
+    return _mm512_inserti32x4(r, _mm_loadu_si128((const __m128i *)(p + step * 3)), 3);
+}
+
+
+__attribute__((target("avx512f,avx512bw"))) static void VS_CC
+deint2_8_avx512(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m512i mask = _mm512_set1_epi16(0x00FF);
+    const __m512i order = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        __m512i a = _mm512_loadu_si512((const void *)(srcp + x * 2));
+        __m512i b = _mm512_loadu_si512((const void *)(srcp + x * 2 + 64));
+        __m512i c0 = _mm512_packus_epi16(_mm512_and_si512(a, mask),
+                                         _mm512_and_si512(b, mask));
+        __m512i c1 = _mm512_packus_epi16(_mm512_srli_epi16(a, 8),
+                                         _mm512_srli_epi16(b, 8));
+        _mm512_storeu_si512((void *)(dstp[0] + x),
+                            _mm512_permutexvar_epi64(order, c0));
+        _mm512_storeu_si512((void *)(dstp[1] + x),
+                            _mm512_permutexvar_epi64(order, c1));
+    }
+    deint_tail(srcp, dstp, x, width, 2, 1);
+}
+
+
+__attribute__((target("avx512f,avx512bw"))) static void VS_CC
+deint3_8_avx512(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        const uint8_t *s = srcp + x * 3;
+        __m512i a = load4x128(s, 48);
+        __m512i b = load4x128(s + 16, 48);
+        __m512i c = load4x128(s + 32, 48);
+        for (int i = 0; i < 3; i++) {
+            const int8_t (*m)[16] = shuf3_8 + i * 3;
+            __m512i r = _mm512_shuffle_epi8(a,
+                _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)m[0])));
+            r = _mm512_or_si512(r, _mm512_shuffle_epi8(b,
+                _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)m[1]))));
+            r = _mm512_or_si512(r, _mm512_shuffle_epi8(c,
+                _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)m[2]))));
+            _mm512_storeu_si512((void *)(dstp[i] + x), r);
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 3, 1);
+}
+
+
+__attribute__((target("avx512f,avx512bw"))) static void VS_CC
+deint4_8_avx512(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    const __m512i m =
+        _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)shuf4_8));
+    /* lane l of component register j has pixels 16j + 4l to 16j + 4l + 3 */
+    const __m512i order = _mm512_setr_epi32(0, 4, 8, 12, 1, 5, 9, 13,
+                                            2, 6, 10, 14, 3, 7, 11, 15);
+    int x = 0;
+    for (; x + 64 <= width; x += 64) {
+        const uint8_t *s = srcp + x * 4;
+        __m512i s0 = _mm512_shuffle_epi8(_mm512_loadu_si512((const void *)s), m);
+        __m512i s1 = _mm512_shuffle_epi8(_mm512_loadu_si512((const void *)(s + 64)), m);
+        __m512i s2 = _mm512_shuffle_epi8(_mm512_loadu_si512((const void *)(s + 128)), m);
+        __m512i s3 = _mm512_shuffle_epi8(_mm512_loadu_si512((const void *)(s + 192)), m);
+        __m512i t0 = _mm512_unpacklo_epi32(s0, s1);
+        __m512i t1 = _mm512_unpackhi_epi32(s0, s1);
+        __m512i t2 = _mm512_unpacklo_epi32(s2, s3);
+        __m512i t3 = _mm512_unpackhi_epi32(s2, s3);
+        __m512i c[4] = {
+            _mm512_unpacklo_epi64(t0, t2), _mm512_unpackhi_epi64(t0, t2),
+            _mm512_unpacklo_epi64(t1, t3), _mm512_unpackhi_epi64(t1, t3)
+        };
+        for (int i = 0; i < 4; i++) {
+            _mm512_storeu_si512((void *)(dstp[i] + x),
+                                _mm512_permutexvar_epi32(order, c[i]));
+        }
+    }
+    deint_tail(srcp, dstp, x, width, 4, 1);
+}
+
+
+__attribute__((target("avx512f,avx512bw"))) static void VS_CC
+pal8_avx512(const uint8_t *idx, const uint32_t *palette, uint32_t *dstp,
+            int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m512i i = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(idx + x)));
+        _mm512_storeu_si512((void *)(dstp + x),
+                            _mm512_i32gather_epi32(i, (const void *)palette, 4));
+    }
+    for (; x < width; x++) {
+        dstp[x] = palette[idx[x]];
+    }
+}
+#endif /* HAVE_AVX512 */
+
+#endif /* IMGR_X86 */
+
+
+#ifdef IMGR_NEON
+
+static void VS_CC
+deint2_8_neon(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x2_t v = vld2q_u8(srcp + x * 2);
+        vst1q_u8(dstp[0] + x, v.val[0]);
+        vst1q_u8(dstp[1] + x, v.val[1]);
+    }
+    deint_tail(srcp, dstp, x, width, 2, 1);
+}
+
+
+static void VS_CC
+deint3_8_neon(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x3_t v = vld3q_u8(srcp + x * 3);
+        vst1q_u8(dstp[0] + x, v.val[0]);
+        vst1q_u8(dstp[1] + x, v.val[1]);
+        vst1q_u8(dstp[2] + x, v.val[2]);
+    }
+    deint_tail(srcp, dstp, x, width, 3, 1);
+}
+
+
+static void VS_CC
+deint4_8_neon(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t v = vld4q_u8(srcp + x * 4);
+        vst1q_u8(dstp[0] + x, v.val[0]);
+        vst1q_u8(dstp[1] + x, v.val[1]);
+        vst1q_u8(dstp[2] + x, v.val[2]);
+        vst1q_u8(dstp[3] + x, v.val[3]);
+    }
+    deint_tail(srcp, dstp, x, width, 4, 1);
+}
+
+
+static void VS_CC
+deint2_16_neon(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint16x8x2_t v = vld2q_u16((const uint16_t *)srcp + x * 2);
+        vst1q_u16((uint16_t *)dstp[0] + x, v.val[0]);
+        vst1q_u16((uint16_t *)dstp[1] + x, v.val[1]);
+    }
+    deint_tail(srcp, dstp, x, width, 2, 2);
+}
+
+
+static void VS_CC
+deint3_16_neon(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint16x8x3_t v = vld3q_u16((const uint16_t *)srcp + x * 3);
+        vst1q_u16((uint16_t *)dstp[0] + x, v.val[0]);
+        vst1q_u16((uint16_t *)dstp[1] + x, v.val[1]);
+        vst1q_u16((uint16_t *)dstp[2] + x, v.val[2]);
+    }
+    deint_tail(srcp, dstp, x, width, 3, 2);
+}
+
+
+static void VS_CC
+deint4_16_neon(const uint8_t *srcp, uint8_t * const *dstp, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint16x8x4_t v = vld4q_u16((const uint16_t *)srcp + x * 4);
+        vst1q_u16((uint16_t *)dstp[0] + x, v.val[0]);
+        vst1q_u16((uint16_t *)dstp[1] + x, v.val[1]);
+        vst1q_u16((uint16_t *)dstp[2] + x, v.val[2]);
+        vst1q_u16((uint16_t *)dstp[3] + x, v.val[3]);
+    }
+    deint_tail(srcp, dstp, x, width, 4, 2);
+}
+
+#endif /* IMGR_NEON */
+
+
+static const deint_kernels_t kernels_c = {
+    "c",
+    deint2_8_c, deint3_8_c, deint4_8_c,
+    deint2_16_c, deint3_16_c, deint4_16_c,
+    pal8_c,
+    bitfield16_c, bitfield32_c
+};
+
+#ifdef IMGR_X86
+static const deint_kernels_t kernels_sse2 = {
+    "sse2",
+    deint2_8_sse2, deint3_8_c, deint4_8_sse2,
+    deint2_16_sse2, deint3_16_c, deint4_16_sse2,
+    pal8_c,
+    bitfield16_sse2, bitfield32_sse2
+};
+
+static const deint_kernels_t kernels_ssse3 = {
+    "ssse3",
+    deint2_8_sse2, deint3_8_ssse3, deint4_8_ssse3,
+    deint2_16_sse2, deint3_16_ssse3, deint4_16_sse2,
+    pal8_c,
+    bitfield16_sse2, bitfield32_sse2
+};
+
+static const deint_kernels_t kernels_avx2 = {
+    "avx2",
+    deint2_8_avx2, deint3_8_avx2, deint4_8_avx2,
+    deint2_16_avx2, deint3_16_avx2, deint4_16_avx2,
+    pal8_avx2,
+    bitfield16_avx2, bitfield32_avx2
+};
+
+#ifdef HAVE_AVX512
+static const deint_kernels_t kernels_avx512 = {
+    "avx512",
+    deint2_8_avx512, deint3_8_avx512, deint4_8_avx512,
+    deint2_16_avx2, deint3_16_avx2, deint4_16_avx2,
+    pal8_avx512,
+    bitfield16_avx2, bitfield32_avx2
+};
+#endif
+#endif
+
+#ifdef IMGR_NEON
+static const deint_kernels_t kernels_neon = {
+    "neon",
+    deint2_8_neon, deint3_8_neon, deint4_8_neon,
+    deint2_16_neon, deint3_16_neon, deint4_16_neon,
+    pal8_c,
+    bitfield16_c, bitfield32_c
+};
+#endif
+
+static const deint_kernels_t *kernels = &kernels_c;
+
+
+/* picks the best kernels for the cpu. environment variable IMGR_SIMD
+   limits them to the named set (c, sse2, ssse3, avx2, avx512 or neon). */
+void VS_CC imgr_init_deint_kernels(void)
+{
+    const deint_kernels_t *sets[8];
+    int num = 0;
+    init_unpack_tables();
+    sets[num++] = &kernels_c;
+#ifdef IMGR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sets[num++] = &kernels_sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        sets[num++] = &kernels_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sets[num++] = &kernels_avx2;
+    }
+#ifdef HAVE_AVX512
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw")) {
+        sets[num++] = &kernels_avx512;
+    }
+#endif
+#endif
+#ifdef IMGR_NEON
+    sets[num++] = &kernels_neon;
+#endif
+
+    kernels = sets[num - 1];
+    const char *limit = getenv("IMGR_SIMD");
+    for (int i = 0; limit && i < num; i++) {
+        if (strcmp(limit, sets[i]->name) == 0) {
+            kernels = sets[i];
+        }
+    }
+}
+
+
+const deint_kernels_t * VS_CC imgr_deint_kernels(void)
+{
+    return kernels;
+}
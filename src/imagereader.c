@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include <stdarg.h>
 
 #include "turbojpeg.h"
@@ -35,6 +36,162 @@
 
 #define VS_IMGR_VERSION "0.2.1"
 #define INITIAL_SRC_BUFF_SIZE (2 * 1024 * 1024) /* 2MiByte */
+#define DEFAULT_PREFETCH_MEM 256 /* MiByte */
+#define PROBE_CHUNK 16 /* files taken by a probing worker at once */
+#define SIBLING_SLOTS_MIN 4
+
+
+static void VS_CC free_context(img_ctx_t *ctx)
+{
+    if (ctx->tjhandle && tjDestroy((tjhandle)ctx->tjhandle)) {
+        fprintf(stderr, "%s\n", tjGetErrorStr());
+    }
+    free(ctx->src_buff);
+    free(ctx->image_buff);
+    free(ctx->png_row_index);
+    free(ctx->proxy_buff);
+    free(ctx);
+}
+
+
+/* grows the image buffer of the context to size bytes at least.
+   writers may read 32 bytes beyond the rows. */
+uint8_t * VS_CC imgr_image_buffer(img_ctx_t *ctx, size_t size)
+{
+    if (size > ctx->image_buff_size) {
+        uint8_t *buff = (uint8_t *)realloc(ctx->image_buff, size + 32);
+        if (!buff) {
+            return NULL;
+        }
+        ctx->image_buff = buff;
+        ctx->image_buff_size = size;
+    }
+    return ctx->image_buff;
+}
+
+
+static img_ctx_t * VS_CC create_context(img_hnd_t *ih)
+{
+    img_ctx_t *ctx = (img_ctx_t *)calloc(sizeof(img_ctx_t), 1);
+    if (!ctx) {
+        return NULL;
+    }
+
+    ctx->tjhandle = tjInitDecompress();
+    ctx->src_buff = (uint8_t *)malloc(INITIAL_SRC_BUFF_SIZE);
+    ctx->src_buff_size = INITIAL_SRC_BUFF_SIZE;
+    if (!ctx->tjhandle || !ctx->src_buff) {
+        free_context(ctx);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ih->ctx_mutex);
+    ctx->next = ih->ctx_list;
+    ih->ctx_list = ctx;
+    pthread_mutex_unlock(&ih->ctx_mutex);
+
+    return ctx;
+}
+
+
+static void VS_CC release_context(img_hnd_t *ih, img_ctx_t *ctx)
+{
+    pthread_mutex_lock(&ih->ctx_mutex);
+    ctx->next_idle = ih->ctx_idle;
+    ih->ctx_idle = ctx;
+    pthread_mutex_unlock(&ih->ctx_mutex);
+}
+
+
+static img_ctx_t * VS_CC acquire_context(img_hnd_t *ih)
+{
+    pthread_mutex_lock(&ih->ctx_mutex);
+    img_ctx_t *ctx = ih->ctx_idle;
+    if (ctx) {
+        ih->ctx_idle = ctx->next_idle;
+    }
+    pthread_mutex_unlock(&ih->ctx_mutex);
+
+    if (!ctx) {
+        return create_context(ih);
+    }
+    return ctx;
+}
+
+
+static void VS_CC
+set_duration(VSFrameRef *frame, const VSVideoInfo *vi, const VSAPI *vsapi)
+{
+    VSMap *props = vsapi->getFramePropsRW(frame);
+    vsapi->propSetInt(props, "_DurationNum", vi->fpsDen, paReplace);
+    vsapi->propSetInt(props, "_DurationDen", vi->fpsNum, paReplace);
+}
+
+
+/* takes the output index of frame n if it was decoded with the other one */
+static VSFrameRef * VS_CC take_sibling(img_hnd_t *ih, int n, int index)
+{
+    VSFrameRef *frame = NULL;
+    pthread_mutex_lock(&ih->alpha_mutex);
+    ih->requested[index] = 1;
+    for (int i = 0; i < ih->num_siblings; i++) {
+        sibling_t *sb = ih->siblings + i;
+        if (sb->frame && sb->n == n && sb->index == index) {
+            frame = sb->frame;
+            sb->frame = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ih->alpha_mutex);
+    return frame;
+}
+
+
+/* keeps a frame for the request of the other output, if that output has
+   ever been requested. the oldest one is dropped when all slots are used. */
+static void VS_CC
+put_sibling(img_hnd_t *ih, int n, int index, VSFrameRef *frame,
+            const VSAPI *vsapi)
+{
+    pthread_mutex_lock(&ih->alpha_mutex);
+    if (!ih->requested[index]) {
+        pthread_mutex_unlock(&ih->alpha_mutex);
+        vsapi->freeFrame(frame);
+        return;
+    }
+    sibling_t *sb = ih->siblings + ih->next_sibling;
+    ih->next_sibling = (ih->next_sibling + 1) % ih->num_siblings;
+    VSFrameRef *old = sb->frame;
+    sb->n = n;
+    sb->index = index;
+    sb->frame = frame;
+    pthread_mutex_unlock(&ih->alpha_mutex);
+    vsapi->freeFrame(old);
+}
+
+
+static image_type_t VS_CC type_of(const src_info_t *src)
+{
+    if (src->read == read_src_bmp) {
+        return IMG_TYPE_BMP;
+    }
+    if (src->read == read_src_jpeg) {
+        return IMG_TYPE_JPG;
+    }
+    if (src->read == read_src_png) {
+        return IMG_TYPE_PNG;
+    }
+    if (src->read == read_src_tga) {
+        return IMG_TYPE_TGA;
+    }
+    return IMG_TYPE_NONE;
+}
+
+
+/* names of the trace events of src.read, indexed by image_type_t */
+static const char * const read_names[] = {
+    "read", "read_bmp", "read_jpeg", "read_png", "read_tga"
+};
 
 
 static const VSFrameRef * VS_CC
@@ -53,38 +210,135 @@ img_get_frame(int n, int activation_reason, void **instance_data,
         frame_number = ih->vi[0].numFrames - 1;
     }
 
-    if (ih->src[frame_number].read(ih, frame_number)) {
+    int index = ih->enable_alpha ? vsapi->getOutputIndex(frame_ctx) : 0;
+
+    /* options: bit0 = output index, bit1 = alpha enabled, bit2-5 = proxy,
+       bit6 = fast */
+    uint32_t options = (ih->enable_alpha << 1) | (ih->proxy << 2) |
+                       ((ih->tj_flags != 0) << 6);
+    cache_key_t key[2];
+    int use_cache = ih->enable_cache &&
+        imgr_cache_key(ih, frame_number, options, core, key) == 0;
+    if (use_cache) {
+        key[1] = key[0];
+        key[1].options |= 1;
+        const VSFrameRef *cached = imgr_cache_get(key + index, vsapi);
+        if (cached) {
+            VSFrameRef *ret = vsapi->copyFrame(cached, core);
+            vsapi->freeFrame(cached);
+            set_duration(ret, ih->vi + index, vsapi);
+            return ret;
+        }
+    }
+
+    if (ih->enable_alpha) {
+        VSFrameRef *sibling = take_sibling(ih, frame_number, index);
+        if (sibling) {
+            return sibling;
+        }
+    }
+
+    if (ih->prefetcher) {
+        prefetch_notify(ih->prefetcher, frame_number);
+    }
+
+    img_ctx_t *ctx = acquire_context(ih);
+    if (!ctx) {
+        vsapi->setFilterError("failed to create decoding context",
+                              frame_ctx);
         return NULL;
     }
-    ih->row_adjust--;
+    memset(&ctx->stats, 0, sizeof(frame_stats_t));
+    int64_t start = imgr_now();
 
-    VSFrameRef *dst[2];
+    /* readers of the images scaled or cropped set their own size */
+    ctx->width = ih->src[frame_number].width;
+    ctx->height = ih->src[frame_number].height;
+    ctx->roi_left = ctx->roi_top = 0;
+    ctx->roi_width = ctx->width;
+    ctx->roi_height = ctx->height;
+    ctx->proxy = 1;
+    image_type_t type = type_of(ih->src + frame_number);
+    /* the readers check the files not probed yet */
+    int unchecked = ih->lazy_state && !ih->lazy_state[frame_number];
+    int64_t read_start = imgr_now();
+    __sync_fetch_and_add(&ih->decoding, 1);
+    if (ih->src[frame_number].read(ih, ctx, frame_number)) {
+        __sync_fetch_and_sub(&ih->decoding, 1);
+        imgr_release_source(ih, ctx);
+        release_context(ih, ctx);
+        char msg[256];
+        snprintf(msg, sizeof(msg), "file %d: failed to read image%s",
+                 frame_number,
+                 unchecked ? ", or it differs from the first file" : "");
+        vsapi->setFilterError(msg, frame_ctx);
+        return NULL;
+    }
+    trace_event(ih->trace, read_names[type], frame_number, read_start,
+                imgr_now());
+    ctx->row_adjust--;
+
+    VSFrameRef *dst[2] = { NULL, NULL };
     dst[0] = vsapi->newVideoFrame(ih->src[frame_number].format,
                                   ih->src[frame_number].width,
                                   ih->src[frame_number].height,
                                   NULL, core);
+    set_duration(dst[0], ih->vi, vsapi);
 
-    VSMap *props = vsapi->getFramePropsRW(dst[0]);
-    vsapi->propSetInt(props, "_DurationNum", ih->vi[0].fpsDen, paReplace);
-    vsapi->propSetInt(props, "_DurationDen", ih->vi[0].fpsNum, paReplace);
+    ctx->write_frame(ih, ctx, frame_number, dst, core, vsapi);
+    __sync_fetch_and_sub(&ih->decoding, 1);
+    int64_t end = imgr_now();
+    trace_event(ih->trace, "frame", frame_number, start, end);
+    frame_stats_t stats = ctx->stats;
+    stats.decode_ns = end - start - stats.read_ns - stats.write_ns;
+    stats.bytes = ctx->source.size;
+    imgr_release_source(ih, ctx);
+    release_context(ih, ctx);
+    if (!dst[0]) {
+        /* decoders writing into the frame free it on failure */
+        vsapi->freeFrame(dst[1]);
+        if (unchecked) {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "file %d: failed to decode image, "
+                     "or it differs from the first file", frame_number);
+            vsapi->setFilterError(msg, frame_ctx);
+        } else {
+            vsapi->setFilterError("failed to decode image", frame_ctx);
+        }
+        return NULL;
+    }
+    if (unchecked) {
+        ih->lazy_state[frame_number] = 1;
+    }
 
-    ih->write_frame(ih, frame_number, dst, core, vsapi);
+    if (ih->enable_alpha) {
+        if (!dst[1]) {
+            vsapi->freeFrame(dst[0]);
+            vsapi->setFilterError("failed to create alpha frame", frame_ctx);
+            return NULL;
+        }
+        set_duration(dst[1], ih->vi + 1, vsapi);
+    }
 
-    if (ih->enable_alpha == 0) {
-        return dst[0];
+    imgr_stats_add(type, &stats);
+    if (ih->stats_props) {
+        for (int i = 0; i <= ih->enable_alpha; i++) {
+            imgr_stats_set_props(dst[i], &stats, vsapi);
+        }
     }
 
-    if (vsapi->getOutputIndex(frame_ctx) == 0) {
-        vsapi->freeFrame(dst[1]);
-        return dst[0];
+    if (use_cache) {
+        for (int i = 0; i <= ih->enable_alpha; i++) {
+            imgr_cache_put(key + i, dst[i], vsapi);
+        }
     }
 
-    vsapi->freeFrame(dst[0]);
-    props = vsapi->getFramePropsRW(dst[1]);
-    vsapi->propSetInt(props, "_DurationNum", ih->vi[1].fpsDen, paReplace);
-    vsapi->propSetInt(props, "_DurationDen", ih->vi[1].fpsNum, paReplace);
+    if (ih->enable_alpha) {
+        /* both outputs are decoded at once */
+        put_sibling(ih, frame_number, !index, dst[!index], vsapi);
+    }
 
-    return dst[1];
+    return dst[index];
 }
 
 
@@ -104,26 +358,38 @@ close_handler(void *instance_data, VSCore *core, const VSAPI *vsapi)
     if (!ih) {
         return;
     }
-    if (ih->tjhandle && tjDestroy((tjhandle)ih->tjhandle)) {
-        fprintf(stderr, tjGetErrorStr());
+    if (ih->enable_cache) {
+        imgr_cache_detach(core, vsapi);
+    }
+    prefetch_destroy(ih->prefetcher);
+    ih->prefetcher = NULL;
+    pool_destroy(ih->pool);
+    ih->pool = NULL;
+    while (ih->ctx_list) {
+        img_ctx_t *next = ih->ctx_list->next;
+        free_context(ih->ctx_list);
+        ih->ctx_list = next;
     }
-    ih->tjhandle = NULL;
+    ih->ctx_idle = NULL;
     if (ih->src) {
         free(ih->src);
         ih->src = NULL;
     }
-    if (ih->src_buff) {
-        free(ih->src_buff);
-        ih->src_buff = NULL;
+    free(ih->pattern);
+    free(ih->lazy_state);
+    for (int i = 0; i < ih->num_siblings; i++) {
+        vsapi->freeFrame(ih->siblings[i].frame);
     }
-    if (ih->image_buff) {
-        free(ih->image_buff);
-        ih->image_buff = NULL;
-    }
-    if (ih->png_row_index) {
-        free(ih->png_row_index);
-        ih->png_row_index = NULL;
+    free(ih->siblings);
+    while (ih->zero_alpha) {
+        zero_alpha_t *next = ih->zero_alpha->next;
+        vsapi->freeFrame(ih->zero_alpha->frame);
+        free(ih->zero_alpha);
+        ih->zero_alpha = next;
     }
+    trace_close(ih->trace);
+    pthread_mutex_destroy(&ih->ctx_mutex);
+    pthread_mutex_destroy(&ih->alpha_mutex);
     free(ih);
     ih = NULL;
 }
@@ -145,7 +411,7 @@ static image_type_t VS_CC detect_image_type(FILE *fp)
     if (sof == 0x5089) {
         return IMG_TYPE_PNG;
     }
-    if (((uint8_t *)&sof)[1] == 0x00) { // 0x01(color map) is unsupported.
+    if (((uint8_t *)&sof)[1] <= 0x01) { // color map type of TGA
         return IMG_TYPE_TGA;
     }
     
@@ -153,8 +419,37 @@ static image_type_t VS_CC detect_image_type(FILE *fp)
 }
 
 
+/* crops src[n] to the region of interest. the region is given in the
+   coordinates of the frame made with proxy. */
+static const char * VS_CC apply_crop(img_hnd_t *ih, int n)
+{
+    if (!ih->crop) {
+        return NULL;
+    }
+
+    const int *roi = ih->roi;
+    int width = roi[2] ? roi[2] : ih->src[n].width - roi[0];
+    int height = roi[3] ? roi[3] : ih->src[n].height - roi[1];
+    if (width <= 0 || height <= 0 || roi[0] + width > ih->src[n].width ||
+        roi[1] + height > ih->src[n].height) {
+        return "crop region is out of the image";
+    }
+    const VSFormat *format = ih->src[n].format;
+    if (((roi[0] | width) & ((1 << format->subSamplingW) - 1)) ||
+        ((roi[1] | height) & ((1 << format->subSamplingH) - 1))) {
+        return "crop region is not aligned to the chroma subsampling";
+    }
+
+    ih->src[n].width = width;
+    ih->src[n].height = height;
+    return NULL;
+}
+
+
+/* probes file n. if me is not NULL, the results are stored into it.
+   the manifest keeps the size before crop. */
 static const char * VS_CC
-check_src_props(img_hnd_t *ih, int n, vs_args_t *va)
+check_src_props(img_hnd_t *ih, int n, vs_args_t *va, manifest_entry_t *me)
 {
     const func_check_src check_src[] = {
         NULL,
@@ -164,7 +459,9 @@ check_src_props(img_hnd_t *ih, int n, vs_args_t *va)
         check_src_tga
     };
 
-    FILE *fp = imgr_fopen(ih->src[n].name);
+    int64_t t = imgr_probe_start(va);
+    FILE *fp = imgr_fopen(imgr_src_name(ih, n), "rb", L"rb");
+    t = imgr_probe_time(va, PROBE_OPEN, t);
     if (!fp) {
         return "failed to open file";
     }
@@ -175,43 +472,352 @@ check_src_props(img_hnd_t *ih, int n, vs_args_t *va)
         return "unsupported format";
     }
 
-    fseek(fp, 0, SEEK_SET);
+    if (fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return "file is not seekable";
+    }
+    t = imgr_probe_time(va, PROBE_DETECT, t);
+    int max_row_size = va->max_row_size;
+    va->max_row_size = 0;
     const char *ret = check_src[img_type](ih, n, fp, va);
+    int row_size = va->max_row_size;
+    va->max_row_size = row_size > max_row_size ? row_size : max_row_size;
 
+    if (va->probe) {
+        int64_t now = imgr_now();
+        va->probe->check_ns[img_type] += now - t;
+        va->probe->files[img_type]++;
+        long pos = ftell(fp);
+        va->probe->bytes += pos > 0 ? pos : 0;
+        t = now;
+    }
     fclose(fp);
+    imgr_probe_time(va, PROBE_CLOSE, t);
     if (ret) {
         return ret;
     }
 
+    /* jpeg is scaled by libturbojpeg, and the others by the writers */
+    if (img_type != IMG_TYPE_JPG) {
+        ih->src[n].width = IMG_PROXY_SIZE(ih->src[n].width, ih->proxy);
+        ih->src[n].height = IMG_PROXY_SIZE(ih->src[n].height, ih->proxy);
+    }
+
     if (va->max_height < ih->src[n].height) {
         va->max_height = ih->src[n].height;
     }
-    if (n == 0) {
-        ih->vi[0].width = ih->src[0].width;
-        ih->vi[0].height = ih->src[0].height;
-        ih->vi[0].format = ih->src[0].format;
+
+    if (me) {
+        me->image_size = ih->src[n].image_size;
+        me->format_id = ih->src[n].format->id;
+        me->row_size = row_size;
+        me->width = ih->src[n].width;
+        me->height = ih->src[n].height;
+        me->type = img_type;
+        me->flip = ih->src[n].flip;
     }
 
-    if ((va->variable_width << 2 |
-         va->variable_height << 1 |
-         va->variable_format) == 3) {
+    return apply_crop(ih, n);
+}
+
+
+/* fills src[n] with a manifest entry instead of probing the file */
+static int VS_CC
+restore_src_props(img_hnd_t *ih, int n, vs_args_t *va,
+                  const manifest_entry_t *me)
+{
+    const func_read_image read_src[] = {
+        NULL,
+        read_src_bmp,
+        read_src_jpeg,
+        read_src_png,
+        read_src_tga
+    };
+
+    /* entries without a size were not made by probing, so are stale */
+    if (me->type <= IMG_TYPE_NONE || me->type > IMG_TYPE_TGA ||
+        me->width == 0 || me->height == 0) {
+        return -1;
+    }
+    const VSFormat *format = va->vsapi->getFormatPreset(me->format_id,
+                                                        va->core);
+    if (!format) {
+        return -1;
+    }
+
+    ih->src[n].read = read_src[me->type];
+    ih->src[n].image_size = me->image_size;
+    ih->src[n].width = me->width;
+    ih->src[n].height = me->height;
+    ih->src[n].format = format;
+    ih->src[n].flip = me->flip;
+
+    if (va->max_row_size < me->row_size) {
+        va->max_row_size = me->row_size;
+    }
+    if (va->max_height < me->height) {
+        va->max_height = me->height;
+    }
+
+    return apply_crop(ih, n) ? -1 : 0;
+}
+
+
+typedef struct {
+    img_hnd_t *ih;
+    int num_srcs;
+    int next; // next file to be taken by a worker
+    int error_index; // lowest failed file, num_srcs if none
+    const manifest_t *manifest;
+    manifest_entry_t *entries; // new manifest, NULL if not used
+    int stale; // some entries were probed again
+} probe_job_t;
+
+typedef struct {
+    probe_job_t *job;
+    vs_args_t va;
+    probe_stats_t probe;
+    int error_index;
+    const char *error;
+    pthread_t thread;
+} probe_worker_t;
+
+
+static const char * VS_CC
+probe_or_restore(probe_job_t *job, int n, vs_args_t *va)
+{
+    img_hnd_t *ih = job->ih;
+    if (!job->entries) {
+        return check_src_props(ih, n, va, NULL);
+    }
+
+    int64_t t = imgr_probe_start(va);
+    manifest_entry_t *me = job->entries + n;
+    const char *name = imgr_src_name(ih, n);
+    if (imgr_stat(name, &me->mtime, &me->size)) {
+        return "failed to open file";
+    }
+    const manifest_entry_t *old = manifest_lookup(job->manifest, n, name);
+    int restored = old && old->mtime == me->mtime &&
+                   old->size == me->size &&
+                   restore_src_props(ih, n, va, old) == 0;
+    imgr_probe_time(va, PROBE_MANIFEST, t);
+    if (restored) {
+        *me = *old;
+        if (va->probe) {
+            va->probe->restored++;
+        }
         return NULL;
     }
 
-    if (ih->vi[0].width != ih->src[n].width) {
-        va->variable_width = 1;
+    job->stale = 1;
+    return check_src_props(ih, n, va, me);
+}
+
+
+static const char * VS_CC
+probe_file(probe_job_t *job, int n, vs_args_t *va)
+{
+    int64_t start = imgr_probe_start(va);
+    const char *ret = probe_or_restore(job, n, va);
+    if (va->probe) {
+        imgr_probe_file(va->probe, n, imgr_now() - start);
+    }
+    return ret;
+}
+
+
+static void *probe_worker(void *arg)
+{
+    probe_worker_t *pw = (probe_worker_t *)arg;
+    probe_job_t *job = pw->job;
+
+    for (;;) {
+        int start = __sync_fetch_and_add(&job->next, PROBE_CHUNK);
+        /* files after a known failure don't affect the result */
+        if (start >= job->num_srcs || start > job->error_index) {
+            break;
+        }
+        int end = start + PROBE_CHUNK;
+        if (end > job->num_srcs) {
+            end = job->num_srcs;
+        }
+        for (int i = start; i < end; i++) {
+            const char *ret = probe_file(job, i, &pw->va);
+            if (ret) {
+                pw->error_index = i;
+                pw->error = ret;
+                int cur = job->error_index;
+                while (i < cur &&
+                       !__sync_bool_compare_and_swap(&job->error_index,
+                                                     cur, i)) {
+                    cur = job->error_index;
+                }
+                return NULL;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/* probes all files on num_threads workers. results are merged in the
+   order of the files, so they don't depend on the scheduling.
+   if manifest_path is given, files not modified since the manifest was
+   written are not probed, and the manifest is updated afterwards.
+   if va->probe is given, the profiles of the workers are merged into it. */
+static const char * VS_CC
+probe_sources(img_hnd_t *ih, int num_srcs, int num_threads,
+              const char *manifest_path, vs_args_t *va, int *error_index)
+{
+    int64_t start = imgr_probe_start(va);
+    int max_threads = (num_srcs + PROBE_CHUNK - 1) / PROBE_CHUNK;
+    if (num_threads > max_threads) {
+        num_threads = max_threads;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+
+    probe_worker_t *pw =
+        (probe_worker_t *)calloc(sizeof(probe_worker_t), num_threads);
+    if (!pw) {
+        *error_index = -1;
+        return "failed to allocate probing workers";
     }
-    if (ih->vi[0].height != ih->src[n].height) {
-        va->variable_height = 1;
+
+    probe_job_t job = { ih, num_srcs, 0, num_srcs, NULL, NULL, 0 };
+    uint32_t options = ih->enable_alpha | ((ih->proxy - 1) << 1);
+    if (manifest_path) {
+        job.entries =
+            (manifest_entry_t *)calloc(sizeof(manifest_entry_t), num_srcs);
+        if (!job.entries) {
+            free(pw);
+            *error_index = -1;
+            return "failed to allocate manifest entries";
+        }
+        job.manifest = manifest_open(manifest_path, options);
     }
-    if (ih->vi[0].format != ih->src[n].format) {
-        va->variable_format = 1;
+
+    for (int i = 0; i < num_threads; i++) {
+        pw[i].job = &job;
+        pw[i].va = *va;
+        pw[i].error_index = num_srcs;
+        if (va->probe) {
+            pw[i].va.probe = &pw[i].probe;
+        }
+    }
+    /* the first worker is this thread with the caller's context. the files
+       are taken in chunks, so the workers started probe all of them even if
+       the contexts or the threads of the others can't be made. */
+    int started = 1;
+    for (; started < num_threads; started++) {
+        probe_worker_t *w = pw + started;
+        int64_t t = imgr_probe_start(va);
+        w->va.ctx = create_context(ih);
+        imgr_probe_time(&w->va, PROBE_CONTEXT, t);
+        if (!w->va.ctx) {
+            break;
+        }
+        if (pthread_create(&w->thread, NULL, probe_worker, w)) {
+            release_context(ih, w->va.ctx);
+            break;
+        }
+    }
+    probe_worker(pw);
+    for (int i = 1; i < started; i++) {
+        pthread_join(pw[i].thread, NULL);
+    }
+
+    const char *ret = NULL;
+    *error_index = num_srcs;
+    for (int i = 0; i < started; i++) {
+        if (pw[i].error_index < *error_index) {
+            *error_index = pw[i].error_index;
+            ret = pw[i].error;
+        }
+        if (pw[i].va.max_row_size > va->max_row_size) {
+            va->max_row_size = pw[i].va.max_row_size;
+        }
+        if (pw[i].va.max_height > va->max_height) {
+            va->max_height = pw[i].va.max_height;
+        }
+        if (va->probe) {
+            imgr_probe_merge(va->probe, &pw[i].probe);
+        }
+    }
+    for (int i = 1; i < started; i++) {
+        release_context(ih, pw[i].va.ctx);
+    }
+    free(pw);
+
+    if (!ret && job.entries &&
+        (job.stale || manifest_count(job.manifest) != (uint64_t)num_srcs)) {
+        manifest_close((manifest_t *)job.manifest);
+        job.manifest = NULL;
+        if (manifest_write(manifest_path, options, ih, job.entries,
+                           num_srcs)) {
+            fprintf(stderr, "imgr: failed to write manifest %s\n",
+                    manifest_path);
+        }
+    }
+    manifest_close((manifest_t *)job.manifest);
+    free(job.entries);
+    if (va->probe) {
+        va->probe->threads = started;
+        va->probe->probe_ns = imgr_now() - start;
+    }
+    if (ret) {
+        return ret;
+    }
+
+    ih->vi[0].width = ih->src[0].width;
+    ih->vi[0].height = ih->src[0].height;
+    ih->vi[0].format = ih->src[0].format;
+    for (int i = 1; i < num_srcs; i++) {
+        if (ih->vi[0].width != ih->src[i].width) {
+            va->variable_width = 1;
+        }
+        if (ih->vi[0].height != ih->src[i].height) {
+            va->variable_height = 1;
+        }
+        if (ih->vi[0].format != ih->src[i].format) {
+            va->variable_format = 1;
+        }
     }
 
     return NULL;
 }
 
 
+/* pattern must have just one conversion of an int, such as %d or %06d */
+static int VS_CC check_pattern(const char *pattern)
+{
+    int conversions = 0;
+    for (const char *p = pattern; *p; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        p++;
+        if (*p == '%') {
+            continue;
+        }
+        while (*p && strchr("-+ #0", *p)) {
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+        if (*p != 'd' && *p != 'i') {
+            return -1;
+        }
+        conversions++;
+    }
+    return conversions == 1 ? 0 : -1;
+}
+
+
 #define RET_IF_ERR(cond, ...) {\
     if (cond) {\
         close_handler(ih, core, vsapi);\
@@ -225,6 +831,7 @@ static void VS_CC
 create_reader(const VSMap *in, VSMap *out, void *user_data, VSCore *core,
               const VSAPI *vsapi)
 {
+    int64_t create_start = imgr_now();
     const char *filter_name = (const char *)user_data;
     char msg_buff[256] = { 0 };
     sprintf(msg_buff, "%s: ", filter_name);
@@ -232,37 +839,155 @@ create_reader(const VSMap *in, VSMap *out, void *user_data, VSCore *core,
 
     img_hnd_t *ih = (img_hnd_t *)calloc(sizeof(img_hnd_t), 1);
     RET_IF_ERR(!ih, "failed to create handler");
+    pthread_mutex_init(&ih->ctx_mutex, NULL);
+    pthread_mutex_init(&ih->alpha_mutex, NULL);
+
+    int err;
 
-    int num_srcs = vsapi->propNumElements(in, "files");
-    RET_IF_ERR(num_srcs < 1, "no source file");
+    const char *pattern = vsapi->propGetData(in, "pattern", 0, &err);
+    int num_srcs;
+    if (err) {
+        num_srcs = vsapi->propNumElements(in, "files");
+        RET_IF_ERR(num_srcs < 1, "no source file");
+    } else {
+        RET_IF_ERR(vsapi->propNumElements(in, "files") > 0,
+                   "files and pattern can't be used together");
+        RET_IF_ERR(check_pattern(pattern),
+                   "pattern must have just one %%d conversion");
+        int64_t first = vsapi->propGetInt(in, "first", 0, &err);
+        if (err) {
+            first = 0;
+        }
+        int64_t last = vsapi->propGetInt(in, "last", 0, &err);
+        RET_IF_ERR(err, "last is required with pattern");
+        int64_t step = vsapi->propGetInt(in, "step", 0, &err);
+        if (err) {
+            step = 1;
+        }
+        RET_IF_ERR(step == 0, "step must not be 0");
+        RET_IF_ERR(first < INT_MIN || first > INT_MAX || last < INT_MIN ||
+                   last > INT_MAX || step < INT_MIN || step > INT_MAX,
+                   "first, last and step must be 32-bit integers");
+        RET_IF_ERR((last < first && step > 0) || (last > first && step < 0),
+                   "last can't be reached from first by step");
+        int64_t count = (last - first) / step + 1;
+        RET_IF_ERR(count > INT_MAX, "too many files");
+        num_srcs = (int)count;
+        ih->first = (int)first;
+        ih->step = (int)step;
+        RET_IF_ERR(snprintf(NULL, 0, pattern, ih->first) >= FILENAME_MAX * 2 ||
+                   snprintf(NULL, 0, pattern, (int)last) >= FILENAME_MAX * 2,
+                   "pattern makes too long file names");
+        ih->pattern = strdup(pattern);
+        RET_IF_ERR(!ih->pattern, "failed to allocate pattern");
+    }
     ih->vi[0].numFrames = num_srcs;
 
-    ih->src = (src_info_t *)malloc(sizeof(src_info_t) * num_srcs);
+    ih->src = (src_info_t *)calloc(sizeof(src_info_t), num_srcs);
     RET_IF_ERR(!ih->src, "failed to allocate array of src infomation");
 
-    ih->tjhandle = tjInitDecompress();
-    RET_IF_ERR(!ih->tjhandle, "%s", tjGetErrorStr());
-
-    ih->src_buff = (uint8_t *)malloc(INITIAL_SRC_BUFF_SIZE);
-    RET_IF_ERR(!ih->src_buff, "failed to allocate src read buffer");
-    ih->src_buff_size = INITIAL_SRC_BUFF_SIZE;
-
-    int err;
+    img_ctx_t *ctx = create_context(ih);
+    RET_IF_ERR(!ctx, "failed to create decoding context");
 
     int alpha = (int)vsapi->propGetInt(in, "alpha", 0, &err);
     if (err) {
         alpha = 0;
     }
     ih->enable_alpha = !!alpha;
+    if (ih->enable_alpha) {
+        ih->num_siblings = vsapi->getCoreInfo(core)->numThreads * 2;
+        if (ih->num_siblings < SIBLING_SLOTS_MIN) {
+            ih->num_siblings = SIBLING_SLOTS_MIN;
+        }
+        ih->siblings =
+            (sibling_t *)calloc(sizeof(sibling_t), ih->num_siblings);
+        RET_IF_ERR(!ih->siblings, "failed to allocate sibling slots");
+    }
 
-    vs_args_t va = {in, out, core, vsapi, 0, 0, 0, 0, 0};
-    for (int i = 0; i < num_srcs; i++) {
+    ih->proxy = (int)vsapi->propGetInt(in, "proxy", 0, &err);
+    if (err) {
+        ih->proxy = 1;
+    }
+    RET_IF_ERR(ih->proxy != 1 && ih->proxy != 2 && ih->proxy != 4 &&
+               ih->proxy != 8, "proxy must be 1, 2, 4 or 8");
+
+    const char *roi_args[] = { "left", "top", "width", "height" };
+    for (int i = 0; i < 4; i++) {
+        ih->roi[i] = (int)vsapi->propGetInt(in, roi_args[i], 0, &err);
+        if (err) {
+            ih->roi[i] = 0;
+        }
+        RET_IF_ERR(ih->roi[i] < 0, "crop region must not be negative");
+        ih->crop |= ih->roi[i] != 0;
+    }
+
+    int fast = (int)vsapi->propGetInt(in, "fast", 0, &err);
+    if (!err && fast) {
+        ih->tj_flags = TJFLAG_FASTDCT | TJFLAG_FASTUPSAMPLE;
+    }
+
+    ih->trusted = (int)vsapi->propGetInt(in, "trusted", 0, &err) != 0;
+    ih->stats_props = (int)vsapi->propGetInt(in, "stats", 0, &err) != 0;
+
+    const char *trace = vsapi->propGetData(in, "trace", 0, &err);
+    if (err) {
+        trace = getenv("IMGR_TRACE");
+    }
+    if (trace && strlen(trace) > 0) {
+        ih->trace = trace_open(trace);
+        RET_IF_ERR(!ih->trace, "failed to open trace %s", trace);
+    }
+
+    for (int i = 0; !ih->pattern && i < num_srcs; i++) {
         ih->src[i].name = vsapi->propGetData(in, "files", i, &err);
         RET_IF_ERR(err || strlen(ih->src[i].name) == 0,
                    "zero length file name was found");
-        const char *cs = check_src_props(ih, i, &va);
-        RET_IF_ERR(cs, "file %d: %s", i, cs);
     }
+
+    int probe_threads = (int)vsapi->propGetInt(in, "probe_threads", 0, &err);
+    if (err) {
+        probe_threads = vsapi->getCoreInfo(core)->numThreads;
+    }
+    RET_IF_ERR(probe_threads < 0, "probe_threads must be 0 or greater");
+
+    const char *manifest = vsapi->propGetData(in, "manifest", 0, &err);
+    if (err || strlen(manifest) == 0) {
+        manifest = NULL;
+    }
+
+    int lazy = (int)vsapi->propGetInt(in, "lazy", 0, &err);
+    if (err || num_srcs == 1) {
+        lazy = 0;
+    }
+    if (lazy) {
+        ih->lazy_state = (uint8_t *)calloc(1, num_srcs);
+        RET_IF_ERR(!ih->lazy_state, "failed to allocate lazy probing state");
+        ih->lazy_state[0] = 1;
+        manifest = NULL;
+    }
+
+    const char *report = vsapi->propGetData(in, "probe_report", 0, &err);
+    if (err) {
+        report = getenv("IMGR_PROBE_REPORT");
+    }
+    if (report && strlen(report) == 0) {
+        report = NULL;
+    }
+    probe_stats_t probe;
+    memset(&probe, 0, sizeof(probe));
+
+    vs_args_t va = {in, out, core, vsapi, 0, 0, 0, 0, 0, ctx,
+                    report ? &probe : NULL};
+    int error_index;
+    int num_probed = lazy ? 1 : num_srcs;
+    const char *cs = probe_sources(ih, num_probed, probe_threads, manifest,
+                                   &va, &error_index);
+    if (report && cs) {
+        imgr_probe_report(report, ih, &probe, num_probed,
+                          imgr_now() - create_start);
+    }
+    RET_IF_ERR(cs && error_index < 0, "%s", cs);
+    RET_IF_ERR(cs, "file %d: %s", error_index, cs);
     if (va.variable_width != 0) {
         ih->vi[0].width = 0;
     }
@@ -273,15 +998,16 @@ create_reader(const VSMap *in, VSMap *out, void *user_data, VSCore *core,
         ih->vi[0].format = NULL;
     }
 
-    uint8_t *buff = (uint8_t *)malloc(va.max_row_size * va.max_height + 32);
-    RET_IF_ERR(!buff, "failed to allocate image buffer");
-    ih->image_buff = buff;
+    ih->max_row_size = va.max_row_size;
+    ih->max_height = va.max_height;
+    release_context(ih, ctx);
 
-    ih->png_row_index = (uint8_t **)malloc(sizeof(uint8_t *) * va.max_height);
-    RET_IF_ERR(!ih->png_row_index, "failed to allocate image buffer index");
-    for (int i = 0; i < va.max_height; i++) {
-        ih->png_row_index[i] = buff;
-        buff += va.max_row_size;
+    /* the other files are assumed to be the same as the first one until
+       their readers check them against it */
+    for (int i = 1; lazy && i < num_srcs; i++) {
+        const char *name = ih->src[i].name;
+        ih->src[i] = ih->src[0];
+        ih->src[i].name = name;
     }
 
     ih->vi[0].fpsNum = vsapi->propGetInt(in, "fpsnum", 0, &err);
@@ -299,8 +1025,49 @@ create_reader(const VSMap *in, VSMap *out, void *user_data, VSCore *core,
         ih->vi[1].format = vsapi->getFormatPreset(pf, core);
     }
 
+    int depth = (int)vsapi->propGetInt(in, "prefetch", 0, &err);
+    RET_IF_ERR(depth < 0, "prefetch must be 0 or greater");
+    if (depth > 0) {
+        int mem = (int)vsapi->propGetInt(in, "prefetch_mem", 0, &err);
+        if (err) {
+            mem = DEFAULT_PREFETCH_MEM;
+        }
+        RET_IF_ERR(mem < 1, "prefetch_mem must be 1 or greater");
+        /* the threads of the core request the frames out of order */
+        ih->prefetcher = prefetch_create(ih, depth, (size_t)mem << 20,
+                                         vsapi->getCoreInfo(core)->numThreads);
+        RET_IF_ERR(!ih->prefetcher, "failed to create prefetcher");
+    }
+
+    ih->enable_mmap = (int)vsapi->propGetInt(in, "mmap", 0, &err);
+    if (err) {
+        ih->enable_mmap = 1;
+    }
+
+    int cache_size = (int)vsapi->propGetInt(in, "cache", 0, &err);
+    RET_IF_ERR(cache_size < 0, "cache must be 0 or greater");
+    if (cache_size > 0) {
+        imgr_cache_attach(core, (size_t)cache_size << 20);
+        ih->enable_cache = 1;
+    }
+
+    if (report) {
+        imgr_probe_report(report, ih, &probe, num_probed,
+                          imgr_now() - create_start);
+    }
+
     vsapi->createFilter(in, out, filter_name, vs_init, img_get_frame,
-                        close_handler, fmSerial, 0, ih, core);
+                        close_handler, fmParallel, 0, ih, core);
+}
+
+
+static void VS_CC
+get_stats(const VSMap *in, VSMap *out, void *user_data, VSCore *core,
+          const VSAPI *vsapi)
+{
+    int err;
+    int reset = (int)vsapi->propGetInt(in, "reset", 0, &err);
+    imgr_stats_report(out, !err && reset, vsapi);
 }
 
 
@@ -310,7 +1077,15 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(
     f_config("chikuzen.does.not.have.his.own.domain.imgr", "imgr",
              "Image reader for VapourSynth " VS_IMGR_VERSION,
              VAPOURSYNTH_API_VERSION, 1, plugin);
+    imgr_init_deint_kernels();
     f_register("Read",
-               "files:data[];fpsnum:int:opt;fpsden:int:opt;alpha:int:opt;",
+               "files:data[]:opt;fpsnum:int:opt;fpsden:int:opt;alpha:int:opt;"
+               "prefetch:int:opt;prefetch_mem:int:opt;cache:int:opt;"
+               "probe_threads:int:opt;manifest:data:opt;lazy:int:opt;"
+               "pattern:data:opt;first:int:opt;last:int:opt;step:int:opt;"
+               "mmap:int:opt;proxy:int:opt;fast:int:opt;trusted:int:opt;"
+               "left:int:opt;top:int:opt;width:int:opt;height:int:opt;"
+               "stats:int:opt;trace:data:opt;probe_report:data:opt;",
                create_reader, NULL, plugin);
+    f_register("Stats", "reset:int:opt;", get_stats, NULL, plugin);
 }
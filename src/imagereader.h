@@ -26,8 +26,11 @@
 #ifndef VS_IMAGE_READER_H
 #define VS_IMAGE_READER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -36,6 +39,25 @@
 
 #define IMG_ORDER_BGR 0x0100
 #define IMG_ORDER_RGB 0x0200
+#define IMG_PALETTE_ALPHA 0x0400 // alpha of the palette is in reserved
+
+/* size of the frame made from size pixels of the image with proxy */
+#define IMG_PROXY_SIZE(size, proxy) (((size) + (proxy) - 1) / (proxy))
+
+/* the image in ctx is not written into the frame as a whole */
+#define IMG_IS_CROPPED(ctx) ((ctx)->roi_width != (ctx)->width || \
+                             (ctx)->roi_height != (ctx)->height)
+
+/* size of the row bands decoded and written at once */
+#define IMG_BAND_SIZE (64 * 1024)
+
+typedef struct image_handler img_hnd_t;
+typedef struct image_context img_ctx_t;
+typedef struct prefetcher prefetcher_t;
+typedef struct manifest manifest_t;
+typedef struct trace trace_t;
+typedef struct probe_stats probe_stats_t;
+typedef struct worker_pool worker_pool_t;
 
 typedef struct {
     const VSMap *in;
@@ -47,17 +69,59 @@ typedef struct {
     int variable_width;
     int variable_height;
     int variable_format;
+    img_ctx_t *ctx;
+    probe_stats_t *probe; // NULL unless the probing is profiled
 } vs_args_t;
 
-typedef struct image_handler img_hnd_t;
-
 typedef const char * (VS_CC *func_check_src)(img_hnd_t *, int, FILE *,
                                               vs_args_t *);
 
-typedef int (VS_CC *func_read_image)(img_hnd_t *, int);
+typedef int (VS_CC *func_read_image)(img_hnd_t *, img_ctx_t *, int);
+
+typedef void (VS_CC *func_write_frame)(img_hnd_t *, img_ctx_t *, int,
+                                        VSFrameRef **, VSCore *core,
+                                        const VSAPI *);
+
+/* state of the thread running the tasks of the pool */
+typedef struct {
+    void *tjhandle; // made by the task on demand, NULL until then
+} pool_local_t;
+
+typedef int (VS_CC *func_pool_task)(void *arg, pool_local_t *local);
+
+typedef struct pool_task {
+    func_pool_task func;
+    void *arg;
+    int ret;
+    void *batch; // set by pool_run
+    struct pool_task *next;
+} pool_task_t;
+
+typedef void (VS_CC *func_deint_row)(const uint8_t *, uint8_t * const *, int);
+
+typedef void (VS_CC *func_pal_row)(const uint8_t *, const uint32_t *,
+                                   uint32_t *, int);
+
+typedef struct {
+    int shift[4]; // lowest bit of each channel
+    int bits[4]; // width of each channel, 0 if absent
+} bitfields_t;
 
-typedef void (VS_CC *func_write_frame)(img_hnd_t *, int, VSFrameRef **,
-                                        VSCore *core, const VSAPI *);
+typedef void (VS_CC *func_bitfield_row)(const uint8_t *, uint8_t * const *,
+                                        int, int, const bitfields_t *);
+
+typedef struct {
+    const char *name;
+    func_deint_row deint2_8;
+    func_deint_row deint3_8;
+    func_deint_row deint4_8;
+    func_deint_row deint2_16;
+    func_deint_row deint3_16;
+    func_deint_row deint4_16;
+    func_pal_row pal8;
+    func_bitfield_row bitfield16;
+    func_bitfield_row bitfield32;
+} deint_kernels_t;
 
 typedef struct {
     uint8_t blue;
@@ -76,19 +140,135 @@ typedef struct {
     int flip;
 } src_info_t;
 
-struct image_handler {
-    VSVideoInfo vi[2]; // 0: base image, 1: for alpha
-    src_info_t *src;
-    uint8_t *src_buff; // libturbojpeg require this
+typedef struct {
+    const char *name;
+    int64_t mtime; // nanoseconds
+    int64_t size;
+    uint32_t options; // decoding options affecting the output
+    int roi[4]; // left, top, width and height of the crop region
+    VSCore *core;
+} cache_key_t;
+
+typedef struct {
+    uint8_t *data; // whole contents of the source file
+    size_t size;
+    void *slot; // prefetch slot owning data, NULL if data is src_buff
+    void *map; // mapping of the file if data is mapped
+} src_data_t;
+
+/* zero frame for the alpha of the images without alpha channel */
+typedef struct zero_alpha {
+    const VSFormat *format;
+    int width;
+    int height;
+    VSFrameRef *frame;
+    struct zero_alpha *next;
+} zero_alpha_t;
+
+/* output decoded together with a requested one, kept for its request */
+typedef struct {
+    int n;
+    int index;
+    VSFrameRef *frame;
+} sibling_t;
+
+/* one file in the probe manifest. all fields have fixed width since the
+   manifest is mapped as is. */
+typedef struct {
+    int64_t mtime; // nanoseconds
+    int64_t size;
+    uint64_t name_offset; // from the top of the manifest
+    uint64_t image_size;
+    uint32_t name_length;
+    int32_t format_id;
+    int32_t row_size;
+    uint16_t width;
+    uint16_t height;
+    uint8_t type; // image_type_t
+    uint8_t flip;
+    uint8_t reserved[6];
+} manifest_entry_t;
+
+/* time spent on each stage of a frame, see img_get_frame() */
+typedef struct {
+    int64_t read_ns; // loading the source file
+    int64_t decode_ns; // the rest
+    int64_t write_ns; // func_write_* writers
+    int64_t bytes; // size of the source file
+} frame_stats_t;
+
+typedef enum {
+    PREFETCH_HITS,
+    PREFETCH_MISSES,
+    PREFETCH_EVICTED,
+    NUM_PREFETCH_COUNTS
+} prefetch_count_t;
+
+/* decoding state owned by one worker thread at a time */
+struct image_context {
+    src_data_t source;
+    uint8_t *src_buff; // file read buffer
     size_t src_buff_size;
-    uint8_t *image_buff; // buffer for decoded image
+    uint8_t *image_buff; // buffer for decoded rows, see imgr_image_buffer()
+    size_t image_buff_size;
+    uint8_t *image; // rows passed to write_frame (image_buff or in place)
+    int width; // size of the image in the file
+    int height;
+    int proxy; // 1, or the size of the blocks averaged by the writers
+    uint8_t *proxy_buff; // scratch rows and the sums of them for proxy
+    size_t proxy_buff_size;
+    int proxy_count; // rows added into the sums
+    int roi_left; // region of the image written into the frame
+    int roi_top;
+    int roi_width;
+    int roi_height;
+    int band_top; // first row of the image held by image
+    int band_height; // rows held by image, 0 if it holds the whole image
     uint8_t **png_row_index; // libpng require this
+    int png_row_index_size;
     void *tjhandle; // libturbojpeg require this
     func_write_frame write_frame;
     color_palette_t palettes[256];
+    bitfields_t bitfields; // for func_write_bitfields
     int row_adjust;
-    int enable_alpha;
     int misc;
+    frame_stats_t stats; // of the frame being decoded
+    img_ctx_t *next_idle;
+    img_ctx_t *next;
+};
+
+struct image_handler {
+    VSVideoInfo vi[2]; // 0: base image, 1: for alpha
+    src_info_t *src;
+    char *pattern; // printf style file name, NULL if names are in src
+    int first;
+    int step;
+    int max_row_size;
+    int max_height;
+    int enable_alpha;
+    int proxy; // 1, 2, 4 or 8
+    int tj_flags; // flags for libturbojpeg decoding
+    int trusted; // skip checksums and ancillary chunks of png
+    int stats_props; // attach frame_stats_t to the frames
+    trace_t *trace; // NULL unless tracing
+    worker_pool_t *pool; // for the split images, made on demand
+    int pool_failed;
+    int decoding; // frames being decoded
+    int roi[4]; // crop region after proxy, 0 width/height is to the edge
+    int crop; // roi is given
+    int enable_cache;
+    int enable_mmap;
+    uint8_t *lazy_state; // 1 per file decoded once, NULL unless lazy
+    prefetcher_t *prefetcher;
+    pthread_mutex_t ctx_mutex;
+    img_ctx_t *ctx_idle; // contexts not used by any thread
+    img_ctx_t *ctx_list; // all contexts, for cleanup
+    pthread_mutex_t alpha_mutex; // for siblings and zero_alpha
+    sibling_t *siblings;
+    int num_siblings;
+    int next_sibling;
+    int requested[2]; // outputs requested at least once, for siblings
+    zero_alpha_t *zero_alpha;
 };
 
 typedef enum {
@@ -99,11 +279,44 @@ typedef enum {
     IMG_TYPE_TGA
 } image_type_t;
 
+typedef enum {
+    PROBE_OPEN,
+    PROBE_DETECT, // reading the signature and seeking back
+    PROBE_STAT, // the following four are a part of the checks
+    PROBE_ALLOC,
+    PROBE_READ,
+    PROBE_PNG_SETUP, // png decoder made for reading the header
+    PROBE_CLOSE,
+    PROBE_MANIFEST, // stat and lookup of the manifest entries
+    PROBE_CONTEXT, // decoding contexts of the workers
+    NUM_PROBE_PHASES
+} probe_phase_t;
+
+#define PROBE_SLOWEST 10
+
+struct probe_stats {
+    int64_t phase_ns[NUM_PROBE_PHASES]; // summed over the workers
+    int64_t check_ns[IMG_TYPE_TGA + 1]; // by format
+    int files[IMG_TYPE_TGA + 1]; // checked, by format
+    int restored; // from the manifest
+    int64_t bytes; // consumed by the checks
+    int slowest[PROBE_SLOWEST]; // files, slowest first
+    int64_t slowest_ns[PROBE_SLOWEST];
+    int num_slowest;
+    int threads;
+    int64_t probe_ns; // wall time of the probing
+};
+
 extern const func_check_src check_src_bmp;
 extern const func_check_src check_src_jpeg;
 extern const func_check_src check_src_png;
 extern const func_check_src check_src_tga;
 
+extern const func_read_image read_src_bmp;
+extern const func_read_image read_src_jpeg;
+extern const func_read_image read_src_png;
+extern const func_read_image read_src_tga;
+
 extern const func_write_frame func_write_planar;
 extern const func_write_frame func_write_gray8_a;
 extern const func_write_frame func_write_gray16_a;
@@ -112,16 +325,121 @@ extern const func_write_frame func_write_rgb32;
 extern const func_write_frame func_write_rgb48;
 extern const func_write_frame func_write_rgb64;
 extern const func_write_frame func_write_palette;
+extern const func_write_frame func_write_bitfields;
+
+void VS_CC set_dummy_alpha(img_hnd_t *ih, int n, VSFrameRef **dummy,
+                           VSCore *core, const VSAPI *vsapi);
+int VS_CC imgr_set_image_size(img_hnd_t *ih, img_ctx_t *ctx, int n,
+                              int width, int height, int proxy);
+int VS_CC imgr_check_layout(img_hnd_t *ih, int n, int format_id,
+                            size_t row_size, int flip);
+int VS_CC imgr_rows_needed(img_hnd_t *ih, img_ctx_t *ctx, int n);
+
+void VS_CC imgr_init_deint_kernels(void);
+const deint_kernels_t * VS_CC imgr_deint_kernels(void);
+void VS_CC imgr_unpack_indices(const uint8_t *srcp, uint8_t *dstp, int width,
+                               int bits);
+
+const char * VS_CC imgr_src_name(img_hnd_t *ih, int n);
+int VS_CC imgr_stat(const char *name, int64_t *mtime, int64_t *size);
+int VS_CC imgr_read_file(const char *name, uint8_t **buff, size_t *buff_size,
+                         size_t *size);
+int VS_CC imgr_load_source(img_hnd_t *ih, img_ctx_t *ctx, int n);
+uint8_t * VS_CC imgr_image_buffer(img_ctx_t *ctx, size_t size);
+void VS_CC imgr_release_source(img_hnd_t *ih, img_ctx_t *ctx);
 
+prefetcher_t * VS_CC prefetch_create(img_hnd_t *ih, int depth,
+                                     size_t mem_limit, int jitter);
+void VS_CC prefetch_notify(prefetcher_t *pf, int n);
+int VS_CC prefetch_take(prefetcher_t *pf, int n, src_data_t *sd);
+void VS_CC prefetch_release(prefetcher_t *pf, src_data_t *sd);
+void VS_CC prefetch_destroy(prefetcher_t *pf);
+
+void VS_CC imgr_cache_attach(VSCore *core, size_t budget);
+void VS_CC imgr_cache_detach(VSCore *core, const VSAPI *vsapi);
+int VS_CC imgr_cache_key(img_hnd_t *ih, int n, uint32_t options,
+                         VSCore *core, cache_key_t *key);
+const VSFrameRef * VS_CC imgr_cache_get(const cache_key_t *key,
+                                        const VSAPI *vsapi);
+void VS_CC imgr_cache_put(const cache_key_t *key, const VSFrameRef *frame,
+                          const VSAPI *vsapi);
+
+worker_pool_t * VS_CC imgr_pool(img_hnd_t *ih, VSCore *core,
+                                const VSAPI *vsapi);
+int VS_CC imgr_split_threads(img_hnd_t *ih, VSCore *core, const VSAPI *vsapi);
+int VS_CC pool_run(worker_pool_t *pool, pool_task_t *tasks, int num,
+                   pool_local_t *local);
+void VS_CC pool_destroy(worker_pool_t *pool);
+
+void VS_CC imgr_stats_add(image_type_t type, const frame_stats_t *fs);
+void VS_CC imgr_stats_set_props(VSFrameRef *frame, const frame_stats_t *fs,
+                                const VSAPI *vsapi);
+void VS_CC imgr_stats_prefetch(prefetch_count_t count);
+void VS_CC imgr_stats_report(VSMap *out, int reset, const VSAPI *vsapi);
+
+trace_t * VS_CC trace_open(const char *path);
+void VS_CC trace_event(trace_t *tr, const char *name, int n, int64_t start,
+                       int64_t end);
+void VS_CC trace_close(trace_t *tr);
+
+void VS_CC imgr_probe_file(probe_stats_t *ps, int n, int64_t ns);
+void VS_CC imgr_probe_merge(probe_stats_t *to, const probe_stats_t *from);
+void VS_CC imgr_probe_report(const char *path, img_hnd_t *ih,
+                             const probe_stats_t *ps, int num_files,
+                             int64_t total_ns);
+
+manifest_t * VS_CC manifest_open(const char *path, uint32_t options);
+uint64_t VS_CC manifest_count(const manifest_t *mf);
+const manifest_entry_t * VS_CC manifest_lookup(const manifest_t *mf, int n,
+                                               const char *name);
+void VS_CC manifest_close(manifest_t *mf);
+int VS_CC manifest_write(const char *path, uint32_t options, img_hnd_t *ih,
+                         manifest_entry_t *entries, int num_entries);
+
+
+static inline int64_t imgr_now(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (int64_t)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* the time to be passed to imgr_probe_time, 0 if not profiling */
+static inline int64_t imgr_probe_start(const vs_args_t *va)
+{
+    return va->probe ? imgr_now() : 0;
+}
+
+/* adds the time since start to phase, and returns the current time */
+static inline int64_t
+imgr_probe_time(vs_args_t *va, probe_phase_t phase, int64_t start)
+{
+    if (!va->probe) {
+        return 0;
+    }
+    int64_t now = imgr_now();
+    va->probe->phase_ns[phase] += now - start;
+    return now;
+}
 
-static inline FILE *imgr_fopen(const char *filename)
+/* opens the file of the UTF-8 name with mode, or with the same mode in
+   wmode on Windows */
+static inline FILE *
+imgr_fopen(const char *filename, const char *mode, const wchar_t *wmode)
 {
 #ifdef _WIN32
     wchar_t tmp[FILENAME_MAX * 2];
     MultiByteToWideChar(CP_UTF8, 0, filename, -1, tmp, FILENAME_MAX * 2);
-    return _wfopen(tmp, L"rb");
+    return _wfopen(tmp, wmode);
 #else
-    return fopen(filename, "rb");
+    return fopen(filename, mode);
 #endif
 }
 #endif
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/stat.h>
 #ifdef _WIN32
 #include <windows.h>
@@ -35,28 +36,482 @@
 #include "imagereader.h"
 
 
-static int VS_CC read_jpeg(img_hnd_t *ih, int n)
+/* the frame has the size padded for the subsampling */
+static void VS_CC pad_size(int subsample, int *width, int *height)
 {
-    FILE *fp = imgr_fopen(ih->src[n].name);
-    if (!fp) {
+    if (subsample == TJSAMP_420 || subsample == TJSAMP_422) {
+        *width += *width & 1;
+    }
+    if (subsample == TJSAMP_420 || subsample == TJSAMP_440) {
+        *height += *height & 1;
+    }
+}
+
+
+#ifdef HAVE_TJ_YUVPLANES
+/* restart intervals: a sequential JPEG with restart markers is split at the
+   markers lying on the starts of MCU rows. each strip is decoded as a JPEG
+   of its own on a thread of the pool, into the rows of the planes under
+   the rows of the previous strip. */
+
+#define JPEG_STRIP_MIN_PIXELS (1024 * 1024) // smaller images are not split
+#define JPEG_MAX_STRIPS 64
+
+typedef struct {
+    const uint8_t *data;
+    size_t header_size; // from SOI to the end of SOS
+    size_t sof_height; // offset of the height in SOF
+    int width;
+    int height;
+    int num_comps;
+    int mcu_width;
+    int mcu_height;
+    int mcus_x; // MCUs in a row
+    int mcus_y; // rows of MCUs
+    int interval; // MCUs in a restart interval
+} jpeg_header_t;
+
+typedef struct {
+    const jpeg_header_t *jh;
+    size_t start; // entropy coded data of the strip
+    size_t end;
+    int first_interval;
+    int top; // rows of the image in the strip
+    int height;
+    unsigned char *planes[3];
+    int *strides;
+    int width; // size of the strip decoded
+    int scaled_height;
+    int flags;
+    trace_t *trace;
+    int n; // frame number for the trace
+} jpeg_strip_t;
+
+
+static inline int get_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+/* reads the markers up to SOS. returns -1 unless the image is a sequential
+   huffman coded one with restart markers, and all components in its scan. */
+static int VS_CC
+read_jpeg_header(const uint8_t *data, size_t size, jpeg_header_t *jh)
+{
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
         return -1;
     }
 
-    unsigned long read = fread(ih->src_buff, 1, ih->src[n].image_size, fp);
-    fclose(fp);
-    if (read < ih->src[n].image_size) {
+    memset(jh, 0, sizeof(jpeg_header_t));
+    jh->data = data;
+    int max_h = 1, max_v = 1;
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) {
+            return -1;
+        }
+        int marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos++; // fill byte
+            continue;
+        }
+        size_t len = get_be16(data + pos + 2);
+        if (len < 2 || len > size - pos - 2) {
+            return -1;
+        }
+        const uint8_t *seg = data + pos + 4;
+
+        if (marker == 0xC0 || marker == 0xC1) {
+            if (len < 8 || seg[0] != 8) {
+                return -1;
+            }
+            jh->sof_height = pos + 5;
+            jh->height = get_be16(seg + 1);
+            jh->width = get_be16(seg + 3);
+            jh->num_comps = seg[5];
+            if (jh->num_comps < 1 || jh->num_comps > 3 ||
+                len < 8 + 3 * (size_t)jh->num_comps) {
+                return -1;
+            }
+            for (int i = 0; i < jh->num_comps; i++) {
+                int h = seg[7 + i * 3] >> 4, v = seg[7 + i * 3] & 0x0F;
+                max_h = h > max_h ? h : max_h;
+                max_v = v > max_v ? v : max_v;
+            }
+        } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 &&
+                   marker != 0xC8 && marker != 0xCC) {
+            return -1; // progressive, lossless or arithmetic coding
+        } else if (marker == 0xDD) {
+            if (len < 4) {
+                return -1;
+            }
+            jh->interval = get_be16(seg);
+        } else if (marker == 0xDA) {
+            if (jh->num_comps == 0 || seg[0] != jh->num_comps) {
+                return -1;
+            }
+            jh->header_size = pos + 2 + len;
+            break;
+        }
+        pos += 2 + len;
+    }
+
+    if (jh->header_size == 0 || jh->interval == 0 || jh->width == 0 ||
+        jh->height == 0) {
         return -1;
     }
 
-    tjhandle tjh = (tjhandle)ih->tjhandle;
-    if (tjDecompressToYUV(tjh, ih->src_buff, read, ih->image_buff, 0)) {
+    /* a scan of one component is made of 8x8 blocks */
+    jh->mcu_width = jh->num_comps == 1 ? 8 : max_h * 8;
+    jh->mcu_height = jh->num_comps == 1 ? 8 : max_v * 8;
+    jh->mcus_x = (jh->width + jh->mcu_width - 1) / jh->mcu_width;
+    jh->mcus_y = (jh->height + jh->mcu_height - 1) / jh->mcu_height;
+    return 0;
+}
+
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+
+/* splits the image into at most max_strips strips starting at restart
+   markers. returns the number of the strips, or 0 if it can't be split. */
+static int VS_CC
+plan_strips(const jpeg_header_t *jh, size_t size, int max_strips,
+            jpeg_strip_t *strips)
+{
+    /* restart markers are on the starts of every step rows of MCUs */
+    int step = jh->interval / gcd(jh->interval, jh->mcus_x);
+    int units = (jh->mcus_y + step - 1) / step;
+    int num = units < max_strips ? units : max_strips;
+    if (num < 2) {
+        return 0;
+    }
+    int units_per_strip = (units + num - 1) / num;
+    num = (units + units_per_strip - 1) / units_per_strip;
+
+    for (int i = 0; i < num; i++) {
+        int first_row = i * units_per_strip * step;
+        int last_row = first_row + units_per_strip * step;
+        last_row = last_row < jh->mcus_y ? last_row : jh->mcus_y;
+        strips[i].jh = jh;
+        strips[i].first_interval =
+            (int)((int64_t)first_row * jh->mcus_x / jh->interval);
+        strips[i].top = first_row * jh->mcu_height;
+        strips[i].height = i < num - 1 ? (last_row - first_row) * jh->mcu_height
+                                       : jh->height - strips[i].top;
+    }
+
+    /* finds the markers at the starts of the strips */
+    const uint8_t *data = jh->data;
+    const uint8_t *end = data + size;
+    const uint8_t *p = data + jh->header_size;
+    int num_intervals = (int)(((int64_t)jh->mcus_x * jh->mcus_y +
+                               jh->interval - 1) / jh->interval);
+    int interval = 0, next = 1;
+    strips[0].start = jh->header_size;
+    for (;;) {
+        p = (const uint8_t *)memchr(p, 0xFF, end - p);
+        if (!p || end - p < 2) {
+            return 0;
+        }
+        int marker = p[1];
+        if (marker == 0x00 || marker == 0xFF) {
+            p++;
+            continue;
+        }
+        if (marker < 0xD0 || marker > 0xD7) {
+            break;
+        }
+        interval++;
+        if (next < num && interval == strips[next].first_interval) {
+            strips[next - 1].end = p - data;
+            strips[next].start = p + 2 - data;
+            next++;
+        }
+        p += 2;
+    }
+    if (p[1] != 0xD9 || interval + 1 != num_intervals || next != num) {
+        return 0; // multiple scans, or broken restart markers
+    }
+    strips[num - 1].end = p - data;
+    return num;
+}
+
+
+/* copies the headers and the data of the strip into a JPEG of its own.
+   the height in SOF is the one of the strip, and the restart markers are
+   numbered from RST0. */
+static int VS_CC decode_strip(jpeg_strip_t *st, tjhandle tjh)
+{
+    int64_t start = imgr_now();
+    const jpeg_header_t *jh = st->jh;
+    size_t data_size = st->end - st->start;
+    size_t size = jh->header_size + data_size + 2;
+    uint8_t *buff = (uint8_t *)malloc(size);
+    if (!buff) {
         return -1;
     }
 
-    ih->write_frame = func_write_planar;
-    ih->row_adjust = 4;
+    memcpy(buff, jh->data, jh->header_size);
+    buff[jh->sof_height] = st->height >> 8;
+    buff[jh->sof_height + 1] = st->height & 0xFF;
+    uint8_t *data = buff + jh->header_size;
+    memcpy(data, jh->data + st->start, data_size);
+    int delta = st->first_interval & 7;
+    for (uint8_t *p = data, *end = data + data_size; delta && p; ) {
+        p = (uint8_t *)memchr(p, 0xFF, end - p);
+        if (!p || end - p < 2) {
+            break;
+        }
+        if (p[1] >= 0xD0 && p[1] <= 0xD7) {
+            p[1] = 0xD0 + ((p[1] - 0xD0 - delta) & 7);
+        }
+        p++;
+    }
+    buff[size - 2] = 0xFF;
+    buff[size - 1] = 0xD9;
+
+    int ret = tjDecompressToYUVPlanes(tjh, buff, size,
+                                      st->planes, st->width, st->strides,
+                                      st->scaled_height, st->flags);
+    free(buff);
+    trace_event(st->trace, "jpeg_strip", st->n, start, imgr_now());
+    return ret ? -1 : 0;
+}
+
+
+/* the decompressors of the pool threads are kept for their next strips */
+static int VS_CC strip_task(void *arg, pool_local_t *local)
+{
+    if (!local->tjhandle) {
+        local->tjhandle = tjInitDecompress();
+        if (!local->tjhandle) {
+            return -1;
+        }
+    }
+    return decode_strip((jpeg_strip_t *)arg, (tjhandle)local->tjhandle);
+}
+
+
+/* decodes the strips overlapping the rows [first, last) of the frame on
+   up to threads threads of the pool. returns 1 if the image can't be
+   split. */
+static int VS_CC
+decode_strips(img_hnd_t *ih, img_ctx_t *ctx, int n, unsigned char **planes,
+              int *strides, int num_planes, int subsample, int first,
+              int last, worker_pool_t *pool, int threads)
+{
+    jpeg_header_t jh;
+    jpeg_strip_t strips[JPEG_MAX_STRIPS];
+    if (read_jpeg_header(ctx->source.data, ctx->source.size, &jh) ||
+        (int64_t)jh.width * jh.height < JPEG_STRIP_MIN_PIXELS) {
+        return 1;
+    }
+    int num = plan_strips(&jh, ctx->source.size,
+                          threads < JPEG_MAX_STRIPS ? threads : JPEG_MAX_STRIPS,
+                          strips);
+    if (num < 2) {
+        return 1;
+    }
+
+    tjscalingfactor sf = { 1, ih->proxy };
+    pool_task_t tasks[JPEG_MAX_STRIPS];
+    int num_tasks = 0;
+    for (int i = 0; i < num; i++) {
+        jpeg_strip_t *st = strips + i;
+        int top = TJSCALED(st->top, sf);
+        st->scaled_height = TJSCALED(st->height, sf);
+        if (top >= last || top + st->scaled_height <= first) {
+            continue; // out of the region of interest
+        }
+        for (int j = 0; j < num_planes; j++) {
+            st->planes[j] = planes[j] +
+                (size_t)tjPlaneHeight(j, top, subsample) * strides[j];
+        }
+        st->strides = strides;
+        st->width = TJSCALED(jh.width, sf);
+        st->flags = ih->tj_flags;
+        st->trace = ih->trace;
+        st->n = n;
+        tasks[num_tasks].func = strip_task;
+        tasks[num_tasks].arg = st;
+        tasks[num_tasks].ret = 0;
+        num_tasks++;
+    }
+    if (num_tasks == 0) {
+        return 0;
+    }
+
+    /* the top strip is decoded by this thread with the handle of ctx */
+    pool_local_t local = { ctx->tjhandle };
+    return pool_run(pool, tasks, num_tasks, &local);
+}
+
+
+/* decodes straight into the planes of the frame. the padding is filled by
+   libturbojpeg. with proxy, the DCT scaling of libturbojpeg makes the frame
+   size. with crop, the whole image is decoded into the image buffer, since
+   libturbojpeg can not skip the blocks out of the region when it decodes
+   into YUV planes. large images with restart markers are decoded in
+   strips on the worker pool of the handler, and the strips out of the
+   region are skipped. */
+static int VS_CC
+decode_jpeg(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef *frame,
+            worker_pool_t *pool, int threads, const VSAPI *vsapi)
+{
+    tjhandle tjh = (tjhandle)ctx->tjhandle;
+    int width, height, subsample;
+    tjscalingfactor sf = { 1, ih->proxy };
+    if (tjDecompressHeader2(tjh, ctx->source.data, ctx->source.size,
+                            &width, &height, &subsample)) {
+        return -1;
+    }
+    width = TJSCALED(width, sf);
+    height = TJSCALED(height, sf);
+
+    unsigned char *planes[3];
+    int strides[3];
+    int num = ih->src[n].format->numPlanes;
+    if (ih->crop) {
+        size_t size = 0;
+        for (int i = 0; i < num; i++) {
+            strides[i] = tjPlaneWidth(i, width, subsample);
+            size += (size_t)strides[i] * tjPlaneHeight(i, height, subsample);
+        }
+        uint8_t *buff = imgr_image_buffer(ctx, size);
+        int padded_width = width, padded_height = height;
+        pad_size(subsample, &padded_width, &padded_height);
+        if (!buff || imgr_set_image_size(ih, ctx, n, padded_width,
+                                         padded_height, 1)) {
+            return -1;
+        }
+        ctx->image = buff;
+        for (int i = 0; i < num; i++) {
+            planes[i] = buff;
+            buff += (size_t)strides[i] * tjPlaneHeight(i, height, subsample);
+        }
+    } else {
+        for (int i = 0; i < num; i++) {
+            planes[i] = vsapi->getWritePtr(frame, i);
+            strides[i] = vsapi->getStride(frame, i);
+        }
+    }
+
+    if (pool && threads > 1) {
+        int ret = decode_strips(ih, ctx, n, planes, strides, num, subsample,
+                                ctx->roi_top, ctx->roi_top + ctx->roi_height,
+                                pool, threads);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+
+    return tjDecompressToYUVPlanes(tjh, ctx->source.data, ctx->source.size,
+                                   planes, width, strides, height,
+                                   ih->tj_flags) ? -1 : 0;
+}
+
+
+static void VS_CC
+write_jpeg(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+           VSCore *core, const VSAPI *vsapi)
+{
+    int threads = imgr_split_threads(ih, core, vsapi);
+    worker_pool_t *pool = threads > 1 ? imgr_pool(ih, core, vsapi) : NULL;
+    if (decode_jpeg(ih, ctx, n, dst[0], pool, threads, vsapi)) {
+        vsapi->freeFrame(dst[0]);
+        dst[0] = NULL;
+        return;
+    }
+
+    if (ih->crop) {
+        /* write_planar copies the region from the image buffer */
+        func_write_planar(ih, ctx, n, dst, core, vsapi);
+    } else if (ih->enable_alpha) {
+        set_dummy_alpha(ih, n, dst + 1, core, vsapi);
+    }
+}
+#endif
+
+
+static VSPresetFormat VS_CC tjsamp_to_vspresetformat(enum TJSAMP tjsamp);
+
+
+/* with lazy probing, checks a file read for the first time against the
+   props of the first file. the frame is decoded without
+   imgr_set_image_size unless cropped, so the size is checked here. */
+static int VS_CC check_lazy_header(img_hnd_t *ih, img_ctx_t *ctx, int n)
+{
+    if (!ih->lazy_state || ih->lazy_state[n]) {
+        return 0;
+    }
+    int width, height, subsample;
+    if (tjDecompressHeader2((tjhandle)ctx->tjhandle, ctx->source.data,
+                            ctx->source.size, &width, &height, &subsample)) {
+        return -1;
+    }
+#ifdef HAVE_TJ_YUVPLANES
+    tjscalingfactor sf = { 1, ih->proxy };
+    width = TJSCALED(width, sf);
+    height = TJSCALED(height, sf);
+#endif
+    pad_size(subsample, &width, &height);
+    if (!ih->crop &&
+        (width != ih->src[n].width || height != ih->src[n].height)) {
+        return -1;
+    }
+    return imgr_check_layout(ih, n, tjsamp_to_vspresetformat(subsample),
+                             tjBufSizeYUV(width, height, subsample) / height,
+                             0);
+}
+
+
+static int VS_CC read_jpeg(img_hnd_t *ih, img_ctx_t *ctx, int n)
+{
+    if (imgr_load_source(ih, ctx, n) || check_lazy_header(ih, ctx, n)) {
+        return -1;
+    }
+
+#ifdef HAVE_TJ_YUVPLANES
+    ctx->write_frame = write_jpeg;
+    ctx->row_adjust = 1;
 
     return 0;
+#else
+    tjhandle tjh = (tjhandle)ctx->tjhandle;
+    int width = ih->src[n].width;
+    int height = ih->src[n].height;
+    if (ih->crop) {
+        /* the frame is smaller than the image */
+        int subsample;
+        if (tjDecompressHeader2(tjh, ctx->source.data, ctx->source.size,
+                                &width, &height, &subsample)) {
+            return -1;
+        }
+        pad_size(subsample, &width, &height);
+    }
+    uint8_t *buff = imgr_image_buffer(ctx, (size_t)ih->max_row_size * height);
+    if (!buff ||
+        tjDecompressToYUV(tjh, ctx->source.data, ctx->source.size, buff,
+                          ih->tj_flags)) {
+        return -1;
+    }
+
+    ctx->image = buff;
+    ctx->write_frame = func_write_planar;
+    ctx->row_adjust = 4;
+
+    return imgr_set_image_size(ih, ctx, n, width, height, 1);
+#endif
 }
 
 
@@ -83,45 +538,51 @@ static VSPresetFormat VS_CC tjsamp_to_vspresetformat(enum TJSAMP tjsamp)
 static const char * VS_CC
 check_jpeg(img_hnd_t *ih, int n, FILE *fp, vs_args_t *va)
 {
+    int64_t t = imgr_probe_start(va);
     struct stat st;
 #ifdef _WIN32
     wchar_t tmp[FILENAME_MAX * 2];
-    MultiByteToWideChar(CP_UTF8, 0, ih->src[n].name, -1, tmp, FILENAME_MAX * 2);
+    MultiByteToWideChar(CP_UTF8, 0, imgr_src_name(ih, n), -1, tmp,
+                        FILENAME_MAX * 2);
     if (wstat(tmp, &st)) {
 #else
-    if (stat(ih->src[n].name, &st)) {
+    if (stat(imgr_src_name(ih, n), &st)) {
 #endif
         return "source file does not exist";
     }
+    t = imgr_probe_time(va, PROBE_STAT, t);
     ih->src[n].image_size = st.st_size;
-    if (ih->src_buff_size < st.st_size) {
-        ih->src_buff_size = st.st_size;
-        free(ih->src_buff);
-        ih->src_buff = malloc(ih->src_buff_size);
-        if (!ih->src_buff) {
+    if (va->ctx->src_buff_size < st.st_size) {
+        va->ctx->src_buff_size = st.st_size;
+        free(va->ctx->src_buff);
+        va->ctx->src_buff = malloc(va->ctx->src_buff_size);
+        if (!va->ctx->src_buff) {
             return "failed to allocate read buffer";
         }
     }
+    t = imgr_probe_time(va, PROBE_ALLOC, t);
 
-    unsigned long read = fread(ih->src_buff, 1, st.st_size, fp);
-    fclose(fp);
+    unsigned long read = fread(va->ctx->src_buff, 1, st.st_size, fp);
+    imgr_probe_time(va, PROBE_READ, t);
     if (read < st.st_size) {
         return "failed to read jpeg file";
     }
 
     int subsample, width, height;
-    tjhandle handle = (tjhandle)ih->tjhandle;
-    if (tjDecompressHeader2(handle, ih->src_buff, read, &width, &height,
+    tjhandle handle = (tjhandle)va->ctx->tjhandle;
+    if (tjDecompressHeader2(handle, va->ctx->src_buff, read, &width, &height,
                             &subsample) != 0) {
         return tjGetErrorStr();
     }
 
-    if (subsample == TJSAMP_420 || subsample == TJSAMP_422) {
-        width += width & 1;
-    }
-    if (subsample == TJSAMP_420 || subsample == TJSAMP_440) {
-        height += height & 1;
-    }
+#ifdef HAVE_TJ_YUVPLANES
+    /* 1/2, 1/4 and 1/8 are supported by all versions of libturbojpeg */
+    tjscalingfactor sf = { 1, ih->proxy };
+    width = TJSCALED(width, sf);
+    height = TJSCALED(height, sf);
+#endif
+
+    pad_size(subsample, &width, &height);
 
     ih->src[n].width = width;
 
@@ -141,3 +602,4 @@ check_jpeg(img_hnd_t *ih, int n, FILE *fp, vs_args_t *va)
 }
 
 const func_check_src check_src_jpeg = check_jpeg;
+const func_read_image read_src_jpeg = read_jpeg;
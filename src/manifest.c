@@ -0,0 +1,275 @@
+/*
+  manifest.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+/*
+  probe manifest: the results of check_src_props() for a list of files.
+
+  layout (native byte order):
+    manifest_header_t
+    manifest_entry_t[num_entries]
+    file names (nul terminated)
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "imagereader.h"
+
+
+#define MANIFEST_MAGIC "IMGRMNF"
+#define MANIFEST_VERSION 1
+#define MANIFEST_BYTE_ORDER 0x01020304
+
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t options;
+    uint64_t num_entries;
+    uint64_t names_offset;
+    uint64_t file_size;
+} manifest_header_t;
+
+struct manifest {
+    const uint8_t *base;
+    size_t size;
+    const manifest_header_t *header;
+    const manifest_entry_t *entries;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+
+static int VS_CC map_file(manifest_t *mf, const char *path)
+{
+#ifdef _WIN32
+    wchar_t tmp[FILENAME_MAX * 2];
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, tmp, FILENAME_MAX * 2);
+    mf->file = CreateFileW(tmp, GENERIC_READ, FILE_SHARE_READ, NULL,
+                           OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (mf->file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(mf->file, &size) || size.QuadPart == 0) {
+        CloseHandle(mf->file);
+        return -1;
+    }
+    mf->mapping = CreateFileMappingW(mf->file, NULL, PAGE_READONLY, 0, 0,
+                                     NULL);
+    if (!mf->mapping) {
+        CloseHandle(mf->file);
+        return -1;
+    }
+    mf->base = (const uint8_t *)MapViewOfFile(mf->mapping, FILE_MAP_READ,
+                                              0, 0, 0);
+    if (!mf->base) {
+        CloseHandle(mf->mapping);
+        CloseHandle(mf->file);
+        return -1;
+    }
+    mf->size = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    mf->base = (const uint8_t *)base;
+    mf->size = st.st_size;
+#endif
+    return 0;
+}
+
+
+static void VS_CC unmap_file(manifest_t *mf)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(mf->base);
+    CloseHandle(mf->mapping);
+    CloseHandle(mf->file);
+#else
+    munmap((void *)mf->base, mf->size);
+#endif
+}
+
+
+/* returns NULL if the manifest does not exist or is not usable */
+manifest_t * VS_CC manifest_open(const char *path, uint32_t options)
+{
+    manifest_t *mf = (manifest_t *)calloc(sizeof(manifest_t), 1);
+    if (!mf) {
+        return NULL;
+    }
+    if (map_file(mf, path)) {
+        free(mf);
+        return NULL;
+    }
+
+    const manifest_header_t *h = (const manifest_header_t *)mf->base;
+    if (mf->size < sizeof(manifest_header_t) ||
+        memcmp(h->magic, MANIFEST_MAGIC, sizeof(h->magic)) != 0 ||
+        h->byte_order != MANIFEST_BYTE_ORDER ||
+        h->version != MANIFEST_VERSION ||
+        h->entry_size != sizeof(manifest_entry_t) ||
+        h->options != options ||
+        h->file_size != mf->size ||
+        h->num_entries > (mf->size - sizeof(manifest_header_t)) /
+                         sizeof(manifest_entry_t) ||
+        h->names_offset < sizeof(manifest_header_t) +
+                          h->num_entries * sizeof(manifest_entry_t) ||
+        h->names_offset > mf->size) {
+        manifest_close(mf);
+        return NULL;
+    }
+
+    mf->header = h;
+    mf->entries = (const manifest_entry_t *)(h + 1);
+    return mf;
+}
+
+
+uint64_t VS_CC manifest_count(const manifest_t *mf)
+{
+    return mf ? mf->header->num_entries : 0;
+}
+
+
+/* entries are looked up by position. the name has to match as well. */
+const manifest_entry_t * VS_CC
+manifest_lookup(const manifest_t *mf, int n, const char *name)
+{
+    if (!mf || n < 0 || (uint64_t)n >= mf->header->num_entries) {
+        return NULL;
+    }
+
+    const manifest_entry_t *me = mf->entries + n;
+    if (me->name_offset < mf->header->names_offset ||
+        me->name_offset >= mf->size ||
+        me->name_length >= mf->size - me->name_offset ||
+        mf->base[me->name_offset + me->name_length] != '\0') {
+        return NULL;
+    }
+    if (strlen(name) != me->name_length ||
+        memcmp(mf->base + me->name_offset, name, me->name_length) != 0) {
+        return NULL;
+    }
+
+    return me;
+}
+
+
+void VS_CC manifest_close(manifest_t *mf)
+{
+    if (!mf) {
+        return;
+    }
+    if (mf->base) {
+        unmap_file(mf);
+    }
+    free(mf);
+}
+
+
+static int replace_file(const char *from, const char *to)
+{
+#ifdef _WIN32
+    wchar_t wfrom[FILENAME_MAX * 2], wto[FILENAME_MAX * 2];
+    MultiByteToWideChar(CP_UTF8, 0, from, -1, wfrom, FILENAME_MAX * 2);
+    MultiByteToWideChar(CP_UTF8, 0, to, -1, wto, FILENAME_MAX * 2);
+    return MoveFileExW(wfrom, wto, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+
+/* writes the manifest into a temporary file and replaces the old one with
+   it, so that readers never map a half written manifest.
+   name_offset of the entries are filled here. */
+int VS_CC
+manifest_write(const char *path, uint32_t options, img_hnd_t *ih,
+               manifest_entry_t *entries, int num_entries)
+{
+    manifest_header_t h = { MANIFEST_MAGIC, MANIFEST_BYTE_ORDER,
+                            MANIFEST_VERSION, sizeof(manifest_entry_t),
+                            options, num_entries, 0, 0 };
+    h.names_offset = sizeof(h) + sizeof(manifest_entry_t) * num_entries;
+    uint64_t offset = h.names_offset;
+    for (int i = 0; i < num_entries; i++) {
+        entries[i].name_length = strlen(imgr_src_name(ih, i));
+        entries[i].name_offset = offset;
+        offset += entries[i].name_length + 1;
+    }
+    h.file_size = offset;
+
+    size_t len = strlen(path);
+    char *tmp_path = (char *)malloc(len + 5);
+    if (!tmp_path) {
+        return -1;
+    }
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *fp = imgr_fopen(tmp_path, "wb", L"wb");
+    if (!fp) {
+        free(tmp_path);
+        return -1;
+    }
+    int ret = fwrite(&h, sizeof(h), 1, fp) != 1 ||
+        fwrite(entries, sizeof(manifest_entry_t), num_entries, fp) !=
+        (size_t)num_entries;
+    for (int i = 0; i < num_entries && ret == 0; i++) {
+        ret = fwrite(imgr_src_name(ih, i), 1, entries[i].name_length + 1, fp) !=
+              entries[i].name_length + 1;
+    }
+    if (fclose(fp) || ret || replace_file(tmp_path, path)) {
+        remove(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    free(tmp_path);
+    return 0;
+}
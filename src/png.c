@@ -23,96 +23,984 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#ifdef HAVE_ZLIB_NG
+#include "zlib-ng.h"
+#else
+#include "zlib.h"
+#endif
+#ifdef HAVE_SPNG
+#include "spng.h"
+#else
 #ifdef ENABLE_NEW_PNG
 #include "pnglibconf.h"
 #include "pngconf.h"
 #endif
 #include "png.h"
+#endif
 #include "imagereader.h"
 
 #define PNG_SIG_LENGTH 8
 
+/* color types of IHDR */
+#define COLOR_GRAY       0
+#define COLOR_RGB        2
+#define COLOR_PALETTE    3
+#define COLOR_GRAY_ALPHA 4
+#define COLOR_RGB_ALPHA  6
+#define COLOR_MASK_ALPHA 4
+
+
+/* rows decoded by a backend. they are palette indices of 1/2/4/8 bits, or
+   samples of 8/16 bits in host byte order. */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    int color_type;
+    int bit_depth;
+    int interlaced;
+    size_t row_size;
+} png_layout_t;
+
 
-static int VS_CC read_png(img_hnd_t *ih, int n)
+/* imgr_unpack_indices() without writing after the end of the row */
+static void VS_CC
+unpack_row(const uint8_t *srcp, uint8_t *dstp, int width, int bits)
 {
-    FILE *fp = imgr_fopen(ih->src[n].name);
-    if (!fp) {
-        return -1;
+    int per_byte = 8 / bits;
+    int whole = width / per_byte;
+    imgr_unpack_indices(srcp, dstp, whole * per_byte, bits);
+    if (whole * per_byte < width) {
+        uint8_t last[8];
+        imgr_unpack_indices(srcp + whole, last, per_byte, bits);
+        memcpy(dstp + whole * per_byte, last, width - whole * per_byte);
     }
+}
+
+
+/* png backends. libpng is used unless configure selects libspng. each one
+   has
+     open_decoder()  reads the headers from data, or fp if it is not NULL
+     read_rows()     decodes the next rows of a non interlaced image
+     read_image()    decodes the whole image
+     load_palette()  copies PLTE and tRNS into ctx->palettes
+     close_decoder()
+   and returns -1 on failure. with trusted, the checksums are not verified
+   and the ancillary chunks are not parsed. */
+
+#ifndef HAVE_SPNG
+
+#ifndef PNGCBAPI
+#define PNGCBAPI PNGAPI
+#endif
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+} png_src_t;
+
+typedef struct {
+    png_structp p_str;
+    png_infop p_info;
+    png_src_t src;
+} png_decoder_t;
+
+
+static void PNGCBAPI
+read_from_memory(png_structp p_str, png_bytep buff, png_size_t length)
+{
+    png_src_t *src = (png_src_t *)png_get_io_ptr(p_str);
+    if (src->size - src->pos < length) {
+        png_error(p_str, "unexpected end of file");
+    }
+    memcpy(buff, src->data + src->pos, length);
+    src->pos += length;
+}
 
-    png_structp p_str =
+
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+/* ancillary chunks known by libpng, except tRNS */
+static png_byte ancillary_chunks[] =
+    "bKGD\0cHRM\0eXIf\0gAMA\0hIST\0iCCP\0iTXt\0oFFs\0pCAL\0pHYs\0sBIT\0"
+    "sCAL\0sPLT\0sRGB\0sTER\0tEXt\0tIME\0zTXt";
+#endif
+
+static void VS_CC set_trusted(png_structp p_str)
+{
+    png_set_crc_action(p_str, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#if defined(PNG_SET_OPTION_SUPPORTED) && defined(PNG_IGNORE_ADLER32)
+    png_set_option(p_str, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
+#ifdef PNG_HANDLE_AS_UNKNOWN_SUPPORTED
+    png_set_keep_unknown_chunks(p_str, PNG_HANDLE_CHUNK_NEVER,
+                                ancillary_chunks,
+                                sizeof(ancillary_chunks) / 5);
+#endif
+}
+
+
+static void VS_CC close_decoder(png_decoder_t *dec)
+{
+    png_destroy_read_struct(&dec->p_str, &dec->p_info, NULL);
+}
+
+
+/* samples are unpacked, swapped to little endian, and the alpha channel
+   is added or stripped following enable_alpha */
+static int VS_CC
+open_decoder(png_decoder_t *dec, const uint8_t *data, size_t size, FILE *fp,
+             img_hnd_t *ih, png_layout_t *layout)
+{
+    dec->src.data = data;
+    dec->src.size = size;
+    dec->src.pos = 0;
+    dec->p_info = NULL;
+    dec->p_str =
         png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!p_str) {
-        fclose(fp);
+    if (!dec->p_str) {
         return -1;
     }
-
-    png_infop p_info = png_create_info_struct(p_str);
-    if (!p_info) {
-        fclose(fp);
-        png_destroy_read_struct(&p_str, NULL, NULL);
+    dec->p_info = png_create_info_struct(dec->p_str);
+    if (!dec->p_info || setjmp(png_jmpbuf(dec->p_str))) {
+        close_decoder(dec);
         return -1;
     }
 
-    png_init_io(p_str, fp);
+    png_structp p_str = dec->p_str;
+    png_infop p_info = dec->p_info;
+    if (fp) {
+        png_init_io(p_str, fp);
+    } else {
+        png_set_read_fn(p_str, &dec->src, read_from_memory);
+    }
+    if (ih->trusted) {
+        set_trusted(p_str);
+    }
     png_read_info(p_str, p_info);
 
-    png_uint_32 width, height;
-    int color_type, bit_depth;
-    png_get_IHDR(p_str, p_info, &width, &height, &bit_depth, &color_type,
-                 NULL, NULL, NULL);
-    if (color_type & PNG_COLOR_TYPE_PALETTE) {
-        png_set_palette_to_rgb(p_str);
-    }
-    if (bit_depth < 8) {
-        png_set_packing(p_str);
+    int color_type = png_get_color_type(p_str, p_info);
+    int bit_depth = png_get_bit_depth(p_str, p_info);
+    int interlace = png_get_interlace_type(p_str, p_info);
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        /* indices are expanded by write_palette */
+    } else {
+        if (bit_depth < 8) {
+            png_set_packing(p_str);
+        }
+        if (ih->enable_alpha == 0) {
+            if (color_type & PNG_COLOR_MASK_ALPHA) {
+                png_set_strip_alpha(p_str);
+            }
+        } else if ((color_type & PNG_COLOR_MASK_ALPHA) == 0) {
+            png_set_add_alpha(p_str, 0x00, PNG_FILLER_AFTER);
+        }
     }
     if (bit_depth > 8) {
         png_set_swap(p_str);
     }
-    if (ih->enable_alpha == 0) {
-        if (color_type & PNG_COLOR_MASK_ALPHA) {
-            png_set_strip_alpha(p_str);
-        }
-    } else if ((color_type & PNG_COLOR_MASK_ALPHA) == 0) {
-        png_set_add_alpha(p_str, 0x00, PNG_FILLER_AFTER);
+    if (interlace != PNG_INTERLACE_NONE) {
+        png_set_interlace_handling(p_str);
     }
     png_read_update_info(p_str, p_info);
-    png_read_image(p_str, ih->png_row_index);
 
-    fclose(fp);
-    png_destroy_read_struct(&p_str, &p_info, NULL);
+    layout->width = png_get_image_width(p_str, p_info);
+    layout->height = png_get_image_height(p_str, p_info);
+    layout->color_type = png_get_color_type(p_str, p_info);
+    layout->bit_depth = png_get_bit_depth(p_str, p_info);
+    layout->interlaced = interlace != PNG_INTERLACE_NONE;
+    layout->row_size = png_get_rowbytes(p_str, p_info);
+    return 0;
+}
 
-    ih->misc = IMG_ORDER_RGB;
-    ih->row_adjust = 1;
 
-    switch ((ih->src[n].format->id << 1) | ih->enable_alpha) {
-    case (pfRGB24 << 1 | 0):
-        ih->write_frame = func_write_rgb24;
-        break;
-    case (pfRGB24 << 1 | 1):
-        ih->write_frame = func_write_rgb32;
-        break;
-    case (pfRGB48 << 1 | 0):
-        ih->write_frame = func_write_rgb48;
+static int VS_CC
+read_rows(png_decoder_t *dec, uint8_t *buff, size_t row_size, int rows)
+{
+    if (setjmp(png_jmpbuf(dec->p_str))) {
+        return -1;
+    }
+    for (int i = 0; i < rows; i++) {
+        png_read_row(dec->p_str, buff + i * row_size, NULL);
+    }
+    return 0;
+}
+
+
+static int VS_CC
+read_image(png_decoder_t *dec, uint8_t *buff, size_t row_size, int height,
+           img_ctx_t *ctx)
+{
+    if (ctx->png_row_index_size < height) {
+        uint8_t **index = (uint8_t **)realloc(ctx->png_row_index,
+                                              sizeof(uint8_t *) * height);
+        if (!index) {
+            return -1;
+        }
+        ctx->png_row_index = index;
+        ctx->png_row_index_size = height;
+    }
+    for (int i = 0; i < height; i++) {
+        ctx->png_row_index[i] = buff + i * row_size;
+    }
+
+    if (setjmp(png_jmpbuf(dec->p_str))) {
+        return -1;
+    }
+    png_read_image(dec->p_str, ctx->png_row_index);
+    return 0;
+}
+
+
+static int VS_CC load_palette(png_decoder_t *dec, img_ctx_t *ctx)
+{
+    png_colorp plte = NULL;
+    int num_plte = 0;
+    png_bytep trns = NULL;
+    int num_trns = 0;
+    png_get_PLTE(dec->p_str, dec->p_info, &plte, &num_plte);
+    png_get_tRNS(dec->p_str, dec->p_info, &trns, &num_trns, NULL);
+
+    memset(ctx->palettes, 0, sizeof(ctx->palettes));
+    for (int i = 0; i < num_plte && i < 256; i++) {
+        ctx->palettes[i].blue = plte[i].blue;
+        ctx->palettes[i].green = plte[i].green;
+        ctx->palettes[i].red = plte[i].red;
+        if (trns) {
+            ctx->palettes[i].reserved = i < num_trns ? trns[i] : 0xFF;
+        }
+    }
+    ctx->misc = trns ? IMG_PALETTE_ALPHA : 0;
+    return 0;
+}
+
+#else
+
+typedef struct {
+    spng_ctx *sctx;
+    uint32_t width;
+    int unpack; // bits of the gray samples expanded to bytes, 0 if none
+    size_t packed_size; // rows of the png format
+    uint8_t *row; // a packed row for unpack
+    int started;
+} png_decoder_t;
+
+
+static void VS_CC close_decoder(png_decoder_t *dec)
+{
+    spng_ctx_free(dec->sctx);
+    free(dec->row);
+}
+
+
+/* the rows are in the format of the png, except that gray samples of
+   1/2/4 bits are unpacked. the alpha of the images without alpha channel
+   is made by the writers. */
+static int VS_CC
+open_decoder(png_decoder_t *dec, const uint8_t *data, size_t size, FILE *fp,
+             img_hnd_t *ih, png_layout_t *layout)
+{
+    memset(dec, 0, sizeof(png_decoder_t));
+    dec->sctx = spng_ctx_new(ih->trusted ? SPNG_CTX_IGNORE_ADLER32 : 0);
+    if (!dec->sctx) {
+        return -1;
+    }
+    if (ih->trusted) {
+        spng_set_crc_action(dec->sctx, SPNG_CRC_USE, SPNG_CRC_USE);
+    }
+
+    struct spng_ihdr ihdr;
+    size_t image_size;
+    if ((fp ? spng_set_png_file(dec->sctx, fp)
+            : spng_set_png_buffer(dec->sctx, data, size)) ||
+        spng_get_ihdr(dec->sctx, &ihdr) ||
+        spng_decoded_image_size(dec->sctx, SPNG_FMT_PNG, &image_size)) {
+        close_decoder(dec);
+        return -1;
+    }
+
+    dec->width = ihdr.width;
+    dec->packed_size = image_size / ihdr.height;
+    layout->width = ihdr.width;
+    layout->height = ihdr.height;
+    layout->color_type = ihdr.color_type;
+    layout->bit_depth = ihdr.bit_depth;
+    layout->interlaced = ihdr.interlace_method != SPNG_INTERLACE_NONE;
+    layout->row_size = dec->packed_size;
+    if (ihdr.color_type == COLOR_GRAY && ihdr.bit_depth < 8) {
+        dec->unpack = ihdr.bit_depth;
+        layout->bit_depth = 8;
+        layout->row_size = ihdr.width;
+    }
+    return 0;
+}
+
+
+static int VS_CC
+read_rows(png_decoder_t *dec, uint8_t *buff, size_t row_size, int rows)
+{
+    if (!dec->started) {
+        if (spng_decode_image(dec->sctx, NULL, 0, SPNG_FMT_PNG,
+                              SPNG_DECODE_PROGRESSIVE)) {
+            return -1;
+        }
+        if (dec->unpack) {
+            dec->row = (uint8_t *)malloc(dec->packed_size);
+            if (!dec->row) {
+                return -1;
+            }
+        }
+        dec->started = 1;
+    }
+
+    for (int i = 0; i < rows; i++) {
+        uint8_t *dstp = buff + i * row_size;
+        int ret = spng_decode_row(dec->sctx, dec->unpack ? dec->row : dstp,
+                                  dec->packed_size);
+        if (ret != 0 && ret != SPNG_EOI) {
+            return -1;
+        }
+        if (dec->unpack) {
+            unpack_row(dec->row, dstp, dec->width, dec->unpack);
+        }
+    }
+    return 0;
+}
+
+
+static int VS_CC
+read_image(png_decoder_t *dec, uint8_t *buff, size_t row_size, int height,
+           img_ctx_t *ctx)
+{
+    if (spng_decode_image(dec->sctx, buff, dec->packed_size * height,
+                          SPNG_FMT_PNG, 0)) {
+        return -1;
+    }
+    if (!dec->unpack) {
+        return 0;
+    }
+
+    /* packed rows are unpacked from the bottom, each one through row
+       since it overlaps its own unpacked row */
+    dec->row = (uint8_t *)malloc(dec->packed_size);
+    if (!dec->row) {
+        return -1;
+    }
+    for (int y = height - 1; y >= 0; y--) {
+        memcpy(dec->row, buff + y * dec->packed_size, dec->packed_size);
+        unpack_row(dec->row, buff + y * row_size, dec->width, dec->unpack);
+    }
+    return 0;
+}
+
+
+static int VS_CC load_palette(png_decoder_t *dec, img_ctx_t *ctx)
+{
+    struct spng_plte plte;
+    struct spng_trns trns;
+    if (spng_get_plte(dec->sctx, &plte)) {
+        return -1;
+    }
+    int has_trns = spng_get_trns(dec->sctx, &trns) == 0;
+
+    memset(ctx->palettes, 0, sizeof(ctx->palettes));
+    for (uint32_t i = 0; i < plte.n_entries && i < 256; i++) {
+        ctx->palettes[i].blue = plte.entries[i].blue;
+        ctx->palettes[i].green = plte.entries[i].green;
+        ctx->palettes[i].red = plte.entries[i].red;
+        if (has_trns) {
+            ctx->palettes[i].reserved = i < trns.n_type3_entries ?
+                                        trns.type3_alpha[i] : 0xFF;
+        }
+    }
+    ctx->misc = has_trns ? IMG_PALETTE_ALPHA : 0;
+    return 0;
+}
+
+#endif
+
+
+static func_write_frame VS_CC select_writer(const png_layout_t *layout)
+{
+    int bytes = layout->bit_depth == 16 ? 2 : 1;
+    switch (layout->color_type) {
+    case COLOR_GRAY:
+        return func_write_planar;
+    case COLOR_GRAY_ALPHA:
+        return bytes == 1 ? func_write_gray8_a : func_write_gray16_a;
+    case COLOR_RGB:
+        return bytes == 1 ? func_write_rgb24 : func_write_rgb48;
+    case COLOR_RGB_ALPHA:
+        return bytes == 1 ? func_write_rgb32 : func_write_rgb64;
+    case COLOR_PALETTE:
+        return func_write_palette;
+    default:
+        return NULL;
+    }
+}
+
+
+static VSPresetFormat VS_CC format_of(const png_layout_t *layout);
+
+
+/* checks the size of the image and prepares ctx for the rows of layout.
+   returns the writer of the rows, or NULL on failure. */
+static func_write_frame VS_CC
+setup_png(png_decoder_t *dec, const png_layout_t *layout, img_hnd_t *ih,
+          img_ctx_t *ctx, int n)
+{
+    int out_width = IMG_PROXY_SIZE(layout->width, ih->proxy);
+    int out_height = IMG_PROXY_SIZE(layout->height, ih->proxy);
+    if (ih->crop ? out_width < ih->roi[0] + ih->src[n].width ||
+                   out_height < ih->roi[1] + ih->src[n].height
+                 : out_width != ih->src[n].width ||
+                   out_height != ih->src[n].height) {
+        return NULL; // image size changed
+    }
+    if (imgr_check_layout(ih, n, format_of(layout), layout->row_size, 0)) {
+        return NULL;
+    }
+    if (imgr_set_image_size(ih, ctx, n, layout->width, layout->height,
+                            ih->proxy)) {
+        return NULL;
+    }
+
+    func_write_frame write_rows = select_writer(layout);
+    if (!write_rows) {
+        return NULL;
+    }
+    if (layout->color_type == COLOR_PALETTE) {
+        if (load_palette(dec, ctx)) {
+            return NULL;
+        }
+        ctx->misc |= IMG_ORDER_BGR | layout->bit_depth;
+    } else {
+        ctx->misc = IMG_ORDER_RGB;
+    }
+    return write_rows;
+}
+
+
+/* split IDAT: some encoders split the image data into segments of rows,
+   each of them starting at an IDAT chunk on a deflate block boundary with
+   no back reference into the previous segment, and index them with an
+   iDOT chunk before the first IDAT. all numbers are 32bit big endian:
+     number of segments (N)
+     reserved
+     nominal rows in a segment
+     offset of the first IDAT chunk
+     rows of each segment (N entries)
+     offset of the first IDAT chunk of each segment after the first one
+     (N - 1 entries)
+   offsets are from the length field of the iDOT chunk. the segments are
+   inflated and unfiltered on the worker pool of the handler, using the
+   plugin's own inflate. */
+
+#define PNG_MAX_SEGMENTS 64
+
+#ifdef HAVE_ZLIB_NG
+#define ZNAME(name) zng_ ## name
+typedef zng_stream zstream_t;
+#else
+#define ZNAME(name) name
+typedef z_stream zstream_t;
+#endif
+
+typedef struct {
+    const uint8_t *data; // whole file
+    size_t size;
+    png_layout_t layout; // rows passed to the writer
+    int pixel_bits;
+    size_t packed_size; // bytes of a row in the file, without filter type
+    uint8_t *filtered; // rows in the file, with their filter types
+    uint8_t *image;
+    int trusted;
+    uint32_t adler; // end of the zlib stream
+    trace_t *trace;
+    int n; // frame number for the trace
+} png_split_t;
+
+typedef struct {
+    size_t chunk; // first IDAT chunk of the segment
+    int top;
+    int height;
+    uint32_t adler;
+} png_segment_t;
+
+/* consecutive segments decoded by one task */
+typedef struct {
+    png_split_t *ps;
+    png_segment_t *segs;
+    int num_segs;
+    int deferred; // first row needs the last row of the previous job
+} png_job_t;
+
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static int VS_CC channels_of(int color_type)
+{
+    switch (color_type) {
+    case COLOR_GRAY:
+    case COLOR_PALETTE:
+        return 1;
+    case COLOR_GRAY_ALPHA:
+        return 2;
+    case COLOR_RGB:
+        return 3;
+    case COLOR_RGB_ALPHA:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+
+/* reads IHDR and iDOT, and finds the IDAT chunks starting the segments.
+   returns the number of the segments, or 0 if the image is not split. */
+static int VS_CC
+read_split_index(const uint8_t *data, size_t size, png_split_t *ps,
+                 png_segment_t *segs)
+{
+    if (size < PNG_SIG_LENGTH + 25 ||
+        memcmp(data + PNG_SIG_LENGTH + 4, "IHDR", 4) ||
+        get_be32(data + PNG_SIG_LENGTH) != 13) {
+        return 0;
+    }
+    const uint8_t *ihdr = data + PNG_SIG_LENGTH + 8;
+    uint32_t width = get_be32(ihdr);
+    uint32_t height = get_be32(ihdr + 4);
+    int bit_depth = ihdr[8];
+    int color_type = ihdr[9];
+    int channels = channels_of(color_type);
+    if (width == 0 || height == 0 || channels == 0 || ihdr[12] != 0) {
+        return 0; // interlaced
+    }
+
+    memset(ps, 0, sizeof(png_split_t));
+    ps->data = data;
+    ps->size = size;
+    ps->pixel_bits = channels * bit_depth;
+    ps->packed_size = ((size_t)width * ps->pixel_bits + 7) / 8;
+    ps->layout.width = width;
+    ps->layout.height = height;
+    ps->layout.color_type = color_type;
+    ps->layout.bit_depth = bit_depth;
+    ps->layout.row_size = ps->packed_size;
+    if (color_type == COLOR_GRAY && bit_depth < 8) {
+        ps->layout.bit_depth = 8;
+        ps->layout.row_size = width;
+    }
+
+    int num = 0;
+    int found = 0;
+    const uint8_t *idot = NULL;
+    size_t idot_pos = 0;
+    uint8_t tail[4] = { 0 };
+    size_t pos = PNG_SIG_LENGTH + 25;
+    while (pos + 12 <= size) {
+        const uint8_t *p = data + pos;
+        uint32_t len = get_be32(p);
+        if (len > size - pos - 12) {
+            return 0;
+        }
+        if (!memcmp(p + 4, "iDOT", 4) && !found) {
+            num = len >= 12 ? get_be32(p + 8) : 0;
+            if (num < 2 || num > PNG_MAX_SEGMENTS ||
+                len != 4 * (3 + 2 * (uint32_t)num)) {
+                return 0;
+            }
+            idot = p + 8;
+            idot_pos = pos;
+        } else if (!memcmp(p + 4, "IDAT", 4)) {
+            if (!idot) {
+                return 0;
+            }
+            size_t offset = pos - idot_pos;
+            uint32_t expected = found == 0 ? get_be32(idot + 12) :
+                found < num ? get_be32(idot + 16 + 4 * (num + found - 1)) : 0;
+            if (found < num && offset == expected) {
+                segs[found].chunk = pos;
+                segs[found].height = get_be32(idot + 16 + 4 * found);
+                segs[found].top = found == 0 ? 0 :
+                    segs[found - 1].top + segs[found - 1].height;
+                if (segs[found].height == 0 ||
+                    segs[found].height > height - segs[found].top) {
+                    return 0;
+                }
+                found++;
+            } else if (found == 0) {
+                return 0;
+            }
+            for (uint32_t i = len < 4 ? 0 : len - 4; i < len; i++) {
+                memmove(tail, tail + 1, 3);
+                tail[3] = p[8 + i];
+            }
+        } else if (!memcmp(p + 4, "IEND", 4)) {
+            break;
+        }
+        pos += len + 12;
+    }
+    if (num == 0 || found != num ||
+        segs[num - 1].top + segs[num - 1].height != height) {
+        return 0;
+    }
+    ps->adler = get_be32(tail);
+    return num;
+}
+
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+
+/* prev is NULL for the first row of the image */
+static int VS_CC
+unfilter_row(uint8_t *row, const uint8_t *prev, size_t size, size_t bpp,
+             int filter)
+{
+    if (!prev && (filter == 2 || filter == 4)) {
+        filter = filter == 2 ? 0 : 1; // the row above is zero
+    }
+    switch (filter) {
+    case 0:
         break;
-    case (pfRGB48 << 1 | 1):
-        ih->write_frame = func_write_rgb64;
+    case 1:
+        for (size_t i = bpp; i < size; i++) {
+            row[i] += row[i - bpp];
+        }
         break;
-    case (pfGray8 << 1 | 0):
-    case (pfGray16 << 1 | 0):
-        ih->write_frame = func_write_planar;
+    case 2:
+        for (size_t i = 0; i < size; i++) {
+            row[i] += prev[i];
+        }
         break;
-    case (pfGray8 << 1 | 1):
-        ih->write_frame = func_write_gray8_a;
+    case 3:
+        for (size_t i = 0; i < size; i++) {
+            int a = i < bpp ? 0 : row[i - bpp];
+            int b = prev ? prev[i] : 0;
+            row[i] += (a + b) >> 1;
+        }
         break;
-    case (pfGray16 << 1 | 1):
-        ih->write_frame = func_write_gray16_a;
+    case 4:
+        for (size_t i = 0; i < bpp && i < size; i++) {
+            row[i] += prev[i];
+        }
+        for (size_t i = bpp; i < size; i++) {
+            row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+        }
         break;
     default:
-        break;
+        return -1;
     }
+    return 0;
+}
+
+
+/* unfilters the rows, and converts them into the rows of the layout */
+static int VS_CC unfilter_rows(png_split_t *ps, int top, int height)
+{
+    size_t stride = ps->packed_size + 1;
+    size_t bpp = ps->pixel_bits < 8 ? 1 : ps->pixel_bits / 8;
+    png_layout_t *layout = &ps->layout;
+    for (int y = top; y < top + height; y++) {
+        uint8_t *row = ps->filtered + y * stride;
+        if (unfilter_row(row + 1, y == 0 ? NULL : row + 1 - stride,
+                         ps->packed_size, bpp, row[0])) {
+            return -1;
+        }
+        uint8_t *dstp = ps->image + y * layout->row_size;
+        if (layout->bit_depth == 16) {
+            /* to little endian, as set_swap of libpng */
+            for (size_t i = 0; i < ps->packed_size; i += 2) {
+                dstp[i] = row[i + 2];
+                dstp[i + 1] = row[i + 1];
+            }
+        } else if (layout->row_size != ps->packed_size) {
+            unpack_row(row + 1, dstp, layout->width, ps->pixel_bits);
+        } else {
+            memcpy(dstp, row + 1, ps->packed_size);
+        }
+    }
+    return 0;
+}
+
+
+/* inflates the rows of the segment. the first segment follows the zlib
+   header. */
+static int VS_CC inflate_segment(png_split_t *ps, png_segment_t *seg)
+{
+    size_t stride = ps->packed_size + 1;
+    uint8_t *out = ps->filtered + seg->top * stride;
+    size_t out_size = stride * seg->height;
+    zstream_t zs;
+    memset(&zs, 0, sizeof(zs));
+    if (ZNAME(inflateInit2)(&zs, -15) != Z_OK) {
+        return -1;
+    }
+    zs.next_out = out;
+    zs.avail_out = out_size;
+
+    int ret = 0;
+    int header = seg->top == 0 ? 2 : 0;
+    size_t pos = seg->chunk;
+    while (ret == 0 && zs.avail_out > 0) {
+        const uint8_t *p = ps->data + pos;
+        uint32_t len = pos + 12 <= ps->size ? get_be32(p) : 0;
+        if (pos + 12 > ps->size || len > ps->size - pos - 12 ||
+            memcmp(p + 4, "IDAT", 4) || len < header ||
+            (!ps->trusted &&
+             ZNAME(crc32)(0, p + 4, len + 4) != get_be32(p + 8 + len))) {
+            ret = -1;
+            break;
+        }
+        if (header && ((p[8] & 0x0F) != 8 || (p[9] & 0x20) ||
+                       ((p[8] << 8) | p[9]) % 31)) {
+            ret = -1; // not deflate, or with preset dictionary
+            break;
+        }
+        zs.next_in = (uint8_t *)p + 8 + header;
+        zs.avail_in = len - header;
+        header = 0;
+        int zret = ZNAME(inflate)(&zs, Z_NO_FLUSH);
+        if (zret == Z_STREAM_END ? zs.avail_out > 0
+                                 : zret != Z_OK && zret != Z_BUF_ERROR) {
+            ret = -1;
+        }
+        pos += len + 12;
+    }
+    ZNAME(inflateEnd)(&zs);
+
+    if (ret == 0 && !ps->trusted) {
+        seg->adler = ZNAME(adler32)(1, out, out_size);
+    }
+    return ret;
+}
+
+
+/* the first row of a job filtered with the row above waits for the
+   previous job, and the rows of the job are unfiltered after it. */
+static int VS_CC decode_job(png_job_t *job)
+{
+    int64_t start = imgr_now();
+    png_split_t *ps = job->ps;
+    int ret = 0;
+    for (int i = 0; ret == 0 && i < job->num_segs; i++) {
+        ret = inflate_segment(ps, job->segs + i) ? -1 : 0;
+    }
+
+    if (ret == 0) {
+        int top = job->segs[0].top;
+        int filter = ps->filtered[top * (ps->packed_size + 1)];
+        job->deferred = top > 0 && filter >= 2;
+        if (!job->deferred) {
+            png_segment_t *last = job->segs + job->num_segs - 1;
+            ret = unfilter_rows(ps, top, last->top + last->height - top);
+        }
+    }
+    trace_event(ps->trace, "png_segments", ps->n, start, imgr_now());
+    return ret;
+}
+
+
+static int VS_CC job_task(void *arg, pool_local_t *local)
+{
+    return decode_job((png_job_t *)arg);
+}
+
+
+/* decodes the segments overlapping the rows of the region on up to threads
+   threads of the pool. returns 1 if the image is not split, or the split
+   data can't be decoded. the image is then decoded by the backend as usual. */
+static int VS_CC
+decode_split(png_decoder_t *dec, img_hnd_t *ih, img_ctx_t *ctx, int n,
+             VSFrameRef **dst, worker_pool_t *pool, int threads,
+             VSCore *core, const VSAPI *vsapi)
+{
+    png_split_t ps;
+    png_segment_t segs[PNG_MAX_SEGMENTS];
+    int num = read_split_index(ctx->source.data, ctx->source.size, &ps, segs);
+    if (num < 2) {
+        return 1;
+    }
+    for (int i = 0; i < num; i++) {
+        if ((ps.packed_size + 1) * segs[i].height > UINT32_MAX / 2) {
+            return 1; // larger than a zlib stream can output at once
+        }
+    }
+    func_write_frame write_rows = setup_png(dec, &ps.layout, ih, ctx, n);
+    if (!write_rows) {
+        return 1;
+    }
+
+    int last = imgr_rows_needed(ih, ctx, n);
+    while (segs[num - 1].top >= last) {
+        num--;
+    }
+    int height = segs[num - 1].top + segs[num - 1].height;
+    size_t image_size = ps.layout.row_size * ps.layout.height;
+    uint8_t *buff = imgr_image_buffer(ctx, image_size +
+                                      (ps.packed_size + 1) * height);
+    if (!buff) {
+        return 1;
+    }
+    ps.image = buff;
+    ps.filtered = buff + image_size;
+    ps.trusted = ih->trusted;
+    ps.trace = ih->trace;
+    ps.n = n;
+
+    png_job_t jobs[PNG_MAX_SEGMENTS];
+    pool_task_t tasks[PNG_MAX_SEGMENTS];
+    int num_jobs = num < threads ? num : threads;
+    for (int i = 0; i < num_jobs; i++) {
+        int first = num * i / num_jobs;
+        jobs[i].ps = &ps;
+        jobs[i].segs = segs + first;
+        jobs[i].num_segs = num * (i + 1) / num_jobs - first;
+        tasks[i].func = job_task;
+        tasks[i].arg = jobs + i;
+        tasks[i].ret = 0;
+    }
+    /* the first job is decoded by this thread */
+    pool_local_t local = { NULL };
+    int ret = pool_run(pool, tasks, num_jobs, &local);
+    for (int i = 0; ret == 0 && i < num_jobs; i++) {
+        if (jobs[i].deferred) {
+            png_segment_t *seg = jobs[i].segs + jobs[i].num_segs - 1;
+            ret = unfilter_rows(&ps, jobs[i].segs[0].top,
+                                seg->top + seg->height - jobs[i].segs[0].top);
+        }
+    }
+    if (ret == 0 && !ps.trusted && height == (int)ps.layout.height) {
+        /* the adler32 of the whole stream is checked when it is read */
+        uint32_t adler = segs[0].adler;
+        for (int i = 1; i < num; i++) {
+            adler = ZNAME(adler32_combine)(adler, segs[i].adler,
+                                           (ps.packed_size + 1) *
+                                           segs[i].height);
+        }
+        ret = adler != ps.adler;
+    }
+    if (ret) {
+        return 1;
+    }
+
+    ctx->image = ps.image;
+    ctx->band_height = 0;
+    write_rows(ih, ctx, n, dst, core, vsapi);
+    return 0;
+}
+
+
+/* decodes the rows in bands of about IMG_BAND_SIZE bytes and passes each
+   band to the writer while it is still in cache. interlaced images are
+   decoded whole. returns -1 on failure, and the frame is freed by the
+   caller. */
+static int VS_CC
+decode_png(png_decoder_t *dec, const png_layout_t *layout, img_hnd_t *ih,
+           img_ctx_t *ctx, int n, VSFrameRef **dst, VSCore *core,
+           const VSAPI *vsapi)
+{
+    func_write_frame write_rows = setup_png(dec, layout, ih, ctx, n);
+    if (!write_rows) {
+        return -1;
+    }
+    uint32_t height = layout->height;
+
+    /* rows are packed with their own size, as the writers expect */
+    size_t row_size = layout->row_size;
+    uint32_t band = layout->interlaced ? height : IMG_BAND_SIZE / row_size;
+    if (band < 1) {
+        band = 1;
+    }
+    if (band > height) {
+        band = height;
+    }
+    uint8_t *buff = imgr_image_buffer(ctx, row_size * band);
+    if (!buff) {
+        return -1;
+    }
+    ctx->image = buff;
+
+    if (layout->interlaced) {
+        if (read_image(dec, buff, row_size, height, ctx)) {
+            return -1;
+        }
+        write_rows(ih, ctx, n, dst, core, vsapi);
+        return 0;
+    }
+
+    /* the rows after the region of interest are not read */
+    uint32_t last = imgr_rows_needed(ih, ctx, n);
+    for (uint32_t y = 0; y < last; y += band) {
+        uint32_t rows = last - y < band ? last - y : band;
+        if (read_rows(dec, buff, row_size, rows)) {
+            ctx->band_height = 0;
+            return -1;
+        }
+        ctx->band_top = y;
+        ctx->band_height = rows;
+        write_rows(ih, ctx, n, dst, core, vsapi);
+    }
+    ctx->band_height = 0;
+    return 0;
+}
+
+
+static void VS_CC
+write_png(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+          VSCore *core, const VSAPI *vsapi)
+{
+    png_decoder_t dec;
+    png_layout_t layout;
+    if (open_decoder(&dec, ctx->source.data, ctx->source.size, NULL, ih,
+                     &layout)) {
+        vsapi->freeFrame(dst[0]);
+        dst[0] = NULL;
+        return;
+    }
+
+    int ret = 1;
+    int threads = imgr_split_threads(ih, core, vsapi);
+    worker_pool_t *pool = NULL;
+    if (threads > 1 && !layout.interlaced) {
+        pool = imgr_pool(ih, core, vsapi);
+    }
+    if (pool) {
+        ret = decode_split(&dec, ih, ctx, n, dst, pool, threads, core, vsapi);
+    }
+    if (ret > 0) {
+        ret = decode_png(&dec, &layout, ih, ctx, n, dst, core, vsapi);
+    }
+    if (ret) {
+        vsapi->freeFrame(dst[0]);
+        dst[0] = NULL;
+    }
+    close_decoder(&dec);
+}
+
+
+static int VS_CC read_png(img_hnd_t *ih, img_ctx_t *ctx, int n)
+{
+    if (imgr_load_source(ih, ctx, n)) {
+        return -1;
+    }
+
+    ctx->write_frame = write_png;
+    ctx->row_adjust = 1;
 
     return 0;
 }
@@ -127,14 +1015,14 @@ static VSPresetFormat VS_CC get_dst_format(int color_type, int bits)
         uint32_t png_color_type;
         VSPresetFormat vsformat;
     } table[] = {
-        { COLOR_OR_BITS(PNG_COLOR_TYPE_GRAY,        8),  pfGray8  },
-        { COLOR_OR_BITS(PNG_COLOR_TYPE_GRAY_ALPHA,  8),  pfGray8  },
-        { COLOR_OR_BITS(PNG_COLOR_TYPE_GRAY,       16),  pfGray16 },
-        { COLOR_OR_BITS(PNG_COLOR_TYPE_GRAY_ALPHA, 16),  pfGray16 },
-        { COLOR_OR_BITS(PNG_COLOR_TYPE_RGB,         8),  pfRGB24  },
-        { COLOR_OR_BITS(PNG_COLOR_TYPE_RGB_ALPHA,   8),  pfRGB24  },
-        { COLOR_OR_BITS(PNG_COLOR_TYPE_RGB,        16),  pfRGB48  },
-        { COLOR_OR_BITS(PNG_COLOR_TYPE_RGB_ALPHA,  16),  pfRGB48  },
+        { COLOR_OR_BITS(COLOR_GRAY,        8),  pfGray8  },
+        { COLOR_OR_BITS(COLOR_GRAY_ALPHA,  8),  pfGray8  },
+        { COLOR_OR_BITS(COLOR_GRAY,       16),  pfGray16 },
+        { COLOR_OR_BITS(COLOR_GRAY_ALPHA, 16),  pfGray16 },
+        { COLOR_OR_BITS(COLOR_RGB,         8),  pfRGB24  },
+        { COLOR_OR_BITS(COLOR_RGB_ALPHA,   8),  pfRGB24  },
+        { COLOR_OR_BITS(COLOR_RGB,        16),  pfRGB48  },
+        { COLOR_OR_BITS(COLOR_RGB_ALPHA,  16),  pfRGB48  },
         { p_color, pfNone }
     };
 
@@ -145,61 +1033,41 @@ static VSPresetFormat VS_CC get_dst_format(int color_type, int bits)
 #undef COLOR_OR_BITS
 
 
+static VSPresetFormat VS_CC format_of(const png_layout_t *layout)
+{
+    /* indices are expanded to RGB24 by write_palette */
+    return layout->color_type == COLOR_PALETTE ? pfRGB24 :
+           get_dst_format(layout->color_type, layout->bit_depth);
+}
+
+
 static const char * VS_CC
 check_png(img_hnd_t *ih, int n, FILE *fp, vs_args_t *va)
 {
+    static const uint8_t png_sig[PNG_SIG_LENGTH] = {
+        0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A
+    };
     uint8_t signature[PNG_SIG_LENGTH];
     if (fread(signature, 1, PNG_SIG_LENGTH, fp) != PNG_SIG_LENGTH ||
-        png_sig_cmp(signature, 0, PNG_SIG_LENGTH)) {
+        memcmp(signature, png_sig, PNG_SIG_LENGTH) ||
+        fseek(fp, 0, SEEK_SET)) {
         return "unsupported format";
     }
 
-    png_structp p_str = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
-                                               NULL, NULL);
-    if (!p_str) {
-        return "failed to create png_read_struct";
-    }
-
-    png_infop p_info = png_create_info_struct(p_str);
-    if (!p_info) {
-        png_destroy_read_struct(&p_str, NULL, NULL);
-        return "failed to create png_info_struct";
-    }
-
-    png_init_io(p_str, fp);
-    png_set_sig_bytes(p_str, PNG_SIG_LENGTH);
-    png_read_info(p_str, p_info);
-
-    png_uint_32 width, height;
-    int color_type, bit_depth;
-    png_get_IHDR(p_str, p_info, &width, &height, &bit_depth, &color_type,
-                 NULL, NULL, NULL);
-    if (color_type & PNG_COLOR_TYPE_PALETTE) {
-        png_set_palette_to_rgb(p_str);
+    int64_t t = imgr_probe_start(va);
+    png_decoder_t dec;
+    png_layout_t layout;
+    if (open_decoder(&dec, NULL, 0, fp, ih, &layout)) {
+        return "failed to read png header";
     }
-    if (bit_depth < 8) {
-        png_set_packing(p_str);
-    }
-    if (ih->enable_alpha == 0) {
-        if (color_type & PNG_COLOR_MASK_ALPHA) {
-            png_set_strip_alpha(p_str);
-        }
-    } else if ((color_type & PNG_COLOR_MASK_ALPHA) == 0) {
-        png_set_add_alpha(p_str, 0x00, PNG_FILLER_AFTER);
-    }
-
-    png_read_update_info(p_str, p_info);
-    png_get_IHDR(p_str, p_info, &width, &height, &bit_depth, &color_type,
-                 NULL, NULL, NULL);
-    uint32_t row_size = png_get_rowbytes(p_str, p_info);
-
-    png_destroy_read_struct(&p_str, &p_info, NULL);
+    close_decoder(&dec);
+    imgr_probe_time(va, PROBE_PNG_SETUP, t);
 
-    ih->src[n].width = width;
+    ih->src[n].width = layout.width;
 
-    ih->src[n].height = height;
+    ih->src[n].height = layout.height;
 
-    VSPresetFormat pf = get_dst_format(color_type, bit_depth);
+    VSPresetFormat pf = format_of(&layout);
     if (pf == pfNone) {
         return "unsupported png color type";
     }
@@ -209,8 +1077,8 @@ check_png(img_hnd_t *ih, int n, FILE *fp, vs_args_t *va)
 
     ih->src[n].flip = 0;
 
-    if (row_size > va->max_row_size) {
-        va->max_row_size = row_size;
+    if (layout.row_size > va->max_row_size) {
+        va->max_row_size = layout.row_size;
     }
 
     return NULL;
@@ -218,3 +1086,4 @@ check_png(img_hnd_t *ih, int n, FILE *fp, vs_args_t *va)
 
 
 const func_check_src check_src_png = check_png;
+const func_read_image read_src_png = read_png;
@@ -0,0 +1,235 @@
+/*
+  pool.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+
+/* persistent worker threads of an imgr.Read instance, decoding the parts
+   of the split images. the thread requesting the frame decodes the first
+   part, and then the parts not yet taken by the workers, so a frame never
+   waits for the workers busy with other frames to start its parts. */
+
+#include <stdlib.h>
+
+#include "turbojpeg.h"
+#include "imagereader.h"
+
+typedef struct {
+    int pending; // tasks queued or running on the workers
+} pool_batch_t;
+
+struct worker_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t wake; // signaled to the workers
+    pthread_cond_t done; // signaled when a batch finished
+    pool_task_t *head; // queued tasks
+    pool_task_t *tail;
+    int quit;
+    int num_threads;
+    pthread_t *threads;
+};
+
+
+static void run_task(pool_task_t *task, pool_local_t *local)
+{
+    task->ret = task->func(task->arg, local);
+}
+
+
+static void *worker(void *arg)
+{
+    worker_pool_t *pool = (worker_pool_t *)arg;
+    pool_local_t local = { NULL };
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (!pool->head && !pool->quit) {
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+        }
+        if (!pool->head) {
+            break;
+        }
+        pool_task_t *task = pool->head;
+        pool->head = task->next;
+        if (!pool->head) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        run_task(task, &local);
+
+        pthread_mutex_lock(&pool->mutex);
+        pool_batch_t *batch = (pool_batch_t *)task->batch;
+        if (--batch->pending == 0) {
+            pthread_cond_broadcast(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (local.tjhandle) {
+        tjDestroy((tjhandle)local.tjhandle);
+    }
+    return NULL;
+}
+
+
+void VS_CC pool_destroy(worker_pool_t *pool)
+{
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+
+static worker_pool_t *pool_create(int num_threads)
+{
+    worker_pool_t *pool = (worker_pool_t *)calloc(sizeof(worker_pool_t), 1);
+    if (!pool) {
+        return NULL;
+    }
+    pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (; pool->num_threads < num_threads; pool->num_threads++) {
+        if (pthread_create(pool->threads + pool->num_threads, NULL, worker,
+                           pool)) {
+            break;
+        }
+    }
+    if (pool->num_threads == 0) {
+        pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+
+/* the pool of ih, made on the first split image. the workers are one less
+   than the threads of the core, since the requesting thread decodes too.
+   returns NULL if the core has one thread. */
+worker_pool_t * VS_CC imgr_pool(img_hnd_t *ih, VSCore *core,
+                                const VSAPI *vsapi)
+{
+    int threads = vsapi->getCoreInfo(core)->numThreads;
+    if (threads < 2) {
+        return NULL;
+    }
+    pthread_mutex_lock(&ih->ctx_mutex);
+    if (!ih->pool && !ih->pool_failed) {
+        ih->pool = pool_create(threads - 1);
+        ih->pool_failed = !ih->pool;
+    }
+    worker_pool_t *pool = ih->pool;
+    pthread_mutex_unlock(&ih->ctx_mutex);
+    return pool;
+}
+
+
+/* threads for splitting the frame being decoded. the frames decoded at
+   once already keep the threads of the core busy. */
+int VS_CC imgr_split_threads(img_hnd_t *ih, VSCore *core, const VSAPI *vsapi)
+{
+    int threads = vsapi->getCoreInfo(core)->numThreads;
+    int split = threads + 1 - __sync_fetch_and_add(&ih->decoding, 0);
+    return split > 1 ? split : 1;
+}
+
+
+/* runs the tasks, the first one on this thread with local. returns -1 if
+   any of them failed. */
+int VS_CC
+pool_run(worker_pool_t *pool, pool_task_t *tasks, int num, pool_local_t *local)
+{
+    pool_batch_t batch = { 0 };
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 1; i < num; i++) {
+        tasks[i].batch = &batch;
+        tasks[i].next = NULL;
+        if (pool->tail) {
+            pool->tail->next = tasks + i;
+        } else {
+            pool->head = tasks + i;
+        }
+        pool->tail = tasks + i;
+        batch.pending++;
+    }
+    if (batch.pending > 0) {
+        pthread_cond_broadcast(&pool->wake);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_task(tasks, local);
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        /* the tasks of the batch no worker has taken yet */
+        pool_task_t *prev = NULL;
+        pool_task_t *task = pool->head;
+        while (task && task->batch != &batch) {
+            prev = task;
+            task = task->next;
+        }
+        if (!task) {
+            break;
+        }
+        if (prev) {
+            prev->next = task->next;
+        } else {
+            pool->head = task->next;
+        }
+        if (pool->tail == task) {
+            pool->tail = prev;
+        }
+        batch.pending--;
+        pthread_mutex_unlock(&pool->mutex);
+        run_task(task, local);
+        pthread_mutex_lock(&pool->mutex);
+    }
+    while (batch.pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    int ret = 0;
+    for (int i = 0; i < num; i++) {
+        ret |= tasks[i].ret;
+    }
+    return ret ? -1 : 0;
+}
@@ -0,0 +1,389 @@
+/*
+  prefetch.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "imagereader.h"
+
+#define PF_HISTORY 64 // recent requests the access pattern is found from
+#define PF_MIN_HISTORY 3 // requests seen before reading ahead
+
+typedef enum {
+    SLOT_EMPTY,
+    SLOT_LOADING,
+    SLOT_READY,
+    SLOT_IN_USE
+} slot_state_t;
+
+typedef struct {
+    int n;
+    slot_state_t state;
+    uint8_t *buff;
+    size_t buff_size;
+    size_t size;
+} pf_slot_t;
+
+struct prefetcher {
+    img_hnd_t *ih;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;  // signaled to the I/O thread
+    pthread_cond_t ready; // signaled when a slot finished loading
+    pf_slot_t *slots;
+    int depth;
+    size_t mem_limit;
+    size_t mem_used;
+    int blocked;
+    int quit;
+    /* access pattern */
+    int history[PF_HISTORY]; // distinct recent requests, oldest first
+    int num_history;
+    int jitter; // strides the requests may arrive out of order
+    int stride; // 0 while no pattern is found
+    int front; // furthest frame requested along the stride
+};
+
+
+static pf_slot_t * VS_CC find_slot(prefetcher_t *pf, int n)
+{
+    for (int i = 0; i < pf->depth; i++) {
+        if (pf->slots[i].state != SLOT_EMPTY && pf->slots[i].n == n) {
+            return pf->slots + i;
+        }
+    }
+    return NULL;
+}
+
+
+/* frames along the stride from jitter strides behind the front up to depth
+   strides ahead of it are worth keeping */
+static int VS_CC is_wanted(prefetcher_t *pf, int n)
+{
+    if (pf->stride == 0 || (n - pf->front) % pf->stride != 0) {
+        return 0;
+    }
+    int k = (n - pf->front) / pf->stride;
+    return k >= -pf->jitter && k <= pf->depth;
+}
+
+
+static void VS_CC free_slot_buffer(prefetcher_t *pf, pf_slot_t *slot)
+{
+    pf->mem_used -= slot->buff_size;
+    free(slot->buff);
+    slot->buff = NULL;
+    slot->buff_size = 0;
+    slot->state = SLOT_EMPTY;
+}
+
+
+/* picks the nearest predicted frame which is not loaded yet and a slot
+   which can hold it. must be called with the mutex locked. */
+static int VS_CC next_target(prefetcher_t *pf, pf_slot_t **slot)
+{
+    if (pf->stride == 0 || pf->blocked) {
+        return -1;
+    }
+
+    if (pf->mem_used > pf->mem_limit) {
+        for (int i = 0; i < pf->depth; i++) {
+            pf_slot_t *s = pf->slots + i;
+            if (s->state == SLOT_EMPTY ||
+                (s->state == SLOT_READY && !is_wanted(pf, s->n))) {
+                if (s->state == SLOT_READY) {
+                    imgr_stats_prefetch(PREFETCH_EVICTED);
+                }
+                free_slot_buffer(pf, s);
+            }
+        }
+        if (pf->mem_used > pf->mem_limit) {
+            pf->blocked = 1;
+            return -1;
+        }
+    }
+
+    int num_frames = pf->ih->vi[0].numFrames;
+    for (int k = 1; k <= pf->depth; k++) {
+        int n = pf->front + pf->stride * k;
+        if (n < 0 || n >= num_frames) {
+            return -1;
+        }
+        if (find_slot(pf, n)) {
+            continue;
+        }
+
+        pf_slot_t *stale = NULL;
+        for (int i = 0; i < pf->depth; i++) {
+            if (pf->slots[i].state == SLOT_EMPTY) {
+                *slot = pf->slots + i;
+                return n;
+            }
+            if (pf->slots[i].state == SLOT_READY &&
+                !is_wanted(pf, pf->slots[i].n)) {
+                stale = pf->slots + i;
+            }
+        }
+        if (stale) {
+            imgr_stats_prefetch(PREFETCH_EVICTED);
+            *slot = stale;
+            return n;
+        }
+        return -1;
+    }
+
+    return -1;
+}
+
+
+static void *prefetch_worker(void *arg)
+{
+    prefetcher_t *pf = (prefetcher_t *)arg;
+
+    pthread_mutex_lock(&pf->mutex);
+    while (!pf->quit) {
+        pf_slot_t *slot;
+        int n = next_target(pf, &slot);
+        if (n < 0) {
+            pthread_cond_wait(&pf->wake, &pf->mutex);
+            continue;
+        }
+
+        slot->n = n;
+        slot->state = SLOT_LOADING;
+        pf->mem_used -= slot->buff_size;
+        uint8_t *buff = slot->buff;
+        size_t buff_size = slot->buff_size;
+        pthread_mutex_unlock(&pf->mutex);
+
+        size_t size = 0;
+        int ret = imgr_read_file(imgr_src_name(pf->ih, n), &buff, &buff_size,
+                                 &size);
+
+        pthread_mutex_lock(&pf->mutex);
+        slot->buff = buff;
+        slot->buff_size = buff_size;
+        slot->size = size;
+        slot->state = ret == 0 ? SLOT_READY : SLOT_EMPTY;
+        /* the pool may exceed the limit by one file at most */
+        pf->mem_used += buff_size;
+        pthread_cond_broadcast(&pf->ready);
+    }
+    pthread_mutex_unlock(&pf->mutex);
+
+    return NULL;
+}
+
+
+prefetcher_t * VS_CC
+prefetch_create(img_hnd_t *ih, int depth, size_t mem_limit, int jitter)
+{
+    prefetcher_t *pf = (prefetcher_t *)calloc(sizeof(prefetcher_t), 1);
+    if (!pf) {
+        return NULL;
+    }
+    pf->slots = (pf_slot_t *)calloc(sizeof(pf_slot_t), depth);
+    if (!pf->slots) {
+        free(pf);
+        return NULL;
+    }
+
+    pf->ih = ih;
+    pf->depth = depth;
+    pf->mem_limit = mem_limit;
+    pf->jitter = jitter;
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->wake, NULL);
+    pthread_cond_init(&pf->ready, NULL);
+
+    if (pthread_create(&pf->thread, NULL, prefetch_worker, pf)) {
+        pthread_cond_destroy(&pf->ready);
+        pthread_cond_destroy(&pf->wake);
+        pthread_mutex_destroy(&pf->mutex);
+        free(pf->slots);
+        free(pf);
+        return NULL;
+    }
+
+    return pf;
+}
+
+
+static int compare_frames(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+
+/* finds the stride from the recent requests. the frames requested at once
+   by the threads of the core arrive in any order, so the stride is the most
+   common gap between the sorted frames, and the direction is the one the
+   newer half of the requests moved to from the older half. the requests of
+   more than jitter threads are needed to tell the direction. */
+static void VS_CC find_pattern(prefetcher_t *pf)
+{
+    int num = pf->num_history;
+    int min_history = pf->jitter + 2;
+    if (min_history < PF_MIN_HISTORY) {
+        min_history = PF_MIN_HISTORY;
+    } else if (min_history > PF_HISTORY) {
+        min_history = PF_HISTORY;
+    }
+    pf->stride = 0;
+    if (num < min_history) {
+        return;
+    }
+    int sorted[PF_HISTORY], gaps[PF_HISTORY];
+    memcpy(sorted, pf->history, sizeof(int) * num);
+    qsort(sorted, num, sizeof(int), compare_frames);
+    for (int i = 1; i < num; i++) {
+        gaps[i - 1] = sorted[i] - sorted[i - 1];
+    }
+    qsort(gaps, num - 1, sizeof(int), compare_frames);
+
+    /* the longest run of the sorted gaps, the smaller one on a tie */
+    int step = gaps[0], best = 0;
+    for (int i = 0, run = 1; i < num - 1; i++, run++) {
+        if (i == num - 2 || gaps[i + 1] != gaps[i]) {
+            if (run > best) {
+                best = run;
+                step = gaps[i];
+            }
+            run = 0;
+        }
+    }
+    /* all on the grid of step, with at most jitter frames not requested yet */
+    for (int i = 1; i < num; i++) {
+        if ((sorted[i] - sorted[0]) % step != 0) {
+            return;
+        }
+    }
+    if ((sorted[num - 1] - sorted[0]) / step > num - 1 + pf->jitter) {
+        return;
+    }
+
+    int64_t older = 0, newer = 0;
+    for (int i = 0; i < num / 2; i++) {
+        older += pf->history[i];
+        newer += pf->history[num - 1 - i];
+    }
+    if (newer != older) {
+        pf->stride = newer > older ? step : -step;
+        pf->front = newer > older ? sorted[num - 1] : sorted[0];
+    }
+}
+
+
+/* updates the access pattern with the requested frame number */
+void VS_CC prefetch_notify(prefetcher_t *pf, int n)
+{
+    pthread_mutex_lock(&pf->mutex);
+
+    int known = 0;
+    for (int i = 0; i < pf->num_history; i++) {
+        known |= pf->history[i] == n;
+    }
+    if (!known) {
+        /* a jump away from the pattern starts a new one */
+        if (pf->stride != 0 && !is_wanted(pf, n)) {
+            pf->num_history = 0;
+        }
+        if (pf->num_history == PF_HISTORY) {
+            memmove(pf->history, pf->history + 1,
+                    sizeof(int) * (PF_HISTORY - 1));
+            pf->num_history--;
+        }
+        pf->history[pf->num_history++] = n;
+        find_pattern(pf);
+    }
+    pf->blocked = 0;
+
+    pthread_cond_signal(&pf->wake);
+    pthread_mutex_unlock(&pf->mutex);
+}
+
+
+/* returns 0 and fills sd when the file of frame n is (being) prefetched */
+int VS_CC prefetch_take(prefetcher_t *pf, int n, src_data_t *sd)
+{
+    pthread_mutex_lock(&pf->mutex);
+
+    pf_slot_t *slot = find_slot(pf, n);
+    while (slot && slot->state == SLOT_LOADING) {
+        pthread_cond_wait(&pf->ready, &pf->mutex);
+        slot = find_slot(pf, n);
+    }
+    if (!slot || slot->state != SLOT_READY) {
+        imgr_stats_prefetch(PREFETCH_MISSES);
+        pthread_mutex_unlock(&pf->mutex);
+        return -1;
+    }
+
+    slot->state = SLOT_IN_USE;
+    imgr_stats_prefetch(PREFETCH_HITS);
+    pthread_mutex_unlock(&pf->mutex);
+
+    sd->data = slot->buff;
+    sd->size = slot->size;
+    sd->slot = slot;
+
+    return 0;
+}
+
+
+void VS_CC prefetch_release(prefetcher_t *pf, src_data_t *sd)
+{
+    pf_slot_t *slot = (pf_slot_t *)sd->slot;
+
+    pthread_mutex_lock(&pf->mutex);
+    slot->state = SLOT_EMPTY;
+    slot->n = -1;
+    pf->blocked = 0;
+    pthread_cond_signal(&pf->wake);
+    pthread_mutex_unlock(&pf->mutex);
+}
+
+
+void VS_CC prefetch_destroy(prefetcher_t *pf)
+{
+    if (!pf) {
+        return;
+    }
+
+    pthread_mutex_lock(&pf->mutex);
+    pf->quit = 1;
+    pthread_cond_signal(&pf->wake);
+    pthread_mutex_unlock(&pf->mutex);
+    pthread_join(pf->thread, NULL);
+
+    for (int i = 0; i < pf->depth; i++) {
+        free(pf->slots[i].buff);
+    }
+    pthread_cond_destroy(&pf->ready);
+    pthread_cond_destroy(&pf->wake);
+    pthread_mutex_destroy(&pf->mutex);
+    free(pf->slots);
+    free(pf);
+}
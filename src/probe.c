@@ -0,0 +1,156 @@
+/*
+  probe.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+
+/* profile of the probing of the files when an imgr.Read instance is
+   created. each probing worker has its own probe_stats_t, and they are
+   merged and written as a text report after the probing. */
+
+#include <string.h>
+
+#include "imagereader.h"
+
+/* the phases in the order of the report. the ones in the checks are
+   indented under the check. */
+static const struct {
+    int phase; // -1 for the checks
+    const char *name;
+} report_rows[] = {
+    { PROBE_OPEN,      "open"        },
+    { PROBE_DETECT,    "detect"      },
+    { -1,              "check"       },
+    { PROBE_STAT,      "  stat"      },
+    { PROBE_ALLOC,     "  alloc"     },
+    { PROBE_READ,      "  read"      },
+    { PROBE_PNG_SETUP, "  png_setup" },
+    { PROBE_CLOSE,     "close"       },
+    { PROBE_MANIFEST,  "manifest"    },
+    { PROBE_CONTEXT,   "context"     }
+};
+
+#define NUM_REPORT_ROWS (int)(sizeof(report_rows) / sizeof(report_rows[0]))
+
+static const char *format_names[IMG_TYPE_TGA + 1] = {
+    NULL, "bmp", "jpeg", "png", "tga"
+};
+
+
+/* keeps file n if it is one of the slowest */
+void VS_CC imgr_probe_file(probe_stats_t *ps, int n, int64_t ns)
+{
+    int i = ps->num_slowest;
+    if (i == PROBE_SLOWEST) {
+        if (ns <= ps->slowest_ns[i - 1]) {
+            return;
+        }
+        i--;
+    } else {
+        ps->num_slowest++;
+    }
+    for (; i > 0 && ps->slowest_ns[i - 1] < ns; i--) {
+        ps->slowest[i] = ps->slowest[i - 1];
+        ps->slowest_ns[i] = ps->slowest_ns[i - 1];
+    }
+    ps->slowest[i] = n;
+    ps->slowest_ns[i] = ns;
+}
+
+
+void VS_CC imgr_probe_merge(probe_stats_t *to, const probe_stats_t *from)
+{
+    for (int i = 0; i < NUM_PROBE_PHASES; i++) {
+        to->phase_ns[i] += from->phase_ns[i];
+    }
+    for (int i = 0; i <= IMG_TYPE_TGA; i++) {
+        to->check_ns[i] += from->check_ns[i];
+        to->files[i] += from->files[i];
+    }
+    to->restored += from->restored;
+    to->bytes += from->bytes;
+    for (int i = 0; i < from->num_slowest; i++) {
+        imgr_probe_file(to, from->slowest[i], from->slowest_ns[i]);
+    }
+}
+
+
+/* appends the report to the file of path, or writes it to stderr if path
+   is "-". times of the phases are summed over the workers. */
+void VS_CC imgr_probe_report(const char *path, img_hnd_t *ih,
+                             const probe_stats_t *ps, int num_files,
+                             int64_t total_ns)
+{
+    FILE *fp = strcmp(path, "-") ? imgr_fopen(path, "ab", L"ab") : stderr;
+    if (!fp) {
+        fprintf(stderr, "imgr: failed to write probe report %s\n", path);
+        return;
+    }
+    int per = num_files > 0 ? num_files : 1;
+
+    int checked = 0;
+    int64_t check_ns = 0;
+    for (int i = 1; i <= IMG_TYPE_TGA; i++) {
+        checked += ps->files[i];
+        check_ns += ps->check_ns[i];
+    }
+    fprintf(fp, "imgr probe report: %s\n",
+            ih->pattern ? ih->pattern : ih->src[0].name);
+    fprintf(fp, "files: %d (%d checked, %d from manifest), threads: %d\n",
+            num_files, checked, ps->restored, ps->threads);
+    fprintf(fp, "probing: %.3f ms, creating the clip: %.3f ms\n",
+            ps->probe_ns / 1e6, total_ns / 1e6);
+    fprintf(fp, "bytes consumed by the checks: %lld (%lld per file)\n",
+            (long long)ps->bytes, (long long)(ps->bytes / per));
+
+    fprintf(fp, "%-12s %12s %12s\n", "phase", "total ms", "per file us");
+    for (int i = 0; i < NUM_REPORT_ROWS; i++) {
+        int64_t ns = report_rows[i].phase < 0 ? check_ns :
+                     ps->phase_ns[report_rows[i].phase];
+        fprintf(fp, "%-12s %12.3f %12.3f\n", report_rows[i].name, ns / 1e6,
+                ns / 1e3 / per);
+    }
+
+    fprintf(fp, "%-12s %8s %12s %12s %6s\n", "format", "files", "check ms",
+            "per file us", "share");
+    for (int i = 1; i <= IMG_TYPE_TGA; i++) {
+        if (ps->files[i] == 0) {
+            continue;
+        }
+        fprintf(fp, "%-12s %8d %12.3f %12.3f %5.1f%%\n", format_names[i],
+                ps->files[i], ps->check_ns[i] / 1e6,
+                ps->check_ns[i] / 1e3 / ps->files[i],
+                check_ns > 0 ? ps->check_ns[i] * 100.0 / check_ns : 0.0);
+    }
+
+    fprintf(fp, "slowest files:\n");
+    for (int i = 0; i < ps->num_slowest; i++) {
+        fprintf(fp, "%12.3f ms  %s\n", ps->slowest_ns[i] / 1e6,
+                imgr_src_name(ih, ps->slowest[i]));
+    }
+    fprintf(fp, "\n");
+
+    if (fp != stderr && fclose(fp)) {
+        fprintf(stderr, "imgr: failed to write probe report %s\n", path);
+    }
+}
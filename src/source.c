@@ -0,0 +1,283 @@
+/*
+  source.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "imagereader.h"
+
+#define STREAM_CHUNK_SIZE (256 * 1024)
+#define WRITER_SLACK 32 /* writers may read this much over the end */
+
+
+/* returns the name of file n. names made from the pattern are stored in a
+   buffer of the calling thread, valid until its next call. */
+const char * VS_CC imgr_src_name(img_hnd_t *ih, int n)
+{
+    static __thread char name_buff[FILENAME_MAX * 2];
+    if (!ih->pattern) {
+        return ih->src[n].name;
+    }
+    snprintf(name_buff, sizeof(name_buff), ih->pattern,
+             ih->first + n * ih->step);
+    return name_buff;
+}
+
+
+int VS_CC imgr_stat(const char *name, int64_t *mtime, int64_t *size)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    wchar_t tmp[FILENAME_MAX * 2];
+    MultiByteToWideChar(CP_UTF8, 0, name, -1, tmp, FILENAME_MAX * 2);
+    if (_wstat64(tmp, &st)) {
+        return -1;
+    }
+    *mtime = (int64_t)st.st_mtime * 1000000000;
+#else
+    struct stat st;
+    if (stat(name, &st)) {
+        return -1;
+    }
+#ifdef __linux__
+    *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    *mtime = (int64_t)st.st_mtime * 1000000000;
+#endif
+#endif
+    *size = st.st_size;
+    return 0;
+}
+
+
+/* reads a stream whose size is unknown, such as a pipe */
+static int VS_CC
+read_stream(FILE *fp, uint8_t **buff, size_t *buff_size, size_t *size)
+{
+    size_t len = 0;
+    for (;;) {
+        if (*buff_size < len + STREAM_CHUNK_SIZE + WRITER_SLACK) {
+            size_t new_size = (len + STREAM_CHUNK_SIZE + WRITER_SLACK) * 2;
+            uint8_t *tmp = (uint8_t *)realloc(*buff, new_size);
+            if (!tmp) {
+                return -1;
+            }
+            *buff = tmp;
+            *buff_size = new_size;
+        }
+        size_t read = fread(*buff + len, 1, STREAM_CHUNK_SIZE, fp);
+        len += read;
+        if (read < STREAM_CHUNK_SIZE) {
+            break;
+        }
+    }
+    if (ferror(fp) || len == 0) {
+        return -1;
+    }
+
+    *size = len;
+    return 0;
+}
+
+
+/* reads whole file into *buff, growing it when required.
+   32 bytes of slack are kept after the data for the writers. */
+int VS_CC
+imgr_read_file(const char *name, uint8_t **buff, size_t *buff_size,
+               size_t *size)
+{
+    FILE *fp = imgr_fopen(name, "rb", L"rb");
+    if (!fp) {
+        return -1;
+    }
+
+    long file_size = -1;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        file_size = ftell(fp);
+        if (fseek(fp, 0, SEEK_SET) != 0) {
+            file_size = -1;
+        }
+    }
+    if (file_size <= 0) {
+        int ret = read_stream(fp, buff, buff_size, size);
+        fclose(fp);
+        return ret;
+    }
+
+    if (*buff_size < (size_t)file_size + WRITER_SLACK) {
+        uint8_t *tmp = (uint8_t *)realloc(*buff, file_size + WRITER_SLACK);
+        if (!tmp) {
+            fclose(fp);
+            return -1;
+        }
+        *buff = tmp;
+        *buff_size = file_size + WRITER_SLACK;
+    }
+
+    size_t read = fread(*buff, 1, file_size, fp);
+    fclose(fp);
+    if (read != (size_t)file_size) {
+        return -1;
+    }
+
+    *size = read;
+    return 0;
+}
+
+
+/* the writers read over the end of the data, so files are mapped only if
+   the last page has enough room after the data. */
+static int has_slack(size_t size, size_t page_size)
+{
+    return (page_size - size % page_size) % page_size >= WRITER_SLACK;
+}
+
+
+/* maps a regular file. returns -1 if the file should be read with stdio,
+   e.g. a pipe or a special file. */
+static int VS_CC map_source(const char *name, src_data_t *sd)
+{
+#ifdef _WIN32
+    wchar_t tmp[FILENAME_MAX * 2];
+    MultiByteToWideChar(CP_UTF8, 0, name, -1, tmp, FILENAME_MAX * 2);
+    HANDLE file = CreateFileW(tmp, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    LARGE_INTEGER size;
+    if (GetFileType(file) != FILE_TYPE_DISK ||
+        !GetFileSizeEx(file, &size) || size.QuadPart == 0 ||
+        !has_slack((size_t)size.QuadPart, si.dwPageSize)) {
+        CloseHandle(file);
+        return -1;
+    }
+    HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping) {
+        return -1;
+    }
+    /* the view keeps the mapping alive */
+    void *base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!base) {
+        return -1;
+    }
+    sd->size = (size_t)size.QuadPart;
+#else
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        !has_slack(st.st_size, sysconf(_SC_PAGESIZE))) {
+        close(fd);
+        return -1;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    /* every decoder reads the file once from the top */
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    madvise(base, st.st_size, MADV_WILLNEED);
+    sd->size = st.st_size;
+#endif
+    sd->data = (uint8_t *)base;
+    sd->map = base;
+    sd->slot = NULL;
+    return 0;
+}
+
+
+static void VS_CC unmap_source(src_data_t *sd)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(sd->map);
+#else
+    munmap(sd->map, sd->size);
+#endif
+}
+
+
+static int VS_CC load_source(img_hnd_t *ih, img_ctx_t *ctx, int n)
+{
+    src_data_t *sd = &ctx->source;
+    if (sd->data) {
+        return 0;
+    }
+
+    if (ih->prefetcher && prefetch_take(ih->prefetcher, n, sd) == 0) {
+        return 0;
+    }
+
+    if (ih->enable_mmap && map_source(imgr_src_name(ih, n), sd) == 0) {
+        return 0;
+    }
+
+    size_t size;
+    if (imgr_read_file(imgr_src_name(ih, n), &ctx->src_buff, &ctx->src_buff_size,
+                       &size)) {
+        return -1;
+    }
+    sd->data = ctx->src_buff;
+    sd->size = size;
+    sd->slot = NULL;
+
+    return 0;
+}
+
+
+int VS_CC imgr_load_source(img_hnd_t *ih, img_ctx_t *ctx, int n)
+{
+    int64_t start = imgr_now();
+    int ret = load_source(ih, ctx, n);
+    int64_t end = imgr_now();
+    ctx->stats.read_ns += end - start;
+    trace_event(ih->trace, "load_source", n, start, end);
+    return ret;
+}
+
+
+void VS_CC imgr_release_source(img_hnd_t *ih, img_ctx_t *ctx)
+{
+    if (ctx->source.slot) {
+        prefetch_release(ih->prefetcher, &ctx->source);
+    }
+    if (ctx->source.map) {
+        unmap_source(&ctx->source);
+    }
+    memset(&ctx->source, 0, sizeof(src_data_t));
+}
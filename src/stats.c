@@ -0,0 +1,189 @@
+/*
+  stats.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+
+/* process-wide histograms of the frame stats of all imgr.Read instances.
+   the buckets are counted with atomic adds, so that decoding threads
+   never wait for each other or for imgr.Stats. */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "imagereader.h"
+
+#define STATS_NUM_FORMATS 4
+#define STATS_NUM_STAGES 4
+#define STATS_NUM_BUCKETS 192 // 4 per power of 2 up to about 2^48 ns
+
+static const char *format_names[STATS_NUM_FORMATS] = {
+    "bmp", "jpeg", "png", "tga"
+};
+
+static const char *stage_names[STATS_NUM_STAGES] = {
+    "read", "decode", "write", "total"
+};
+
+static const char *prefetch_names[NUM_PREFETCH_COUNTS] = {
+    "prefetch_hits", "prefetch_misses", "prefetch_evicted"
+};
+
+static const int percentiles[] = { 50, 90, 99, 100 };
+
+#define NUM_PERCENTILES (int)(sizeof(percentiles) / sizeof(percentiles[0]))
+
+static struct {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t buckets[STATS_NUM_STAGES][STATS_NUM_BUCKETS];
+} stats[STATS_NUM_FORMATS];
+
+static uint64_t prefetch_counts[NUM_PREFETCH_COUNTS];
+
+
+/* values below 4 have their own buckets. the others are split into 4
+   buckets per power of 2 by the 2 bits below the top one. */
+static int bucket_of(int64_t ns)
+{
+    if (ns < 4) {
+        return ns < 0 ? 0 : (int)ns;
+    }
+    int top = 63 - __builtin_clzll((uint64_t)ns);
+    int index = top * 4 + (int)((ns >> (top - 2)) & 3) - 4;
+    return index < STATS_NUM_BUCKETS ? index : STATS_NUM_BUCKETS - 1;
+}
+
+
+/* middle of the values counted in the bucket */
+static int64_t value_of(int index)
+{
+    if (index < 4) {
+        return index;
+    }
+    int top = index / 4 + 1;
+    int64_t low = (int64_t)(4 + index % 4) << (top - 2);
+    return low + ((int64_t)1 << (top - 2)) / 2;
+}
+
+
+void VS_CC imgr_stats_add(image_type_t type, const frame_stats_t *fs)
+{
+    if (type <= IMG_TYPE_NONE || type > IMG_TYPE_TGA) {
+        return;
+    }
+    int64_t ns[STATS_NUM_STAGES] = {
+        fs->read_ns, fs->decode_ns, fs->write_ns,
+        fs->read_ns + fs->decode_ns + fs->write_ns
+    };
+    int f = type - IMG_TYPE_BMP;
+    __sync_fetch_and_add(&stats[f].frames, 1);
+    __sync_fetch_and_add(&stats[f].bytes, (uint64_t)fs->bytes);
+    for (int i = 0; i < STATS_NUM_STAGES; i++) {
+        __sync_fetch_and_add(&stats[f].buckets[i][bucket_of(ns[i])], 1);
+    }
+}
+
+
+void VS_CC
+imgr_stats_set_props(VSFrameRef *frame, const frame_stats_t *fs,
+                     const VSAPI *vsapi)
+{
+    VSMap *props = vsapi->getFramePropsRW(frame);
+    vsapi->propSetInt(props, "_ImgrReadNs", fs->read_ns, paReplace);
+    vsapi->propSetInt(props, "_ImgrDecodeNs", fs->decode_ns, paReplace);
+    vsapi->propSetInt(props, "_ImgrWriteNs", fs->write_ns, paReplace);
+    vsapi->propSetInt(props, "_ImgrBytes", fs->bytes, paReplace);
+}
+
+
+void VS_CC imgr_stats_prefetch(prefetch_count_t count)
+{
+    __sync_fetch_and_add(prefetch_counts + count, 1);
+}
+
+
+static uint64_t take(uint64_t *counter, int reset)
+{
+    return reset ? __sync_lock_test_and_set(counter, 0)
+                 : __sync_fetch_and_add(counter, 0);
+}
+
+
+/* sets <format>_frames, <format>_bytes and <format>_<stage>_ns holding
+   the values at percentiles for each format decoded since the last
+   reset, and the prefetch counts. the buckets are read one by one, so the
+   frames being counted meanwhile may be missing from some stages. */
+void VS_CC imgr_stats_report(VSMap *out, int reset, const VSAPI *vsapi)
+{
+    for (int i = 0; i < NUM_PERCENTILES; i++) {
+        vsapi->propSetInt(out, "percentiles", percentiles[i], paAppend);
+    }
+    for (int i = 0; i < NUM_PREFETCH_COUNTS; i++) {
+        vsapi->propSetInt(out, prefetch_names[i],
+                          (int64_t)take(prefetch_counts + i, reset),
+                          paReplace);
+    }
+
+    for (int f = 0; f < STATS_NUM_FORMATS; f++) {
+        uint64_t frames = take(&stats[f].frames, reset);
+        uint64_t bytes = take(&stats[f].bytes, reset);
+        uint64_t counts[STATS_NUM_STAGES][STATS_NUM_BUCKETS];
+        for (int s = 0; s < STATS_NUM_STAGES; s++) {
+            for (int b = 0; b < STATS_NUM_BUCKETS; b++) {
+                counts[s][b] = take(&stats[f].buckets[s][b], reset);
+            }
+        }
+        if (frames == 0) {
+            continue;
+        }
+
+        char key[32];
+        vsapi->propSetData(out, "formats", format_names[f], -1, paAppend);
+        snprintf(key, sizeof(key), "%s_frames", format_names[f]);
+        vsapi->propSetInt(out, key, (int64_t)frames, paReplace);
+        snprintf(key, sizeof(key), "%s_bytes", format_names[f]);
+        vsapi->propSetInt(out, key, (int64_t)bytes, paReplace);
+
+        for (int s = 0; s < STATS_NUM_STAGES; s++) {
+            uint64_t total = 0;
+            for (int b = 0; b < STATS_NUM_BUCKETS; b++) {
+                total += counts[s][b];
+            }
+            snprintf(key, sizeof(key), "%s_%s_ns", format_names[f],
+                     stage_names[s]);
+            uint64_t seen = 0;
+            int b = 0;
+            for (int i = 0; i < NUM_PERCENTILES; i++) {
+                /* the smallest bucket reaching the rank of the percentile */
+                uint64_t rank = (total * percentiles[i] + 99) / 100;
+                while (b < STATS_NUM_BUCKETS - 1 &&
+                       (seen + counts[s][b] < rank || counts[s][b] == 0)) {
+                    seen += counts[s][b++];
+                }
+                vsapi->propSetInt(out, key, total ? value_of(b) : 0,
+                                  paAppend);
+            }
+        }
+    }
+}
@@ -26,6 +26,7 @@
 
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "imagereader.h"
 
@@ -42,28 +43,60 @@ typedef enum {
 } tga_retcode_t;
 
 typedef struct {
-    FILE *fd;
+    const uint8_t *data;
+    size_t size;
     int id_len;
+    int cmap_t;
     int img_t;
+    int cmap_first;
+    int cmap_len;
+    int cmap_depth;
     int width;
     int height;
     int depth;
+    int alpha_bits;
+    int top_left;
 } tga_t;
 
+/* decoding state of RLE packets. packets may cross scanlines. */
+typedef struct {
+    const uint8_t *pos;
+    const uint8_t *end;
+    int bytes;
+    int repeat; // pixels left in the run packet
+    int direct; // pixels left in the raw packet
+    uint8_t sample[4];
+} tga_rle_t;
+
+
+static inline int get_cmap_size(tga_t *tga)
+{
+    return tga->cmap_t ? tga->cmap_len * ((tga->cmap_depth + 7) >> 3) : 0;
+}
 
 static inline int get_image_data_offset(tga_t *tga)
 {
-    return TGA_HEADER_SIZE + tga->id_len;
+    return TGA_HEADER_SIZE + tga->id_len + get_cmap_size(tga);
 }
 
 static inline uint32_t get_scanline_size(tga_t *tga)
 {
-    return tga->width * tga->depth >> 3;
+    return tga->width * ((tga->depth + 7) >> 3);
 }
 
 static inline int is_encoded_data(tga_t *tga)
 {
-    return tga->img_t == 10;
+    return tga->img_t >= 9;
+}
+
+static inline int is_color_mapped(tga_t *tga)
+{
+    return tga->img_t == 1 || tga->img_t == 9;
+}
+
+static inline int is_gray(tga_t *tga)
+{
+    return tga->img_t == 3 || tga->img_t == 11;
 }
 
 static inline int bitor_int(uint8_t a, uint8_t b)
@@ -72,46 +105,65 @@ static inline int bitor_int(uint8_t a, uint8_t b)
 }
 
 
-static tga_retcode_t VS_CC tga_read_rle(tga_t *tga, uint8_t *buf)
+/* copies the sample once and doubles the filled area with memcpy */
+static inline void
+fill_run(uint8_t *dstp, const uint8_t *sample, int bytes, int count)
 {
-    if (!tga || !buf) {
-        return TGA_ERROR;
+    if (bytes == 1) {
+        memset(dstp, sample[0], count);
+        return;
+    }
+    size_t total = (size_t)bytes * count;
+    size_t filled = bytes;
+    memcpy(dstp, sample, bytes);
+    while (filled < total) {
+        size_t len = total - filled < filled ? total - filled : filled;
+        memcpy(dstp + filled, dstp, len);
+        filled += len;
     }
+}
 
-    int repeat = 0;
-    int direct = 0;
-    int width = tga->width;
-    int bytes = tga->depth >> 3;
-    char sample[4];
-    FILE *fd = tga->fd;
 
-    for (int x = 0; x < width; x++) {
-        if (repeat == 0 && direct == 0) {
-            int head = getc(fd);
-            if (head == EOF) {
-                return TGA_ERROR;
+/* expands num pixels. each packet is checked against the end of the data
+   once, when its header is read. */
+static tga_retcode_t VS_CC
+tga_read_rle(tga_rle_t *rle, uint8_t *dstp, int num)
+{
+    int bytes = rle->bytes;
+    while (num > 0) {
+        if (rle->repeat == 0 && rle->direct == 0) {
+            if (rle->pos >= rle->end) {
+                return TGA_READ_FAIL;
             }
-            if (head >= 128) {
-                repeat = head - 127;
-                if (fread(sample, bytes, 1, fd) < 1) {
-                    return TGA_ERROR;
+            int head = *rle->pos++;
+            if (head & 0x80) {
+                if (rle->end - rle->pos < bytes) {
+                    return TGA_READ_FAIL;
                 }
+                rle->repeat = (head & 0x7F) + 1;
+                memcpy(rle->sample, rle->pos, bytes);
+                rle->pos += bytes;
             } else {
-                direct = head + 1;
+                rle->direct = head + 1;
+                if (rle->end - rle->pos < rle->direct * bytes) {
+                    return TGA_READ_FAIL;
+                }
             }
         }
-        if (repeat > 0) {
-            for (int k = 0; k < bytes; k++) {
-                buf[k] = sample[k];
-            }
-            repeat--;
+
+        int count;
+        if (rle->repeat) {
+            count = rle->repeat < num ? rle->repeat : num;
+            fill_run(dstp, rle->sample, bytes, count);
+            rle->repeat -= count;
         } else {
-            if (fread(buf, bytes, 1, fd) < 1) {
-                return TGA_ERROR;
-            }
-            --direct;
+            count = rle->direct < num ? rle->direct : num;
+            memcpy(dstp, rle->pos, count * bytes);
+            rle->pos += count * bytes;
+            rle->direct -= count;
         }
-        buf += bytes;
+        dstp += count * bytes;
+        num -= count;
     }
 
     return TGA_OK;
@@ -140,21 +192,13 @@ static const char * VS_CC tga_get_error_string(tga_retcode_t code)
 }
 
 
-static tga_retcode_t VS_CC tga_read_metadata(tga_t *tga)
+static tga_retcode_t VS_CC
+tga_read_metadata(tga_t *tga, const uint8_t *tmp)
 {
     if (!tga) {
         return TGA_ERROR;
     }
 
-    if (fseek(tga->fd, 0, SEEK_SET) != 0) {
-        return TGA_SEEK_FAIL;
-    }
-
-    uint8_t tmp[TGA_HEADER_SIZE] = { 0 };
-    if (fread(tmp, TGA_HEADER_SIZE, 1, tga->fd) == 0) {
-        return TGA_READ_FAIL;
-    }
-
     if (tmp[1] != 0 && tmp[1] != 1) {
         return TGA_UNKNOWN_FORMAT;
     }
@@ -168,87 +212,245 @@ static tga_retcode_t VS_CC tga_read_metadata(tga_t *tga)
         return TGA_UNKNOWN_FORMAT;
     }
 
-    if (tmp[2] != 2 && tmp[2] != 10) {
-        return TGA_UNSUPPORTED_FORMAT;
-    }
-
-    if (tmp[16] != 24 && tmp[16] != 32) {
-        return TGA_UNSUPPORTED_FORMAT;
-    }
-
     tga->id_len     = tmp[0];
+    tga->cmap_t     = tmp[1];
     tga->img_t      = tmp[2];
+    tga->cmap_first = bitor_int(tmp[4], tmp[3]);
+    tga->cmap_len   = bitor_int(tmp[6], tmp[5]);
+    tga->cmap_depth = tmp[7];
     tga->width      = bitor_int(tmp[13], tmp[12]);
     tga->height     = bitor_int(tmp[15], tmp[14]);
     tga->depth      = tmp[16];
+    tga->alpha_bits = tmp[17] & 0x0F;
+    tga->top_left   = (tmp[17] >> 5) & 1;
+
+    if (tga->width == 0 || tga->height == 0) {
+        return TGA_NO_IMAGE_DATA;
+    }
+
+    if (tga->cmap_t && tga->cmap_depth != 15 && tga->cmap_depth != 16 &&
+        tga->cmap_depth != 24 && tga->cmap_depth != 32) {
+        return TGA_UNSUPPORTED_FORMAT;
+    }
+
+    if (is_color_mapped(tga)) {
+        if (!tga->cmap_t || tga->depth != 8) {
+            return TGA_UNSUPPORTED_FORMAT;
+        }
+    } else if (is_gray(tga)) {
+        if (tga->depth != 8 && tga->depth != 16) {
+            return TGA_UNSUPPORTED_FORMAT;
+        }
+    } else if (tga->depth != 15 && tga->depth != 16 &&
+               tga->depth != 24 && tga->depth != 32) {
+        return TGA_UNSUPPORTED_FORMAT;
+    }
 
     return TGA_OK;
 }
 
 
-static tga_retcode_t VS_CC tga_read_all_scanlines(tga_t *tga, uint8_t *buf)
+/* the color map is stored into ctx->palettes. entries out of the color
+   map stay black. */
+static void VS_CC load_color_map(tga_t *tga, img_ctx_t *ctx)
 {
-    if (!tga || !buf) {
-        return TGA_ERROR;
+    const uint8_t *srcp = tga->data + TGA_HEADER_SIZE + tga->id_len;
+    int bytes = (tga->cmap_depth + 7) >> 3;
+    int with_alpha = tga->cmap_depth == 32 ||
+                     (tga->cmap_depth == 16 && tga->alpha_bits);
+
+    memset(ctx->palettes, 0, sizeof(ctx->palettes));
+    for (int i = 0; i < tga->cmap_len && tga->cmap_first + i < 256; i++) {
+        color_palette_t *p = ctx->palettes + tga->cmap_first + i;
+        if (bytes == 2) {
+            int px = srcp[0] | (srcp[1] << 8);
+            int r = (px >> 10) & 0x1F, g = (px >> 5) & 0x1F, b = px & 0x1F;
+            p->red = (r << 3) | (r >> 2);
+            p->green = (g << 3) | (g >> 2);
+            p->blue = (b << 3) | (b >> 2);
+            p->reserved = (px & 0x8000) ? 0xFF : 0;
+        } else {
+            p->blue = srcp[0];
+            p->green = srcp[1];
+            p->red = srcp[2];
+            p->reserved = bytes == 4 ? srcp[3] : 0xFF;
+        }
+        srcp += bytes;
     }
 
-    if (fseek(tga->fd, get_image_data_offset(tga), SEEK_SET) != 0) {
-        return TGA_SEEK_FAIL;
+    ctx->misc |= 8;
+    if (with_alpha) {
+        ctx->misc |= IMG_PALETTE_ALPHA;
     }
+}
 
-    size_t sln_size = get_scanline_size(tga);
-    size_t read;
-    size_t lines = tga->height;
-    if (is_encoded_data(tga)) {
-        for (read = 0; read < lines; read++) {
-            if (tga_read_rle(tga, buf + read * sln_size) != TGA_OK) {
-                break;
-            }
+
+static func_write_frame VS_CC get_writer(tga_t *tga, img_ctx_t *ctx)
+{
+    if (is_color_mapped(tga)) {
+        return func_write_palette;
+    }
+    if (is_gray(tga)) {
+        return tga->depth == 8 ? func_write_planar : func_write_gray8_a;
+    }
+    switch (tga->depth) {
+    case 15:
+    case 16: {
+        /* A1R5G5B5 */
+        bitfields_t bf = { { 10, 5, 0, 15 }, { 5, 5, 5, 0 } };
+        if (tga->depth == 16 && tga->alpha_bits) {
+            bf.bits[3] = 1;
         }
-    } else {
-        read = fread(buf, sln_size, lines, tga->fd);
+        ctx->bitfields = bf;
+        ctx->misc |= 16;
+        return func_write_bitfields;
+    }
+    case 24:
+        return func_write_rgb24;
+    default:
+        return func_write_rgb32;
+    }
+}
+
+
+/* 8bit gray runs are expanded straight into the plane */
+static int VS_CC
+write_tga_rle_gray8(img_hnd_t *ih, tga_t *tga, tga_rle_t *rle,
+                    VSFrameRef **dst, const VSAPI *vsapi)
+{
+    int dst_stride = vsapi->getStride(dst[0], 0);
+    uint8_t *dstp = vsapi->getWritePtr(dst[0], 0);
+    if (!tga->top_left) {
+        dstp += (tga->height - 1) * dst_stride;
+        dst_stride *= -1;
     }
 
-    return read == lines ? TGA_OK : TGA_READ_FAIL;
+    for (int y = 0; y < tga->height; y++) {
+        if (tga_read_rle(rle, dstp, tga->width) != TGA_OK) {
+            return -1;
+        }
+        dstp += dst_stride;
+    }
+    return 0;
 }
 
 
-static int VS_CC read_tga(img_hnd_t *ih, int n)
+/* other RLE images are expanded in bands of about IMG_BAND_SIZE bytes,
+   and each band is written while it is still in cache. */
+static void VS_CC
+write_tga_rle(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+              VSCore *core, const VSAPI *vsapi)
 {
-    FILE *fp = imgr_fopen(ih->src[n].name);
-    if (!fp) {
+    tga_t tga;
+    tga.data = ctx->source.data;
+    tga.size = ctx->source.size;
+    tga_read_metadata(&tga, tga.data);
+
+    tga_rle_t rle = { 0 };
+    rle.pos = tga.data + get_image_data_offset(&tga);
+    rle.end = tga.data + tga.size;
+    rle.bytes = (tga.depth + 7) >> 3;
+
+    if (is_gray(&tga) && tga.depth == 8 && ctx->proxy == 1 &&
+        !IMG_IS_CROPPED(ctx)) {
+        if (write_tga_rle_gray8(ih, &tga, &rle, dst, vsapi)) {
+            vsapi->freeFrame(dst[0]);
+            dst[0] = NULL;
+        } else if (ih->enable_alpha) {
+            set_dummy_alpha(ih, n, dst + 1, core, vsapi);
+        }
+        return;
+    }
+
+    func_write_frame write_rows = get_writer(&tga, ctx);
+    size_t sln_size = get_scanline_size(&tga);
+    int band = IMG_BAND_SIZE / sln_size;
+    if (band < 1) {
+        band = 1;
+    }
+    if (band > tga.height) {
+        band = tga.height;
+    }
+    uint8_t *buff = imgr_image_buffer(ctx, sln_size * band);
+
+    /* packets after the region of interest are not decoded */
+    int last = imgr_rows_needed(ih, ctx, n);
+    int y = 0;
+    for (; buff && y < last; y += band) {
+        int rows = last - y < band ? last - y : band;
+        if (tga_read_rle(&rle, buff, tga.width * rows) != TGA_OK) {
+            break;
+        }
+        ctx->image = buff;
+        ctx->band_top = y;
+        ctx->band_height = rows;
+        write_rows(ih, ctx, n, dst, core, vsapi);
+    }
+    ctx->band_height = 0;
+
+    if (y < last) {
+        vsapi->freeFrame(dst[0]);
+        dst[0] = NULL;
+    }
+}
+
+
+static int VS_CC read_tga(img_hnd_t *ih, img_ctx_t *ctx, int n)
+{
+    if (imgr_load_source(ih, ctx, n)) {
         return -1;
     }
 
     tga_t tga;
-    tga.fd = fp;
-
-    tga_retcode_t ret = tga_read_metadata(&tga);
-    if (ret != TGA_OK) {
-        fclose(fp);
+    tga.data = ctx->source.data;
+    tga.size = ctx->source.size;
+    if (tga.size < TGA_HEADER_SIZE ||
+        tga_read_metadata(&tga, tga.data) != TGA_OK) {
         return -1;
     }
 
-    ret = tga_read_all_scanlines(&tga, ih->image_buff);
-    fclose(fp);
-    if (ret != TGA_OK) {
+    size_t offset = get_image_data_offset(&tga);
+    if (tga.size < offset) {
         return -1;
     }
+    if (!is_encoded_data(&tga)) {
+        /* uncompressed scanlines are passed to the writer in place */
+        if (tga.size - offset <
+            (uint64_t)get_scanline_size(&tga) * tga.height) {
+            return -1;
+        }
+        ctx->image = ctx->source.data + offset;
+    }
 
-    ih->misc = IMG_ORDER_BGR;
-    ih->row_adjust = 1;
-    ih->write_frame = tga.depth == 24 ? func_write_rgb24 : func_write_rgb32;
+    ctx->misc = IMG_ORDER_BGR;
+    ctx->row_adjust = 1;
+    if (is_color_mapped(&tga)) {
+        load_color_map(&tga, ctx);
+    }
+    if (is_encoded_data(&tga)) {
+        ctx->write_frame = write_tga_rle;
+    } else {
+        ctx->write_frame = get_writer(&tga, ctx);
+    }
 
-    return 0;
+    if (imgr_check_layout(ih, n, is_gray(&tga) ? pfGray8 : pfRGB24,
+                          get_scanline_size(&tga), !tga.top_left)) {
+        return -1;
+    }
+    return imgr_set_image_size(ih, ctx, n, tga.width, tga.height, ih->proxy);
 }
 
 
 static const char * VS_CC
 check_tga(img_hnd_t *ih, int n, FILE *fp, vs_args_t *va)
 {
+    uint8_t header[TGA_HEADER_SIZE];
+    if (fread(header, 1, TGA_HEADER_SIZE, fp) != TGA_HEADER_SIZE) {
+        return tga_get_error_string(TGA_READ_FAIL);
+    }
+
     tga_t tga = {0};
-    tga.fd = fp;
-    tga_retcode_t ret = tga_read_metadata(&tga);
+    tga_retcode_t ret = tga_read_metadata(&tga, header);
     if (ret != TGA_OK) {
         return tga_get_error_string(ret);
     }
@@ -257,18 +459,21 @@ check_tga(img_hnd_t *ih, int n, FILE *fp, vs_args_t *va)
 
     ih->src[n].height = tga.height;
 
-    uint32_t row_size = tga.width * (tga.depth >> 3);
+    uint32_t row_size = get_scanline_size(&tga);
     if (row_size > va->max_row_size) {
         va->max_row_size = row_size;
     }
     
-    ih->src[n].format = va->vsapi->getFormatPreset(pfRGB24, va->core);
+    VSPresetFormat pf = is_gray(&tga) ? pfGray8 : pfRGB24;
+    ih->src[n].format = va->vsapi->getFormatPreset(pf, va->core);
     
     ih->src[n].read = read_tga;
 
-    ih->src[n].flip = 1;
+    /* bit 5 of the image descriptor is set if the origin is top left */
+    ih->src[n].flip = !tga.top_left;
 
     return NULL;
 }
 
 const func_check_src check_src_tga = check_tga;
+const func_read_image read_src_tga = read_tga;
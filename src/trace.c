@@ -0,0 +1,366 @@
+/*
+  trace.c
+
+  This file is part of vsimagereader
+
+  Copyright (C) 2013  Oka Motofumi
+
+  Author: Oka Motofumi (chikuzen.mo at gmail dot com)
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with Libav; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+
+
+/* Chrome trace event output (loaded by chrome://tracing and Perfetto).
+   each thread appends complete events to a buffer of its own. the buffers
+   are written into the file and freed when the last imgr.Read instance
+   using it is freed. instances given the same path share the buffers, and
+   the instances created after that append their events to the file. */
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "imagereader.h"
+
+#define TRACE_CHUNK 1024 // events allocated at once
+#define TRACE_THREAD_SLOTS 8 // traces looked up quickly by each thread
+#define TRACE_TAIL "\n]}\n"
+
+typedef struct {
+    const char *name; // static string
+    int n;
+    int64_t start; // nanoseconds
+    int64_t end;
+} trace_event_t;
+
+typedef struct trace_chunk {
+    trace_event_t events[TRACE_CHUNK];
+    int num;
+    struct trace_chunk *next;
+} trace_chunk_t;
+
+typedef struct trace_buffer {
+    int tid;
+    trace_chunk_t *chunks; // newest first
+    int64_t last_end; // of the events in the buffer
+    struct trace_buffer *next;
+    struct trace_buffer *next_idle;
+} trace_buffer_t;
+
+/* file written by this process. the later traces of the path append
+   their events to it with the tids following the ones used. */
+typedef struct trace_file {
+    char *path;
+    int num_tids;
+    int written;
+    struct trace_file *next;
+} trace_file_t;
+
+struct trace {
+    trace_file_t *file;
+    int users;
+    uint64_t serial; // never reused, unlike the address of the trace
+    pthread_mutex_t mutex; // for buffers
+    trace_buffer_t *buffers;
+    trace_buffer_t *idle; // left by the threads exited, for new threads
+    trace_t *next;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    trace_t *list;
+    trace_file_t *files;
+    uint64_t next_serial;
+} traces = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 1 };
+
+/* buffers of the thread for the traces recently used. entries of closed
+   traces are never matched since their serials are not used again. */
+typedef struct {
+    struct {
+        uint64_t serial;
+        trace_buffer_t *buffer;
+    } slots[TRACE_THREAD_SLOTS];
+    int next_slot;
+} thread_traces_t;
+
+static __thread thread_traces_t *thread_traces;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+
+/* the buffers of an exiting thread are passed to the next threads, so that
+   the decoding threads created for each frame share a few tracks. */
+static void release_thread(void *arg)
+{
+    thread_traces_t *tt = (thread_traces_t *)arg;
+    pthread_mutex_lock(&traces.mutex);
+    for (int i = 0; i < TRACE_THREAD_SLOTS; i++) {
+        trace_t *tr = traces.list;
+        while (tr && tr->serial != tt->slots[i].serial) {
+            tr = tr->next;
+        }
+        if (tr) {
+            pthread_mutex_lock(&tr->mutex);
+            tt->slots[i].buffer->next_idle = tr->idle;
+            tr->idle = tt->slots[i].buffer;
+            pthread_mutex_unlock(&tr->mutex);
+        }
+    }
+    pthread_mutex_unlock(&traces.mutex);
+    free(tt);
+}
+
+
+static void create_thread_key(void)
+{
+    pthread_key_create(&thread_key, release_thread);
+}
+
+
+static trace_file_t *find_file(const char *path)
+{
+    trace_file_t *tf = traces.files;
+    while (tf && strcmp(tf->path, path)) {
+        tf = tf->next;
+    }
+    if (tf) {
+        return tf;
+    }
+    tf = (trace_file_t *)calloc(sizeof(trace_file_t), 1);
+    if (tf && !(tf->path = strdup(path))) {
+        free(tf);
+        return NULL;
+    }
+    if (tf) {
+        tf->next = traces.files;
+        traces.files = tf;
+    }
+    return tf;
+}
+
+
+trace_t * VS_CC trace_open(const char *path)
+{
+    pthread_mutex_lock(&traces.mutex);
+    trace_t *tr = traces.list;
+    while (tr && strcmp(tr->file->path, path)) {
+        tr = tr->next;
+    }
+    if (!tr) {
+        trace_file_t *tf = find_file(path);
+        tr = tf ? (trace_t *)calloc(sizeof(trace_t), 1) : NULL;
+        if (tr) {
+            tr->file = tf;
+            tr->serial = traces.next_serial++;
+            pthread_mutex_init(&tr->mutex, NULL);
+            tr->next = traces.list;
+            traces.list = tr;
+        }
+    }
+    if (tr) {
+        tr->users++;
+    }
+    pthread_mutex_unlock(&traces.mutex);
+    return tr;
+}
+
+
+/* a buffer left by another thread is taken only if the event from start
+   follows its events, since the events are recorded when they end. */
+static trace_buffer_t *thread_buffer(trace_t *tr, int64_t start)
+{
+    thread_traces_t *tt = thread_traces;
+    if (!tt) {
+        pthread_once(&thread_key_once, create_thread_key);
+        tt = (thread_traces_t *)calloc(sizeof(thread_traces_t), 1);
+        if (!tt) {
+            return NULL;
+        }
+        pthread_setspecific(thread_key, tt);
+        thread_traces = tt;
+    }
+    for (int i = 0; i < TRACE_THREAD_SLOTS; i++) {
+        if (tt->slots[i].serial == tr->serial) {
+            return tt->slots[i].buffer;
+        }
+    }
+
+    pthread_mutex_lock(&tr->mutex);
+    trace_buffer_t **idle = &tr->idle;
+    while (*idle && (*idle)->last_end > start) {
+        idle = &(*idle)->next_idle;
+    }
+    trace_buffer_t *buf = *idle;
+    if (buf) {
+        *idle = buf->next_idle;
+    } else {
+        buf = (trace_buffer_t *)calloc(sizeof(trace_buffer_t), 1);
+        if (buf) {
+            buf->tid = ++tr->file->num_tids;
+            buf->next = tr->buffers;
+            tr->buffers = buf;
+        }
+    }
+    pthread_mutex_unlock(&tr->mutex);
+    if (!buf) {
+        return NULL;
+    }
+
+    /* the buffer replaced stays in the trace, and is not reused */
+    int slot = tt->next_slot;
+    tt->next_slot = (slot + 1) % TRACE_THREAD_SLOTS;
+    tt->slots[slot].serial = tr->serial;
+    tt->slots[slot].buffer = buf;
+    return buf;
+}
+
+
+/* records that name ran on this thread for frame n from start to end */
+void VS_CC
+trace_event(trace_t *tr, const char *name, int n, int64_t start, int64_t end)
+{
+    if (!tr) {
+        return;
+    }
+    trace_buffer_t *buf = thread_buffer(tr, start);
+    if (!buf) {
+        return;
+    }
+    trace_chunk_t *chunk = buf->chunks;
+    if (!chunk || chunk->num == TRACE_CHUNK) {
+        chunk = (trace_chunk_t *)malloc(sizeof(trace_chunk_t));
+        if (!chunk) {
+            return;
+        }
+        chunk->num = 0;
+        chunk->next = buf->chunks;
+        buf->chunks = chunk;
+    }
+    trace_event_t *ev = chunk->events + chunk->num++;
+    ev->name = name;
+    ev->n = n;
+    ev->start = start;
+    ev->end = end;
+    if (end > buf->last_end) {
+        buf->last_end = end;
+    }
+}
+
+
+/* opens the file written before at the end of its events, or creates it
+   with the metadata of the process */
+static FILE *open_events(trace_file_t *tf, int pid)
+{
+    if (tf->written) {
+        FILE *fp = imgr_fopen(tf->path, "r+b", L"r+b");
+        char tail[sizeof(TRACE_TAIL)] = { 0 };
+        if (fp && (fseek(fp, 1 - (long)sizeof(TRACE_TAIL), SEEK_END) ||
+                   fread(tail, 1, sizeof(TRACE_TAIL) - 1, fp) !=
+                   sizeof(TRACE_TAIL) - 1 ||
+                   strcmp(tail, TRACE_TAIL) ||
+                   fseek(fp, 1 - (long)sizeof(TRACE_TAIL), SEEK_END))) {
+            fclose(fp);
+            fp = NULL; // replaced by others, or truncated
+        }
+        if (fp) {
+            return fp;
+        }
+    }
+
+    FILE *fp = imgr_fopen(tf->path, "wb", L"wb");
+    if (fp) {
+        fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"args\":{\"name\":\"vsimagereader\"}}", pid);
+    }
+    return fp;
+}
+
+
+static void write_trace(trace_t *tr)
+{
+#ifdef _WIN32
+    int pid = (int)GetCurrentProcessId();
+#else
+    int pid = (int)getpid();
+#endif
+    FILE *fp = open_events(tr->file, pid);
+    if (!fp) {
+        fprintf(stderr, "imgr: failed to write trace %s\n", tr->file->path);
+        return;
+    }
+    for (trace_buffer_t *buf = tr->buffers; buf; buf = buf->next) {
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"imgr thread %d\"}}",
+                pid, buf->tid, buf->tid);
+        for (trace_chunk_t *c = buf->chunks; c; c = c->next) {
+            for (int i = 0; i < c->num; i++) {
+                const trace_event_t *ev = c->events + i;
+                fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"imgr\","
+                        "\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,"
+                        "\"tid\":%d,\"args\":{\"frame\":%d}}",
+                        ev->name, ev->start / 1000.0,
+                        (ev->end - ev->start) / 1000.0, pid, buf->tid,
+                        ev->n);
+            }
+        }
+    }
+    fputs(TRACE_TAIL, fp);
+    if (fclose(fp)) {
+        fprintf(stderr, "imgr: failed to write trace %s\n", tr->file->path);
+        return;
+    }
+    tr->file->written = 1;
+}
+
+
+/* the events are written and freed when the last user closes the trace.
+   no event may be recorded into it meanwhile. */
+void VS_CC trace_close(trace_t *tr)
+{
+    if (!tr) {
+        return;
+    }
+    pthread_mutex_lock(&traces.mutex);
+    if (--tr->users > 0) {
+        pthread_mutex_unlock(&traces.mutex);
+        return;
+    }
+    trace_t **p = &traces.list;
+    while (*p != tr) {
+        p = &(*p)->next;
+    }
+    *p = tr->next;
+    /* the lock keeps a new trace of the path from writing meanwhile */
+    write_trace(tr);
+    pthread_mutex_unlock(&traces.mutex);
+
+    while (tr->buffers) {
+        trace_buffer_t *buf = tr->buffers;
+        tr->buffers = buf->next;
+        while (buf->chunks) {
+            trace_chunk_t *c = buf->chunks;
+            buf->chunks = c->next;
+            free(c);
+        }
+        free(buf);
+    }
+    pthread_mutex_destroy(&tr->mutex);
+    free(tr);
+}
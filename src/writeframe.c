@@ -23,6 +23,7 @@
 */
 
 
+#include <stdlib.h>
 #include <string.h>
 #include "imagereader.h"
 
@@ -30,22 +31,11 @@ static const int rgb[3] = {0, 1, 2};
 static const int bgr[3] = {2, 1, 0};
 
 
-static inline uint32_t VS_CC
-bitor8to32(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3)
-{
-    return ((uint32_t)b0 << 24) | ((uint32_t)b1 << 16) |
-           ((uint32_t)b2 << 8) | (uint32_t)b3;
-}
-
-
 static void VS_CC
-bit_blt(VSFrameRef *dst, int plane, const VSAPI *vsapi, uint8_t *srcp,
+bit_blt(uint8_t *dstp, int dst_stride, const uint8_t *srcp, int src_stride,
         int row_size, int height)
 {
-    uint8_t *dstp = vsapi->getWritePtr(dst, plane);
-    int dst_stride = vsapi->getStride(dst, plane);
-
-    if (row_size == dst_stride) {
+    if (row_size == dst_stride && row_size == src_stride) {
         memcpy(dstp, srcp, row_size * height);
         return;
     }
@@ -53,220 +43,387 @@ bit_blt(VSFrameRef *dst, int plane, const VSAPI *vsapi, uint8_t *srcp,
     for (int i = 0; i < height; i++) {
         memcpy(dstp, srcp, row_size);
         dstp += dst_stride;
-        srcp += row_size;
+        srcp += src_stride;
     }
 }
 
 
-static void VS_CC
-set_dummy_alpha(img_hnd_t *ih, int n, VSFrameRef *dummy, VSCore *core,
-                const VSAPI *vsapi)
+/* rows of the image held by ctx->image are [*top, *top + *height) */
+static inline void
+get_band(img_ctx_t *ctx, int *top, int *height)
 {
-    dummy = vsapi->newVideoFrame(vsapi->getFormatPreset(pfGray8, core),
-                                 ih->src[n].width, ih->src[n].height,
-                                 NULL, core);
-    memset(vsapi->getWritePtr(dummy, 0), 0x00,
-           vsapi->getStride(dummy, 0) * vsapi->getFrameHeight(dummy, 0));
+    *top = ctx->band_height ? ctx->band_top : 0;
+    *height = ctx->band_height ? ctx->band_height : ctx->height;
 }
 
 
-static void VS_CC
-write_planar(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
-             const VSAPI *vsapi)
+/* rows of the image from its top in the file which have to be decoded.
+   the rows after them are out of the region of interest. */
+int VS_CC imgr_rows_needed(img_hnd_t *ih, img_ctx_t *ctx, int n)
 {
-    uint8_t *srcp = ih->image_buff;
-
-    for (int i = 0, num = ih->src[n].format->numPlanes; i < num; i++) {
-        int row_size = vsapi->getFrameWidth(dst[0], i) *
-                       ih->src[n].format->bytesPerSample;
-        row_size = (row_size + ih->row_adjust) & (~ih->row_adjust);
-        int height = vsapi->getFrameHeight(dst[0], i);
-        bit_blt(dst[0], i, vsapi, srcp, row_size, height);
-        srcp += row_size * height;
-    }
-    
-    if (ih->enable_alpha) {
-        set_dummy_alpha(ih, n, dst[1], core, vsapi);
+    return ih->src[n].flip ? ctx->height - ctx->roi_top
+                           : ctx->roi_top + ctx->roi_height;
+}
+
+
+static inline int
+is_last_band(img_hnd_t *ih, img_ctx_t *ctx, int n, int top, int height)
+{
+    return top + height >= imgr_rows_needed(ih, ctx, n);
+}
+
+
+/* clips the rows of the band to the region of interest.
+   returns the number of the rows skipped from the top of the band. */
+static int VS_CC
+clip_band(img_hnd_t *ih, img_ctx_t *ctx, int n, int *top, int *height)
+{
+    int first = ctx->roi_top;
+    int last = ctx->roi_top + ctx->roi_height;
+    if (ih->src[n].flip) {
+        first = ctx->height - last;
+        last = ctx->height - ctx->roi_top;
     }
+
+    int start = *top > first ? *top : first;
+    int end = *top + *height < last ? *top + *height : last;
+    int skip = start - *top;
+    *top = start;
+    *height = end > start ? end - start : 0;
+    return skip;
 }
 
 
-static void VS_CC
-write_gray8_a(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
-              const VSAPI *vsapi)
+/* alpha of the images without alpha channel. one zero frame is made for
+   each size and format, and the outputs share its plane. */
+void VS_CC
+set_dummy_alpha(img_hnd_t *ih, int n, VSFrameRef **dummy, VSCore *core,
+                const VSAPI *vsapi)
 {
-    typedef struct {
-        uint8_t c[8];
-    } gray8a_t;
-    
-    uint8_t *srcp_orig = ih->image_buff;
-    int row_size = (ih->src[n].width + 3) / 4;
+    VSPresetFormat pf = ih->src[n].format->bytesPerSample == 1 ? pfGray8 : pfGray16;
+    const VSFormat *format = vsapi->getFormatPreset(pf, core);
+    int width = ih->src[n].width;
     int height = ih->src[n].height;
-    int src_stride = (ih->src[n].width * 2 + ih->row_adjust) & (~ih->row_adjust);
-    
-    uint32_t *dstp0 = (uint32_t *)vsapi->getWritePtr(dst[0], 0);
-    int dst_stride = vsapi->getStride(dst[0], 0) / 4;
-    
-    dst[1] = vsapi->newVideoFrame(vsapi->getFormatPreset(pfGray8, core),
-                                  ih->src[n].width, ih->src[n].height,
-                                  NULL, core);
-    uint32_t *dstp1 = (uint32_t *)vsapi->getWritePtr(dst[1], 0);
-    
-    for (int y = 0; y < height; y++) {
-        gray8a_t *srcp = (gray8a_t *)(srcp_orig + y * src_stride);
-        for (int x = 0; x < row_size; x++) {
-            dstp0[x] = bitor8to32(srcp[x].c[6], srcp[x].c[4],
-                                  srcp[x].c[2], srcp[x].c[0]);
-            dstp1[x] = bitor8to32(srcp[x].c[7], srcp[x].c[5],
-                                  srcp[x].c[3], srcp[x].c[1]);
+
+    pthread_mutex_lock(&ih->alpha_mutex);
+    zero_alpha_t *za = ih->zero_alpha;
+    while (za && (za->format != format || za->width != width ||
+                  za->height != height)) {
+        za = za->next;
+    }
+    if (!za) {
+        za = (zero_alpha_t *)malloc(sizeof(zero_alpha_t));
+        if (!za) {
+            pthread_mutex_unlock(&ih->alpha_mutex);
+            *dummy = NULL;
+            return;
         }
-        dstp0 += dst_stride;
-        dstp1 += dst_stride;
+        za->format = format;
+        za->width = width;
+        za->height = height;
+        za->frame = vsapi->newVideoFrame(format, width, height, NULL, core);
+        memset(vsapi->getWritePtr(za->frame, 0), 0x00,
+               vsapi->getStride(za->frame, 0) * height);
+        za->next = ih->zero_alpha;
+        ih->zero_alpha = za;
     }
-    
-    if (ih->enable_alpha == 0) {
-        vsapi->freeFrame(dst[1]);
-        dst[1] = NULL;
+    *dummy = vsapi->copyFrame(za->frame, core);
+    pthread_mutex_unlock(&ih->alpha_mutex);
+}
+
+
+/* proxy: each block of proxy x proxy pixels of the image is averaged into
+   one pixel of the frame. the writers make the full rows of the planes in
+   scratch rows, and they are summed in ctx->proxy_buff until a row of the
+   frame is completed. */
+
+#define PROXY_MAX_PLANES 4
+
+static inline size_t proxy_row_size(int width)
+{
+    /* 2 bytes per sample, and the slack for the row kernels */
+    return ((size_t)width * 2 + 32 + 31) & ~31;
+}
+
+
+static inline uint8_t *proxy_row(img_ctx_t *ctx, int i)
+{
+    return ctx->proxy_buff + i * proxy_row_size(ctx->roi_width);
+}
+
+
+static inline uint32_t *proxy_sums(img_ctx_t *ctx, int i)
+{
+    uint8_t *sums = ctx->proxy_buff + PROXY_MAX_PLANES * proxy_row_size(ctx->roi_width);
+    return (uint32_t *)sums + i * IMG_PROXY_SIZE(ctx->roi_width, ctx->proxy);
+}
+
+
+/* sets the size of the image in the file, and the region of interest in
+   it from the crop region of the frame. readers of the formats scaled by
+   the writers or cropped call this before write_frame. */
+int VS_CC
+imgr_set_image_size(img_hnd_t *ih, img_ctx_t *ctx, int n, int width,
+                    int height, int proxy)
+{
+    int right = (ih->roi[0] + ih->src[n].width) * proxy;
+    int bottom = (ih->roi[1] + ih->src[n].height) * proxy;
+    ctx->width = width;
+    ctx->height = height;
+    ctx->roi_left = ih->roi[0] * proxy;
+    ctx->roi_top = ih->roi[1] * proxy;
+    ctx->roi_width = (right < width ? right : width) - ctx->roi_left;
+    ctx->roi_height = (bottom < height ? bottom : height) - ctx->roi_top;
+    ctx->proxy = proxy;
+    ctx->proxy_count = 0;
+    if (ctx->roi_width <= 0 || ctx->roi_height <= 0 ||
+        IMG_PROXY_SIZE(ctx->roi_width, proxy) != ih->src[n].width ||
+        IMG_PROXY_SIZE(ctx->roi_height, proxy) != ih->src[n].height) {
+        return -1; // the image is not of the probed size
+    }
+    if (ctx->proxy == 1) {
+        return 0;
     }
+
+    int roi_width = ctx->roi_width;
+    size_t sums_size = PROXY_MAX_PLANES * sizeof(uint32_t) *
+                       IMG_PROXY_SIZE(roi_width, proxy);
+    size_t size = PROXY_MAX_PLANES * proxy_row_size(roi_width) + sums_size;
+    if (size > ctx->proxy_buff_size) {
+        uint8_t *buff = (uint8_t *)realloc(ctx->proxy_buff, size);
+        if (!buff) {
+            return -1;
+        }
+        ctx->proxy_buff = buff;
+        ctx->proxy_buff_size = size;
+    }
+    memset(proxy_sums(ctx, 0), 0, sums_size);
+    return 0;
+}
+
+
+/* with lazy probing, checks the format and the row size parsed by the
+   reader of a file read for the first time against the props of the first
+   file. the size is checked by imgr_set_image_size. */
+int VS_CC
+imgr_check_layout(img_hnd_t *ih, int n, int format_id, size_t row_size,
+                  int flip)
+{
+    if (!ih->lazy_state || ih->lazy_state[n]) {
+        return 0;
+    }
+    if (ih->src[n].format->id != format_id ||
+        row_size > (size_t)ih->max_row_size || ih->src[n].flip != flip) {
+        return -1; // the file differs from the first one
+    }
+    return 0;
 }
 
 
+/* adds the row of the region into the sums, and writes the row of the frame
+   into planes when all rows of its blocks are added. */
 static void VS_CC
-write_gray16_a(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
-               const VSAPI *vsapi)
+proxy_add_row(img_ctx_t *ctx, const uint8_t * const *rows,
+              uint8_t * const *planes, int stride, int num, int bytes, int row)
 {
-    typedef struct {
-        uint16_t c[2];
-    } gray16a_t;
-    
-    uint8_t *srcp_orig = ih->image_buff;
-    int row_size = ih->src[n].width;
-    int height = ih->src[n].height;
-    int src_stride = (ih->src[n].width * 4 + ih->row_adjust) & (~ih->row_adjust);
-    
-    uint16_t *dstp0 = (uint16_t *)vsapi->getWritePtr(dst[0], 0);
-    int dst_stride = vsapi->getStride(dst[0], 0) / 2;
-    
-    dst[1] = vsapi->newVideoFrame(vsapi->getFormatPreset(pfGray16, core),
-                                  ih->src[n].width, ih->src[n].height,
-                                  NULL, core);
-    uint16_t *dstp1 = (uint16_t *)vsapi->getWritePtr(dst[1], 0);
-    
-    for (int y = 0; y < height; y++) {
-        gray16a_t *srcp = (gray16a_t *)(srcp_orig + y * src_stride);
-        for (int x = 0; x < row_size; x++) {
-            dstp0[x] = srcp[x].c[0];
-            dstp1[x] = srcp[x].c[1];
+    int proxy = ctx->proxy;
+    int width = ctx->roi_width;
+    int out_width = IMG_PROXY_SIZE(width, proxy);
+
+    for (int i = 0; i < num; i++) {
+        uint32_t *sums = proxy_sums(ctx, i);
+        for (int x = 0, ox = 0; ox < out_width; ox++) {
+            int end = x + proxy < width ? x + proxy : width;
+            uint32_t sum = 0;
+            if (bytes == 1) {
+                for (; x < end; x++) {
+                    sum += rows[i][x];
+                }
+            } else {
+                const uint16_t *srcp = (const uint16_t *)rows[i];
+                for (; x < end; x++) {
+                    sum += srcp[x];
+                }
+            }
+            sums[ox] += sum;
         }
-        dstp0 += dst_stride;
-        dstp1 += dst_stride;
     }
-    
-    if (ih->enable_alpha == 0) {
-        vsapi->freeFrame(dst[1]);
-        dst[1] = NULL;
+
+    int block = row / proxy;
+    int block_rows = ctx->roi_height - block * proxy < proxy ?
+                     ctx->roi_height - block * proxy : proxy;
+    if (++ctx->proxy_count < block_rows) {
+        return;
+    }
+    ctx->proxy_count = 0;
+
+    for (int i = 0; i < num; i++) {
+        uint32_t *sums = proxy_sums(ctx, i);
+        uint8_t *dstp = planes[i] + block * stride;
+        for (int ox = 0; ox < out_width; ox++) {
+            int cols = width - ox * proxy < proxy ? width - ox * proxy : proxy;
+            uint32_t count = cols * block_rows;
+            uint32_t value = (sums[ox] + count / 2) / count;
+            if (bytes == 1) {
+                dstp[ox] = value;
+            } else {
+                ((uint16_t *)dstp)[ox] = value;
+            }
+            sums[ox] = 0;
+        }
     }
 }
 
 
+/* rows of the planes made by the writers. they are the rows of the frames
+   without proxy, and the scratch rows summed by next_row() with proxy. */
+typedef struct {
+    uint8_t *dstp[PROXY_MAX_PLANES];
+    uint8_t *planes[PROXY_MAX_PLANES]; // top rows of the planes
+    int stride;
+    int num;
+    int bytes;
+    int row; // row of the region made in dstp
+    int step; // -1 if the image is bottom up
+} dst_rows_t;
+
+
 static void VS_CC
-write_rgb24(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
-            const VSAPI *vsapi)
+init_dst_rows(dst_rows_t *dr, img_hnd_t *ih, img_ctx_t *ctx, int n,
+              uint8_t * const *planes, int stride, int num, int bytes,
+              int top)
 {
-    typedef struct {
-        uint8_t c[12];
-    } rgb24_t;
-
-    uint8_t *srcp_orig = ih->image_buff;
-    int row_size = (ih->src[n].width + 3) / 4;
-    int height = ih->src[n].height;
-    int src_stride = (ih->src[n].width * 3 + ih->row_adjust) & (~ih->row_adjust);
+    int flip = ih->src[n].flip;
+    dr->stride = stride;
+    dr->num = num;
+    dr->bytes = bytes;
+    dr->row = (flip ? ctx->height - 1 - top : top) - ctx->roi_top;
+    dr->step = flip ? -1 : 1;
+    for (int i = 0; i < num; i++) {
+        dr->planes[i] = planes[i];
+        dr->dstp[i] = ctx->proxy > 1 ? proxy_row(ctx, i)
+                                     : planes[i] + dr->row * stride;
+    }
+}
 
-    const int *order = (ih->misc & IMG_ORDER_RGB) ? rgb : bgr;
-    uint32_t *dstp0 = (uint32_t *)vsapi->getWritePtr(dst[0], order[0]);
-    uint32_t *dstp1 = (uint32_t *)vsapi->getWritePtr(dst[0], order[1]);
-    uint32_t *dstp2 = (uint32_t *)vsapi->getWritePtr(dst[0], order[2]);
-    int dst_stride = vsapi->getStride(dst[0], 0) / 4;
 
-    if (ih->src[n].flip) {
-        dstp0 += (height - 1) * dst_stride;
-        dstp1 += (height - 1) * dst_stride;
-        dstp2 += (height - 1) * dst_stride;
-        dst_stride *= -1;
+static inline void next_row(dst_rows_t *dr, img_ctx_t *ctx)
+{
+    if (ctx->proxy > 1) {
+        proxy_add_row(ctx, (const uint8_t * const *)dr->dstp, dr->planes,
+                      dr->stride, dr->num, dr->bytes, dr->row);
+    } else {
+        for (int i = 0; i < dr->num; i++) {
+            dr->dstp[i] += dr->step * dr->stride;
+        }
     }
+    dr->row += dr->step;
+}
 
-    for (int y = 0; y < height; y++) {
-        rgb24_t *srcp = (rgb24_t *)(srcp_orig + y * src_stride);
-        for (int x = 0; x < row_size; x++) {
-            dstp0[x] = bitor8to32(srcp[x].c[9], srcp[x].c[6],
-                                  srcp[x].c[3], srcp[x].c[0]);
-            dstp1[x] = bitor8to32(srcp[x].c[10], srcp[x].c[7],
-                                  srcp[x].c[4], srcp[x].c[1]);
-            dstp2[x] = bitor8to32(srcp[x].c[11], srcp[x].c[8],
-                                  srcp[x].c[5], srcp[x].c[2]);
+
+static void VS_CC
+write_planar(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+             VSCore *core, const VSAPI *vsapi)
+{
+    const VSFormat *format = ih->src[n].format;
+    int num = format->numPlanes;
+    int bytes = format->bytesPerSample;
+    uint8_t *srcp = ctx->image;
+    int top, height;
+    get_band(ctx, &top, &height);
+    int rtop = top, rheight = height;
+    int skip = clip_band(ih, ctx, n, &rtop, &rheight);
+
+    if (ctx->proxy > 1) {
+        /* the formats scaled by the writers are not subsampled */
+        int row_size = (ctx->width * bytes + ctx->row_adjust) & (~ctx->row_adjust);
+        uint8_t *planes[3] = { NULL };
+        for (int i = 0; i < num; i++) {
+            planes[i] = vsapi->getWritePtr(dst[0], i);
+        }
+        dst_rows_t dr;
+        init_dst_rows(&dr, ih, ctx, n, planes, vsapi->getStride(dst[0], 0),
+                      num, bytes, rtop);
+        for (int y = skip; y < skip + rheight; y++) {
+            const uint8_t *rows[3];
+            for (int i = 0; i < num; i++) {
+                rows[i] = srcp + ((size_t)i * height + y) * row_size +
+                          ctx->roi_left * bytes;
+            }
+            proxy_add_row(ctx, rows, planes, dr.stride, num, bytes, dr.row);
+            dr.row += dr.step;
+        }
+    } else if (rheight > 0) {
+        /* subsampled images are not banded nor bottom up, and their
+           regions are aligned to the subsampling */
+        int row = (ih->src[n].flip ? ctx->height - 1 - rtop : rtop) - ctx->roi_top;
+        for (int i = 0; i < num; i++) {
+            int ss_w = i ? format->subSamplingW : 0;
+            int ss_h = i ? format->subSamplingH : 0;
+            int row_size = ((ctx->width >> ss_w) * bytes + ctx->row_adjust)
+                           & (~ctx->row_adjust);
+            int dst_stride = vsapi->getStride(dst[0], i);
+            uint8_t *dstp = vsapi->getWritePtr(dst[0], i) +
+                            (row >> ss_h) * dst_stride;
+            if (ih->src[n].flip) {
+                dst_stride *= -1;
+            }
+            bit_blt(dstp, dst_stride,
+                    srcp + (skip >> ss_h) * row_size + (ctx->roi_left >> ss_w) * bytes,
+                    row_size, (ctx->roi_width >> ss_w) * bytes, rheight >> ss_h);
+            srcp += row_size * (height >> ss_h);
         }
-        dstp0 += dst_stride;
-        dstp1 += dst_stride;
-        dstp2 += dst_stride;
     }
     
-    if (ih->enable_alpha) {
-        set_dummy_alpha(ih, n, dst[1], core, vsapi);
+    if (ih->enable_alpha && is_last_band(ih, ctx, n, top, height)) {
+        set_dummy_alpha(ih, n, dst + 1, core, vsapi);
     }
 }
 
 
+/* splits each row of the packed image into the rows given by dr */
 static void VS_CC
-write_rgb32(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
-            const VSAPI *vsapi)
+deinterleave(func_deint_row deint, const uint8_t *srcp, int src_stride,
+             dst_rows_t *dr, img_ctx_t *ctx, int height)
 {
-    typedef struct {
-        uint8_t c[16];
-    } rgb32_t;
-
-    uint8_t *srcp_orig = ih->image_buff;
-    int row_size = (ih->src[n].width + 3) / 4;
-    int height = ih->src[n].height;
-    int src_stride = (ih->src[n].width * 4 + ih->row_adjust) & (~ih->row_adjust);
+    for (int y = 0; y < height; y++) {
+        deint(srcp, dr->dstp, ctx->roi_width);
+        srcp += src_stride;
+        next_row(dr, ctx);
+    }
+}
 
-    const int *order = (ih->misc & IMG_ORDER_RGB) ? rgb : bgr;
-    uint32_t *dstp0 = (uint32_t *)vsapi->getWritePtr(dst[0], order[0]);
-    uint32_t *dstp1 = (uint32_t *)vsapi->getWritePtr(dst[0], order[1]);
-    uint32_t *dstp2 = (uint32_t *)vsapi->getWritePtr(dst[0], order[2]);
-    int dst_stride = vsapi->getStride(dst[0], 0) / 4;
-    
-    dst[1] = vsapi->newVideoFrame(vsapi->getFormatPreset(pfGray8, core),
-                                  ih->src[n].width, ih->src[n].height,
-                                  NULL, core);
-    uint32_t *dstp3 = (uint32_t *)vsapi->getWritePtr(dst[1], 0);
 
-    if (ih->src[n].flip) {
-        dstp0 += (height - 1) * dst_stride;
-        dstp1 += (height - 1) * dst_stride;
-        dstp2 += (height - 1) * dst_stride;
-        dstp3 += (height - 1) * dst_stride;
-        dst_stride *= -1;
-    }
-    
-    for (int y = 0; y < height; y++) {
-        rgb32_t *srcp = (rgb32_t *)(srcp_orig + y * src_stride);
-        for (int x = 0; x < row_size; x++) {
-            dstp0[x] = bitor8to32(srcp[x].c[12], srcp[x].c[8],
-                                  srcp[x].c[4],  srcp[x].c[0]);
-            dstp1[x] = bitor8to32(srcp[x].c[13], srcp[x].c[9],
-                                  srcp[x].c[5],  srcp[x].c[1]);
-            dstp2[x] = bitor8to32(srcp[x].c[14], srcp[x].c[10],
-                                  srcp[x].c[6],  srcp[x].c[2]);
-            dstp3[x] = bitor8to32(srcp[x].c[15], srcp[x].c[11],
-                                  srcp[x].c[7],  srcp[x].c[3]);
-        }
-        dstp0 += dst_stride;
-        dstp1 += dst_stride;
-        dstp2 += dst_stride;
-        dstp3 += dst_stride;
+static void VS_CC
+write_gray_a(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+             VSCore *core, const VSAPI *vsapi, int bytes)
+{
+    const deint_kernels_t *dk = imgr_deint_kernels();
+    int src_stride = (ctx->width * 2 * bytes + ctx->row_adjust) & (~ctx->row_adjust);
+    int top, height;
+    get_band(ctx, &top, &height);
+
+    if (top == 0) {
+        VSPresetFormat pf = bytes == 1 ? pfGray8 : pfGray16;
+        dst[1] = vsapi->newVideoFrame(vsapi->getFormatPreset(pf, core),
+                                      ih->src[n].width, ih->src[n].height,
+                                      NULL, core);
     }
 
-    if (ih->enable_alpha == 0) {
+    uint8_t *planes[2] = {
+        vsapi->getWritePtr(dst[0], 0),
+        vsapi->getWritePtr(dst[1], 0)
+    };
+    dst_rows_t dr;
+    int rtop = top, rheight = height;
+    int skip = clip_band(ih, ctx, n, &rtop, &rheight);
+    init_dst_rows(&dr, ih, ctx, n, planes, vsapi->getStride(dst[0], 0), 2,
+                  bytes, rtop);
+    deinterleave(bytes == 1 ? dk->deint2_8 : dk->deint2_16,
+                 ctx->image + skip * src_stride + ctx->roi_left * 2 * bytes,
+                 src_stride, &dr, ctx, rheight);
+
+    if (ih->enable_alpha == 0 && is_last_band(ih, ctx, n, top, height)) {
         vsapi->freeFrame(dst[1]);
         dst[1] = NULL;
     }
@@ -274,134 +431,256 @@ write_rgb32(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
 
 
 static void VS_CC
-write_rgb48(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
-            const VSAPI *vsapi)
+write_gray8_a(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+              VSCore *core, const VSAPI *vsapi)
 {
-    typedef struct {
-        uint16_t c[3];
-    } rgb48_t;
-
-    uint8_t *srcp_orig = ih->image_buff;
-    int row_size = ih->src[n].width;
-    int height = ih->src[n].height;
-    int src_stride = (row_size * 6 + ih->row_adjust) & (~ih->row_adjust);
+    write_gray_a(ih, ctx, n, dst, core, vsapi, 1);
+}
 
-    const int *order = (ih->misc & IMG_ORDER_RGB) ? rgb : bgr;
-    uint16_t *dstp0 = (uint16_t *)vsapi->getWritePtr(dst[0], order[0]);
-    uint16_t *dstp1 = (uint16_t *)vsapi->getWritePtr(dst[0], order[1]);
-    uint16_t *dstp2 = (uint16_t *)vsapi->getWritePtr(dst[0], order[2]);
-    int dst_stride = vsapi->getStride(dst[0], 0) / 2;
 
-    for (int y = 0; y < height; y++) {
-        rgb48_t *srcp = (rgb48_t *)(srcp_orig + y * src_stride);
-        for (int x = 0; x < row_size; x++) {
-            dstp0[x] = srcp[x].c[0];
-            dstp1[x] = srcp[x].c[1];
-            dstp2[x] = srcp[x].c[2];
-        }
-        dstp0 += dst_stride;
-        dstp1 += dst_stride;
-        dstp2 += dst_stride;
-    }
-    
-    if (ih->enable_alpha) {
-        set_dummy_alpha(ih, n, dst[1], core, vsapi);
-    }
+static void VS_CC
+write_gray16_a(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+               VSCore *core, const VSAPI *vsapi)
+{
+    write_gray_a(ih, ctx, n, dst, core, vsapi, 2);
 }
 
 
+/* 3 or 4 components of 1 or 2 bytes. the 4th goes to the alpha frame. */
 static void VS_CC
-write_rgb64(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
-            const VSAPI *vsapi)
+write_rgb(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+          VSCore *core, const VSAPI *vsapi, int num, int bytes)
 {
-    typedef struct {
-        uint16_t c[4];
-    } rgb64_t;
+    const deint_kernels_t *dk = imgr_deint_kernels();
+    int src_stride = (ctx->width * num * bytes + ctx->row_adjust) & (~ctx->row_adjust);
+    int top, height;
+    get_band(ctx, &top, &height);
+
+    if (num == 4 && top == 0) {
+        VSPresetFormat pf = bytes == 1 ? pfGray8 : pfGray16;
+        dst[1] = vsapi->newVideoFrame(vsapi->getFormatPreset(pf, core),
+                                      ih->src[n].width, ih->src[n].height,
+                                      NULL, core);
+    }
 
-    uint8_t *srcp_orig = ih->image_buff;
-    int row_size = ih->src[n].width;
-    int height = ih->src[n].height;
-    int src_stride = (row_size * 8 + ih->row_adjust) & (~ih->row_adjust);
-    
-    const int *order = (ih->misc & IMG_ORDER_RGB) ? rgb : bgr;
-    uint16_t *dstp0 = (uint16_t *)vsapi->getWritePtr(dst[0], order[0]);
-    uint16_t *dstp1 = (uint16_t *)vsapi->getWritePtr(dst[0], order[1]);
-    uint16_t *dstp2 = (uint16_t *)vsapi->getWritePtr(dst[0], order[2]);
-    int dst_stride = vsapi->getStride(dst[0], 0) / 2;
-    
-    dst[1] = vsapi->newVideoFrame(vsapi->getFormatPreset(pfGray16, core),
-                                  ih->src[n].width, ih->src[n].height,
-                                  NULL, core);
-    uint16_t *dstp3 = (uint16_t *)vsapi->getWritePtr(dst[1], 0);
-    
-    for (int y = 0; y < height; y++) {
-        rgb64_t *srcp = (rgb64_t *)(srcp_orig + y * src_stride);
-        for (int x = 0; x < row_size; x++) {
-            dstp0[x] = srcp[x].c[0];
-            dstp1[x] = srcp[x].c[1];
-            dstp2[x] = srcp[x].c[2];
-            dstp3[x] = srcp[x].c[3];
-        }
-        dstp0 += dst_stride;
-        dstp1 += dst_stride;
-        dstp2 += dst_stride;
-        dstp3 += dst_stride;
+    const int *order = (ctx->misc & IMG_ORDER_RGB) ? rgb : bgr;
+    uint8_t *planes[4];
+    for (int i = 0; i < 3; i++) {
+        planes[i] = vsapi->getWritePtr(dst[0], order[i]);
     }
-    
-    if (ih->enable_alpha == 0) {
+    if (num == 4) {
+        planes[3] = vsapi->getWritePtr(dst[1], 0);
+    }
+    int rtop = top, rheight = height;
+    int skip = clip_band(ih, ctx, n, &rtop, &rheight);
+    dst_rows_t dr;
+    init_dst_rows(&dr, ih, ctx, n, planes, vsapi->getStride(dst[0], 0), num,
+                  bytes, rtop);
+
+    func_deint_row deint = bytes == 1 ? (num == 3 ? dk->deint3_8 : dk->deint4_8)
+                                      : (num == 3 ? dk->deint3_16 : dk->deint4_16);
+    deinterleave(deint,
+                 ctx->image + skip * src_stride + ctx->roi_left * num * bytes,
+                 src_stride, &dr, ctx, rheight);
+
+    if (!is_last_band(ih, ctx, n, top, height)) {
+        return;
+    }
+    if (num == 4 && ih->enable_alpha == 0) {
         vsapi->freeFrame(dst[1]);
         dst[1] = NULL;
+    } else if (num == 3 && ih->enable_alpha) {
+        set_dummy_alpha(ih, n, dst + 1, core, vsapi);
     }
 }
 
 
 static void VS_CC
-write_palette(img_hnd_t *ih, int n, VSFrameRef **dst, VSCore *core,
-              const VSAPI *vsapi)
+write_rgb24(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+            VSCore *core, const VSAPI *vsapi)
 {
-    color_palette_t *palette = ih->palettes;
-    int bits_per_pix = ih->misc & 0xFF;
+    write_rgb(ih, ctx, n, dst, core, vsapi, 3, 1);
+}
 
-    uint8_t *srcp_orig = ih->image_buff;
-    int row_size = ih->src[n].width;
-    int height = ih->src[n].height;
-    int src_stride = ((row_size * bits_per_pix + 7) / 8 + ih->row_adjust)
-                     & (~ih->row_adjust);
 
-    uint8_t *dstp_b = vsapi->getWritePtr(dst[0], 2);
-    uint8_t *dstp_g = vsapi->getWritePtr(dst[0], 1);
-    uint8_t *dstp_r = vsapi->getWritePtr(dst[0], 0);
-    int dst_stride = vsapi->getStride(dst[0], 0);
+static void VS_CC
+write_rgb32(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+            VSCore *core, const VSAPI *vsapi)
+{
+    write_rgb(ih, ctx, n, dst, core, vsapi, 4, 1);
+}
+
 
-    uint8_t mask = (1 << bits_per_pix) - 1;
+static void VS_CC
+write_rgb48(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+            VSCore *core, const VSAPI *vsapi)
+{
+    write_rgb(ih, ctx, n, dst, core, vsapi, 3, 2);
+}
 
-    for (int y = 0; y < height; y++) {
-        uint8_t *srcp = srcp_orig + y * src_stride;
-        for (int x = 0, shift = 8; x < row_size; x++) {
-            shift -= bits_per_pix;
-            dstp_b[x] = palette[(*srcp >> shift) & mask].blue;
-            dstp_g[x] = palette[(*srcp >> shift) & mask].green;
-            dstp_r[x] = palette[(*srcp >> shift) & mask].red;
-            if (shift < 1) {
-                shift = 8;
-                srcp++;
+
+static void VS_CC
+write_rgb64(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+            VSCore *core, const VSAPI *vsapi)
+{
+    write_rgb(ih, ctx, n, dst, core, vsapi, 4, 2);
+}
+
+
+#define PALETTE_CHUNK 256
+
+/* indices of 1/2/4/8 bits. each chunk of a row is expanded to bytes,
+   looked up into packed BGRA pixels and split into the planes. */
+static void VS_CC
+write_palette(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+              VSCore *core, const VSAPI *vsapi)
+{
+    const deint_kernels_t *dk = imgr_deint_kernels();
+    int bits_per_pix = ctx->misc & 0xFF;
+    int with_alpha = ih->enable_alpha && (ctx->misc & IMG_PALETTE_ALPHA);
+
+    int width = ctx->roi_width;
+    int src_stride = ((ctx->width * bits_per_pix + 7) / 8 + ctx->row_adjust)
+                     & (~ctx->row_adjust);
+    int top, height;
+    get_band(ctx, &top, &height);
+    int rtop = top, rheight = height;
+    int skip = clip_band(ih, ctx, n, &rtop, &rheight);
+
+    uint32_t palette[256];
+    memcpy(palette, ctx->palettes, sizeof(palette));
+
+    if (with_alpha && top == 0) {
+        dst[1] = vsapi->newVideoFrame(vsapi->getFormatPreset(pfGray8, core),
+                                      ih->src[n].width, ih->src[n].height,
+                                      NULL, core);
+    }
+
+    uint8_t *planes[4] = {
+        vsapi->getWritePtr(dst[0], 2),
+        vsapi->getWritePtr(dst[0], 1),
+        vsapi->getWritePtr(dst[0], 0),
+        with_alpha ? vsapi->getWritePtr(dst[1], 0) : NULL
+    };
+    dst_rows_t dr;
+    init_dst_rows(&dr, ih, ctx, n, planes, vsapi->getStride(dst[0], 0),
+                  with_alpha ? 4 : 3, 1, rtop);
+
+    uint8_t index[PALETTE_CHUNK + 8];
+    uint32_t pixels[PALETTE_CHUNK];
+    uint8_t no_alpha[PALETTE_CHUNK];
+
+    for (int y = skip; y < skip + rheight; y++) {
+        const uint8_t *srcp = ctx->image + y * src_stride;
+        for (int x = 0; x < width; x += PALETTE_CHUNK) {
+            int num = width - x < PALETTE_CHUNK ? width - x : PALETTE_CHUNK;
+            int sx = ctx->roi_left + x;
+            const uint8_t *idx = srcp + sx;
+            if (bits_per_pix < 8) {
+                /* the region may start in the middle of a byte */
+                int lead = sx * bits_per_pix % 8 / bits_per_pix;
+                imgr_unpack_indices(srcp + sx * bits_per_pix / 8, index,
+                                    num + lead, bits_per_pix);
+                idx = index + lead;
             }
+            dk->pal8(idx, palette, pixels, num);
+            uint8_t *rows[4] = {
+                dr.dstp[0] + x, dr.dstp[1] + x, dr.dstp[2] + x,
+                with_alpha ? dr.dstp[3] + x : no_alpha
+            };
+            dk->deint4_8((const uint8_t *)pixels, rows, num);
         }
-        dstp_b += dst_stride;
-        dstp_g += dst_stride;
-        dstp_r += dst_stride;
+        next_row(&dr, ctx);
     }
-    
-    if (ih->enable_alpha) {
-        set_dummy_alpha(ih, n, dst[1], core, vsapi);
+
+    if (ih->enable_alpha && !with_alpha &&
+        is_last_band(ih, ctx, n, top, height)) {
+        set_dummy_alpha(ih, n, dst + 1, core, vsapi);
+    }
+}
+#undef PALETTE_CHUNK
+
+
+/* 16 or 32bit pixels holding the channels given by ctx->bitfields */
+static void VS_CC
+write_bitfields(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,
+                VSCore *core, const VSAPI *vsapi)
+{
+    const deint_kernels_t *dk = imgr_deint_kernels();
+    const bitfields_t *bf = &ctx->bitfields;
+    int bits_per_pix = ctx->misc & 0xFF;
+    int with_alpha = ih->enable_alpha && bf->bits[3];
+
+    int src_stride = (ctx->width * bits_per_pix / 8 + ctx->row_adjust)
+                     & (~ctx->row_adjust);
+    int top, height;
+    get_band(ctx, &top, &height);
+
+    if (with_alpha && top == 0) {
+        dst[1] = vsapi->newVideoFrame(vsapi->getFormatPreset(pfGray8, core),
+                                      ih->src[n].width, ih->src[n].height,
+                                      NULL, core);
+    }
+
+    uint8_t *planes[4] = {
+        vsapi->getWritePtr(dst[0], 0),
+        vsapi->getWritePtr(dst[0], 1),
+        vsapi->getWritePtr(dst[0], 2),
+        with_alpha ? vsapi->getWritePtr(dst[1], 0) : NULL
+    };
+    int num_planes = with_alpha ? 4 : 3;
+    dst_rows_t dr;
+    int rtop = top, rheight = height;
+    int skip = clip_band(ih, ctx, n, &rtop, &rheight);
+    init_dst_rows(&dr, ih, ctx, n, planes, vsapi->getStride(dst[0], 0),
+                  num_planes, 1, rtop);
+
+    func_bitfield_row unpack = bits_per_pix == 16 ? dk->bitfield16
+                                                  : dk->bitfield32;
+    const uint8_t *srcp = ctx->image + ctx->roi_left * bits_per_pix / 8;
+    for (int y = skip; y < skip + rheight; y++) {
+        unpack(srcp + y * src_stride, dr.dstp, ctx->roi_width, num_planes,
+               bf);
+        next_row(&dr, ctx);
+    }
+
+    if (ih->enable_alpha && !with_alpha &&
+        is_last_band(ih, ctx, n, top, height)) {
+        set_dummy_alpha(ih, n, dst + 1, core, vsapi);
     }
 }
 
-const func_write_frame func_write_planar = write_planar;
-const func_write_frame func_write_gray8_a = write_gray8_a;
-const func_write_frame func_write_gray16_a = write_gray16_a;
-const func_write_frame func_write_rgb24 = write_rgb24;
-const func_write_frame func_write_rgb32 = write_rgb32;
-const func_write_frame func_write_rgb48 = write_rgb48;
-const func_write_frame func_write_rgb64 = write_rgb64;
-const func_write_frame func_write_palette = write_palette;
\ No newline at end of file
+/* the writers add their time to ctx->stats.write_ns, so that it is told
+   from the time of the decoders calling them */
+#define TIMED_WRITER(name)                                                  \
+static void VS_CC                                                           \
+timed_##name(img_hnd_t *ih, img_ctx_t *ctx, int n, VSFrameRef **dst,        \
+             VSCore *core, const VSAPI *vsapi)                              \
+{                                                                           \
+    int64_t start = imgr_now();                                             \
+    name(ih, ctx, n, dst, core, vsapi);                                     \
+    int64_t end = imgr_now();                                               \
+    ctx->stats.write_ns += end - start;                                     \
+    trace_event(ih->trace, #name, n, start, end);                           \
+}
+
+TIMED_WRITER(write_planar)
+TIMED_WRITER(write_gray8_a)
+TIMED_WRITER(write_gray16_a)
+TIMED_WRITER(write_rgb24)
+TIMED_WRITER(write_rgb32)
+TIMED_WRITER(write_rgb48)
+TIMED_WRITER(write_rgb64)
+TIMED_WRITER(write_palette)
+TIMED_WRITER(write_bitfields)
+#undef TIMED_WRITER
+
+const func_write_frame func_write_planar = timed_write_planar;
+const func_write_frame func_write_gray8_a = timed_write_gray8_a;
+const func_write_frame func_write_gray16_a = timed_write_gray16_a;
+const func_write_frame func_write_rgb24 = timed_write_rgb24;
+const func_write_frame func_write_rgb32 = timed_write_rgb32;
+const func_write_frame func_write_rgb48 = timed_write_rgb48;
+const func_write_frame func_write_rgb64 = timed_write_rgb64;
+const func_write_frame func_write_palette = timed_write_palette;
+const func_write_frame func_write_bitfields = timed_write_bitfields;